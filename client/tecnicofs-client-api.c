@@ -1,16 +1,110 @@
+#define _GNU_SOURCE
 #include "tecnicofs-client-api.h"
+#include "../tecnicofs-protocol.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 
-int clientfd;
-socklen_t servlen, clientlen;
-struct sockaddr_un serv_addr, client_addr;
-char clientPath[MAX_CLIENT_PATH];
+/* Bytes buffered from a stream connection while frames are reassembled */
+#define RECEIVE_BUFFER_SIZE (16 * TFS_MAX_MESSAGE)
+/* Memory shared with the server: slots, each taken by one read or write */
+#define SHARED_SLOTS 16
+#define SHARED_SLOT_SIZE (256 << 10)
+
+/* a ticket with a callback stays TICKET_CALLBACK from its response until its callback runs */
+typedef enum { TICKET_FREE, TICKET_PENDING, TICKET_DONE, TICKET_CALLBACK } ticket_state_t;
+
+/*
+ * Request in flight, in the slot ticket % TFS_MAX_IN_FLIGHT
+ */
+typedef struct ticket_slot {
+    tfs_ticket_t ticket;
+    ticket_state_t state;
+    int result;
+    tfs_callback_t callback;
+    void *arg;
+    /* where the results of a batch go, and how many are expected */
+    int *results;
+    int count;
+    /* where the bytes of a read go, and how many fit */
+    char *data;
+    size_t dataLength;
+} ticket_slot_t;
+
+/*
+ * State of a mount. Each mount has its own socket, so threads driving
+ * different mounts share nothing.
+ */
+struct tfs_mount {
+    /* socket to each shard of the server; a stream mount has one */
+    int clientfds[TFS_MAX_SHARDS];
+    int shardCount;
+    /* the socket to shard i > 0 is bound to clientPath followed by "-i" */
+    char clientPath[MAX_CLIENT_PATH];
+    /* whether the mount uses a stream connection instead of datagrams */
+    int streamMount;
+    /* whether requests are sent as text commands instead of binary messages */
+    int textProtocol;
+    /* queued batch: the request header and entry count, then the entries */
+    char batchMessage[TFS_MAX_MESSAGE];
+    size_t batchLength;
+    uint16_t batchCount;
+    int batchShard;
+
+    /*
+     * Requests in flight. Only one thread at a time receives, the one that
+     * set receiving, and it completes the tickets of every thread; the
+     * others wait on completed. sendLock keeps stream frames from
+     * interleaving.
+     */
+    pthread_mutex_t mountLock;
+    pthread_mutex_t sendLock;
+    pthread_cond_t completed;
+    ticket_slot_t tickets[TFS_MAX_IN_FLIGHT];
+    tfs_ticket_t nextTicket;
+    int receiving;
+    /* set when the connection fails, after which every request fails */
+    int broken;
+    /*
+     * Slots of the tickets whose callbacks are due, in the order they
+     * completed. They run once the locks are released, as a callback may
+     * submit requests itself.
+     */
+    int callbacks[TFS_MAX_IN_FLIGHT];
+    int callbackHead;
+    int callbackCount;
+    /* session holding the open files, opened by the first tfsOpen, or -1 */
+    int session;
+    pthread_mutex_t sessionLock;
+    /* memory shared with the session, NULL if the server did not take it */
+    char *shared;
+    /* bit i is set while slot i of shared is free, under sessionLock */
+    unsigned int sharedFree;
+    pthread_cond_t sharedReleased;
+    /* text responses on datagrams carry no id, so only one is in flight */
+    pthread_mutex_t textLock;
+    tfs_ticket_t textTicket;
+    /* partial frames received from a stream connection */
+    char receiveBuffer[RECEIVE_BUFFER_SIZE];
+    size_t receiveLength;
+};
+
+/* Mount used by the calls that take none */
+tfs_mount_t defaultMount;
+/* Distinguishes the client sockets of the mounts of a process */
+unsigned int mountCount = 0;
+/* Locks the thread holds while it waits for a request, which keep it from
+ * running callbacks that could take them again */
+__thread int locksHeld = 0;
 
 /*
  * Initializes the unix socket address.
@@ -30,139 +124,1455 @@ int setSocketAddress(char *path, struct sockaddr_un *addr) {
 }
 
 /*
- * Sends command to the server socket and returns 0 if it is successful.
+ * Completes a ticket with its result, queueing its callback if it has one.
+ * Must be called with mountLock held.
  */
-int sendCommand(const char *command) {
-    return sendto(clientfd, command, strlen(command) + 1, 0, (struct sockaddr *)&serv_addr, servlen) <= 0;
+void completeTicket(tfs_mount_t *mount, ticket_slot_t *slot, int result) {
+    slot->result = result;
+    if (slot->callback != NULL) {
+        slot->state = TICKET_CALLBACK;
+        mount->callbacks[(mount->callbackHead + mount->callbackCount++) % TFS_MAX_IN_FLIGHT] = slot - mount->tickets;
+    } else {
+        slot->state = TICKET_DONE;
+    }
+    pthread_cond_broadcast(&mount->completed);
 }
 
 /*
- * Receives response from the server socket, returns it if successful, if not it returns FAIL.
+ * Runs the callbacks due, freeing their tickets, unless the thread holds
+ * locks of the mount a callback might take. Must be called with mountLock
+ * held, which is released while each callback runs.
  */
-int receiveResponse() {
-    int response;
-    if (recvfrom(clientfd, &response, sizeof(int), 0, NULL, NULL) > 0)
-        return response;
+void runCallbacks(tfs_mount_t *mount) {
+    while (mount->callbackCount > 0 && locksHeld == 0) {
+        ticket_slot_t *slot = &mount->tickets[mount->callbacks[mount->callbackHead]];
+        tfs_callback_t callback = slot->callback;
+        tfs_ticket_t ticket = slot->ticket;
+        void *arg = slot->arg;
+        int result = slot->result;
 
-    return FAIL;
+        mount->callbackHead = (mount->callbackHead + 1) % TFS_MAX_IN_FLIGHT;
+        mount->callbackCount--;
+        slot->state = TICKET_FREE;
+        pthread_cond_broadcast(&mount->completed);
+
+        pthread_mutex_unlock(&mount->mountLock);
+        callback(ticket, result, arg);
+        pthread_mutex_lock(&mount->mountLock);
+    }
 }
 
 /*
- * Sends create command to the server socket.
+ * Fails every request in flight once the connection is lost. Must be
+ * called with mountLock held.
+ */
+void failTickets(tfs_mount_t *mount) {
+    mount->broken = 1;
+    for (int i = 0; i < TFS_MAX_IN_FLIGHT; i++) {
+        if (mount->tickets[i].state == TICKET_PENDING)
+            completeTicket(mount, &mount->tickets[i], FAIL);
+    }
+}
+
+/*
+ * Completes the ticket answered by a message.
  * Input:
- *  - name: path of node
- *  - nodeType: type of node
- * Returns: response from the server socket.
+ *  - ticket: id of the request answered
+ *  - message: the response
+ *  - length: length of the response
+ */
+void dispatchResponse(tfs_mount_t *mount, tfs_ticket_t ticket, const char *message, size_t length) {
+    int result = FAIL;
+    tfs_response response;
+
+    pthread_mutex_lock(&mount->mountLock);
+    if (mount->textProtocol && !mount->streamMount)
+        ticket = mount->textTicket;
+    else if (!mount->textProtocol) {
+        if (length < sizeof(response)) {
+            pthread_mutex_unlock(&mount->mountLock);
+            return;
+        }
+        memcpy(&response, message, sizeof(response));
+        ticket = response.id;
+    }
+
+    ticket_slot_t *slot = &mount->tickets[ticket % TFS_MAX_IN_FLIGHT];
+    /* answers to requests that were given up on are dropped */
+    if (slot->state != TICKET_PENDING || slot->ticket != ticket) {
+        pthread_mutex_unlock(&mount->mountLock);
+        return;
+    }
+
+    if (mount->textProtocol) {
+        if (length == sizeof(int))
+            memcpy(&result, message, sizeof(int));
+    } else if (response.magic != TFS_MAGIC) {
+        result = FAIL;
+    } else if (response.resultType == TFS_RESULT_DATA) {
+        result = response.result;
+        if (slot->data == NULL || (result > 0 && (result > slot->dataLength || length - sizeof(response) != result)))
+            result = FAIL;
+        else if (result > 0)
+            memcpy(slot->data, message + sizeof(response), result);
+    } else if (response.resultType != TFS_RESULT_VECTOR) {
+        result = slot->results == NULL ? response.result : FAIL;
+    } else if (slot->results != NULL && response.result == slot->count
+               && length == sizeof(response) + slot->count * sizeof(int32_t)) {
+        for (int i = 0; i < slot->count; i++) {
+            int32_t entry;
+            memcpy(&entry, message + sizeof(response) + i * sizeof(int32_t), sizeof(entry));
+            slot->results[i] = entry;
+        }
+        result = slot->count;
+    }
+
+    completeTicket(mount, slot, result);
+    pthread_mutex_unlock(&mount->mountLock);
+}
+
+/*
+ * Receives what the server socket holds and completes the tickets
+ * answered. Only the thread that set receiving may call it.
+ * Input:
+ *  - flags: MSG_DONTWAIT not to block, 0 otherwise
+ * Returns: 0, or 1 if the connection failed
+ */
+int receiveResponses(tfs_mount_t *mount, int flags) {
+    ssize_t n;
+
+    if (!mount->streamMount && mount->shardCount > 1) {
+        struct pollfd pfds[TFS_MAX_SHARDS];
+        for (int i = 0; i < mount->shardCount; i++) {
+            pfds[i].fd = mount->clientfds[i];
+            pfds[i].events = POLLIN;
+        }
+        if (poll(pfds, mount->shardCount, flags & MSG_DONTWAIT ? 0 : -1) < 0)
+            return errno != EINTR;
+
+        for (int i = 0; i < mount->shardCount; i++) {
+            char message[TFS_MAX_MESSAGE];
+            if (!(pfds[i].revents & POLLIN))
+                continue;
+            n = recv(mount->clientfds[i], message, sizeof(message), MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                return 1;
+            if (n >= 0)
+                dispatchResponse(mount, 0, message, n);
+        }
+        return 0;
+    }
+
+    if (!mount->streamMount) {
+        char message[TFS_MAX_MESSAGE];
+        do {
+            n = recv(mount->clientfds[0], message, sizeof(message), flags);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0)
+            return errno != EAGAIN;
+        dispatchResponse(mount, 0, message, n);
+        return 0;
+    }
+
+    do {
+        n = recv(mount->clientfds[0], mount->receiveBuffer + mount->receiveLength, RECEIVE_BUFFER_SIZE - mount->receiveLength, flags);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return errno != EAGAIN;
+    if (n == 0)
+        return 1;
+    mount->receiveLength += n;
+
+    size_t offset = 0;
+    tfs_frame_header header;
+    while (mount->receiveLength - offset >= sizeof(header)) {
+        memcpy(&header, mount->receiveBuffer + offset, sizeof(header));
+        if (header.length > TFS_MAX_MESSAGE)
+            return 1;
+        if (mount->receiveLength - offset < sizeof(header) + header.length)
+            break;
+        dispatchResponse(mount, header.id, mount->receiveBuffer + offset + sizeof(header), header.length);
+        offset += sizeof(header) + header.length;
+    }
+    memmove(mount->receiveBuffer, mount->receiveBuffer + offset, mount->receiveLength - offset);
+    mount->receiveLength -= offset;
+    return 0;
+}
+
+/*
+ * Makes progress on the requests in flight: runs the callbacks due, or
+ * receives responses if no other thread is, or else waits for that thread
+ * to complete some. Must be called with mountLock held.
+ */
+void progress(tfs_mount_t *mount) {
+    if (mount->callbackCount > 0 && locksHeld == 0) {
+        runCallbacks(mount);
+        return;
+    }
+    if (mount->receiving) {
+        pthread_cond_wait(&mount->completed, &mount->mountLock);
+        return;
+    }
+
+    mount->receiving = 1;
+    pthread_mutex_unlock(&mount->mountLock);
+    int failed = receiveResponses(mount, 0);
+    pthread_mutex_lock(&mount->mountLock);
+    mount->receiving = 0;
+    if (failed)
+        failTickets(mount);
+    pthread_cond_broadcast(&mount->completed);
+}
+
+/*
+ * Waits until the socket to a shard may take more bytes. Responses are
+ * received meanwhile, as the server may be blocked sending them; their
+ * callbacks are left to run once sendLock is released.
+ */
+void waitWritable(tfs_mount_t *mount, int shard) {
+    struct pollfd pfds[TFS_MAX_SHARDS];
+
+    pfds[0].fd = mount->clientfds[shard];
+    pfds[0].events = POLLOUT;
+    pthread_mutex_lock(&mount->mountLock);
+    if (mount->receiving || mount->broken) {
+        pthread_mutex_unlock(&mount->mountLock);
+        poll(pfds, 1, 10);
+        return;
+    }
+    mount->receiving = 1;
+    pthread_mutex_unlock(&mount->mountLock);
+
+    /* the socket to the shard comes first, the others only matter for reading */
+    int count = 1;
+    pfds[0].events |= POLLIN;
+    for (int i = 0; i < mount->shardCount; i++) {
+        if (i != shard) {
+            pfds[count].fd = mount->clientfds[i];
+            pfds[count++].events = POLLIN;
+        }
+    }
+    int readable = 0;
+    if (poll(pfds, count, -1) > 0) {
+        for (int i = 0; i < count; i++)
+            readable |= pfds[i].revents & POLLIN;
+    }
+    int failed = readable && receiveResponses(mount, MSG_DONTWAIT);
+
+    pthread_mutex_lock(&mount->mountLock);
+    mount->receiving = 0;
+    if (failed)
+        failTickets(mount);
+    pthread_cond_broadcast(&mount->completed);
+    pthread_mutex_unlock(&mount->mountLock);
+}
+
+/*
+ * Sends message to a shard of the server socket and returns 0 if it is
+ * successful. A descriptor other than -1 in passFd is passed along with it.
+ */
+int sendCommand(tfs_mount_t *mount, int shard, const void *message, size_t length, tfs_ticket_t ticket, int passFd) {
+    char frame[sizeof(tfs_frame_header) + TFS_MAX_MESSAGE];
+    char control[CMSG_SPACE(sizeof(int))];
+    const char *buffer = message;
+
+    if (mount->streamMount) {
+        tfs_frame_header header = { .length = length, .id = ticket };
+        memcpy(frame, &header, sizeof(header));
+        memcpy(frame + sizeof(header), message, length);
+        buffer = frame;
+        length += sizeof(header);
+    }
+
+    pthread_mutex_lock(&mount->sendLock);
+    while (length > 0) {
+        struct iovec iov = { .iov_base = (char *) buffer, .iov_len = length };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+        if (passFd >= 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+        }
+
+        ssize_t n = sendmsg(mount->clientfds[shard], &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EAGAIN) {
+            waitWritable(mount, shard);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        /* datagrams are sent whole, and the descriptor goes with the first bytes */
+        buffer += n;
+        length -= n;
+        passFd = -1;
+    }
+    pthread_mutex_unlock(&mount->sendLock);
+
+    pthread_mutex_lock(&mount->mountLock);
+    runCallbacks(mount);
+    pthread_mutex_unlock(&mount->mountLock);
+
+    return length > 0;
+}
+
+/*
+ * Picks the shard for a request on path. Paths in the same directory go
+ * to the same shard, so their requests are served by the same workers.
+ */
+int shardOf(tfs_mount_t *mount, const char *path) {
+    if (mount->shardCount == 1 || path == NULL)
+        return 0;
+
+    /* hash the parent, ignoring trailing slashes */
+    size_t end = strlen(path);
+    while (end > 0 && path[end - 1] == '/')
+        end--;
+    while (end > 0 && path[end - 1] != '/')
+        end--;
+    while (end > 0 && path[end - 1] == '/')
+        end--;
+
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < end; i++) {
+        hash ^= (unsigned char) path[i];
+        hash *= 16777619u;
+    }
+    return hash % mount->shardCount;
+}
+
+/*
+ * Appends a length-prefixed path to a binary request.
+ * Returns: the new length of the request, or 0 if the path does not fit
  */
-int tfsCreate(char *filename, char nodeType) {
-    char command[MAX_INPUT_SIZE];
-    if (sprintf(command, "c %s %c", filename, nodeType) < 0)
+size_t encodePath(char *message, size_t length, const char *path) {
+    uint16_t pathlen = strlen(path) + 1;
+
+    if (pathlen > MAX_FILE_NAME || length + sizeof(pathlen) + pathlen > TFS_MAX_MESSAGE)
+        return 0;
+
+    memcpy(message + length, &pathlen, sizeof(pathlen));
+    memcpy(message + length + sizeof(pathlen), path, pathlen);
+    return length + sizeof(pathlen) + pathlen;
+}
+
+/*
+ * Appends the arguments of an operation to a binary request.
+ * Input:
+ *  - message: the request
+ *  - length: length of the request so far
+ *  - path: first argument
+ *  - to: second path for moves, NULL otherwise
+ *  - nodeType: type of node for creates, '\0' otherwise
+ * Returns: the new length of the request, or 0 if the arguments do not fit
+ */
+size_t encodeArguments(char *message, size_t length, const char *path, const char *to, char nodeType) {
+    length = encodePath(message, length, path);
+    if (length && to != NULL)
+        length = encodePath(message, length, to);
+    if (length && nodeType != '\0') {
+        if (length == TFS_MAX_MESSAGE)
+            return 0;
+        message[length++] = nodeType;
+    }
+    return length;
+}
+
+/*
+ * Takes a ticket for a new request, waiting while its slot is still in use.
+ * Returns: the ticket, or FAIL if the connection was lost
+ */
+tfs_ticket_t takeTicket(tfs_mount_t *mount, tfs_callback_t callback, void *arg, int *results, int count) {
+    pthread_mutex_lock(&mount->mountLock);
+    while (!mount->broken && mount->tickets[mount->nextTicket % TFS_MAX_IN_FLIGHT].state != TICKET_FREE)
+        progress(mount);
+    if (mount->broken) {
+        pthread_mutex_unlock(&mount->mountLock);
         return FAIL;
+    }
+
+    tfs_ticket_t ticket = mount->nextTicket;
+    mount->nextTicket = (mount->nextTicket + 1) & INT_MAX;
+    ticket_slot_t *slot = &mount->tickets[ticket % TFS_MAX_IN_FLIGHT];
+    slot->ticket = ticket;
+    slot->state = TICKET_PENDING;
+    slot->callback = callback;
+    slot->arg = arg;
+    slot->results = results;
+    slot->count = count;
+    slot->data = NULL;
+    pthread_mutex_unlock(&mount->mountLock);
 
-    if (sendCommand(command))
+    return ticket;
+}
+
+/*
+ * Gives up a ticket whose request could not be sent.
+ */
+void dropTicket(tfs_mount_t *mount, tfs_ticket_t ticket) {
+    pthread_mutex_lock(&mount->mountLock);
+    mount->tickets[ticket % TFS_MAX_IN_FLIGHT].state = TICKET_FREE;
+    pthread_cond_broadcast(&mount->completed);
+    pthread_mutex_unlock(&mount->mountLock);
+}
+
+/*
+ * Encodes a request in the protocol in use and sends it.
+ * Input:
+ *  - opcode: operation to request
+ *  - command: letter of the operation in the text protocol
+ *  - path: first argument, NULL if there are none
+ *  - to: second path for moves, NULL otherwise
+ *  - nodeType: type of node for creates, '\0' otherwise
+ *  - callback: function to run on completion, or NULL to wait for it
+ *  - arg: argument given to the callback
+ * Returns: ticket of the request, or FAIL
+ */
+tfs_ticket_t submit(tfs_mount_t *mount, tfs_opcode opcode, char command, const char *path, const char *to, char nodeType,
+                    tfs_callback_t callback, void *arg) {
+    char message[TFS_MAX_MESSAGE];
+    size_t length;
+    tfs_ticket_t ticket = takeTicket(mount, callback, arg, NULL, 0);
+
+    if (ticket == FAIL)
+        return FAIL;
+
+    if (mount->textProtocol) {
+        int n;
+        if (nodeType != '\0')
+            n = snprintf(message, MAX_INPUT_SIZE, "%c %s %c", command, path, nodeType);
+        else if (to != NULL)
+            n = snprintf(message, MAX_INPUT_SIZE, "%c %s %s", command, path, to);
+        else
+            n = snprintf(message, MAX_INPUT_SIZE, "%c %s", command, path);
+        length = n < 0 || n >= MAX_INPUT_SIZE ? 0 : n + 1;
+    } else {
+        tfs_request_header header = {
+            .magic = TFS_MAGIC,
+            .version = TFS_VERSION,
+            .opcode = opcode,
+            .id = ticket
+        };
+        memcpy(message, &header, sizeof(header));
+        length = path == NULL ? sizeof(header) : encodeArguments(message, sizeof(header), path, to, nodeType);
+    }
+
+    if (length == 0 || sendCommand(mount, shardOf(mount, path), message, length, ticket, -1)) {
+        dropTicket(mount, ticket);
         return FAIL;
+    }
 
-    return receiveResponse();
+    return ticket;
 }
 
 /*
- * Sends delete command to the server socket.
+ * Sends a request and waits for its response.
+ * Returns: response from the server socket.
+ */
+int request(tfs_mount_t *mount, tfs_opcode opcode, char command, const char *path, const char *to, char nodeType) {
+    /* text responses on datagrams carry no id */
+    if (mount->textProtocol && !mount->streamMount) {
+        pthread_mutex_lock(&mount->textLock);
+        locksHeld++;
+        pthread_mutex_lock(&mount->mountLock);
+        mount->textTicket = mount->nextTicket;
+        pthread_mutex_unlock(&mount->mountLock);
+    }
+
+    tfs_ticket_t ticket = submit(mount, opcode, command, path, to, nodeType, NULL, NULL);
+    int result = ticket == FAIL ? FAIL : tfsWaitOn(mount, ticket);
+
+    if (mount->textProtocol && !mount->streamMount) {
+        locksHeld--;
+        pthread_mutex_unlock(&mount->textLock);
+    }
+    return result;
+}
+
+/*
+ * Selects the protocol of the requests.
+ * Input:
+ *  - mount: mount to configure
+ *  - text: 1 to send text commands, 0 to send binary messages
+ */
+void tfsSetTextProtocolOn(tfs_mount_t *mount, int text) {
+    mount->textProtocol = text;
+}
+
+/*
+ * Sends create command to the server socket.
  * Input:
+ *  - mount: mount to send it on
  *  - name: path of node
+ *  - nodeType: type of node
  * Returns: response from the server socket.
  */
-int tfsDelete(char *path) {
-    char command[MAX_INPUT_SIZE];
-    if (sprintf(command, "d %s", path) < 0)
-        return FAIL;
-    
-    if (sendCommand(command))
-        return FAIL;
+int tfsCreateOn(tfs_mount_t *mount, char *filename, char nodeType) {
+    return request(mount, TFS_OP_CREATE, 'c', filename, NULL, nodeType);
+}
 
-    return receiveResponse();
+/*
+ * Sends delete command to the server socket.
+ * Input:
+ *  - mount: mount to send it on
+ *  - name: path of node
+ * Returns: response from the server socket.
+ */
+int tfsDeleteOn(tfs_mount_t *mount, char *path) {
+    return request(mount, TFS_OP_DELETE, 'd', path, NULL, '\0');
 }
 
 /*
  * Sends move command to the server socket.
  * Input:
+ *  - mount: mount to send it on
  *  - from: path of node to move
  *  - to: destination path of node
  * Returns: response from the server socket.
  */
-int tfsMove(char *from, char *to) {
-    char command[MAX_INPUT_SIZE];
-    if (sprintf(command, "m %s %s", from, to) < 0)
-        return FAIL;
-    
-    if (sendCommand(command))
-        return FAIL;
-
-    return receiveResponse();
+int tfsMoveOn(tfs_mount_t *mount, char *from, char *to) {
+    return request(mount, TFS_OP_MOVE, 'm', from, to, '\0');
 }
 
 /*
  * Sends lookup command to the server socket.
  * Input:
+ *  - mount: mount to send it on
  *  - name: path of node
  * Returns: response from the server socket.
  */
-int tfsLookup(char *path) {
-    char command[MAX_INPUT_SIZE];
-    if (sprintf(command, "l %s", path) < 0)
+int tfsLookupOn(tfs_mount_t *mount, char *path) {
+    return request(mount, TFS_OP_LOOKUP, 'l', path, NULL, '\0');
+}
+
+/*
+ * Sends print command to the server socket.
+ * Input:
+ *  - mount: mount to send it on
+ *  - outputfile: path for the file to output the tree
+ * Returns: response from the server socket.
+ */
+int tfsPrintOn(tfs_mount_t *mount, char *outputfile) {
+    return request(mount, TFS_OP_PRINT, 'p', outputfile, NULL, '\0');
+}
+
+/*
+ * Sends stats command to the server socket.
+ * Input:
+ *  - mount: mount to send it on
+ *  - outputfile: path for the file to output the statistics
+ * Returns: response from the server socket.
+ */
+int tfsStatsOn(tfs_mount_t *mount, char *outputfile) {
+    return request(mount, TFS_OP_STATS, 's', outputfile, NULL, '\0');
+}
+
+/*
+ * Sends snapshot command to the server socket. The server answers once
+ * the snapshot began and writes it in the background: the image appears
+ * at imagefile when it is whole, and can be restored with -i.
+ * Input:
+ *  - mount: mount to send it on
+ *  - imagefile: path for the image of the tree
+ * Returns: response from the server socket.
+ */
+int tfsSnapshotOn(tfs_mount_t *mount, char *imagefile) {
+    return request(mount, TFS_OP_SNAPSHOT, 'i', imagefile, NULL, '\0');
+}
+
+/*
+ * The tfs*Async calls send the request of the matching tfs* call without
+ * waiting for it, which is only possible in the binary protocol or on a
+ * stream connection. When the response arrives, the callback, if any, is
+ * run with the ticket, the result and arg, in whichever thread received
+ * the response. Tickets without a callback must be given to tfsWait.
+ * Returns: the ticket of the request, or FAIL
+ */
+tfs_ticket_t submitAsync(tfs_mount_t *mount, tfs_opcode opcode, char command, const char *path, const char *to,
+                         char nodeType, tfs_callback_t callback, void *arg) {
+    if (mount->textProtocol && !mount->streamMount)
         return FAIL;
+    return submit(mount, opcode, command, path, to, nodeType, callback, arg);
+}
+
+tfs_ticket_t tfsCreateAsyncOn(tfs_mount_t *mount, char *path, char nodeType, tfs_callback_t callback, void *arg) {
+    return submitAsync(mount, TFS_OP_CREATE, 'c', path, NULL, nodeType, callback, arg);
+}
+
+tfs_ticket_t tfsDeleteAsyncOn(tfs_mount_t *mount, char *path, tfs_callback_t callback, void *arg) {
+    return submitAsync(mount, TFS_OP_DELETE, 'd', path, NULL, '\0', callback, arg);
+}
+
+tfs_ticket_t tfsMoveAsyncOn(tfs_mount_t *mount, char *from, char *to, tfs_callback_t callback, void *arg) {
+    return submitAsync(mount, TFS_OP_MOVE, 'm', from, to, '\0', callback, arg);
+}
+
+tfs_ticket_t tfsLookupAsyncOn(tfs_mount_t *mount, char *path, tfs_callback_t callback, void *arg) {
+    return submitAsync(mount, TFS_OP_LOOKUP, 'l', path, NULL, '\0', callback, arg);
+}
+
+tfs_ticket_t tfsPrintAsyncOn(tfs_mount_t *mount, char *outputfile, tfs_callback_t callback, void *arg) {
+    return submitAsync(mount, TFS_OP_PRINT, 'p', outputfile, NULL, '\0', callback, arg);
+}
+
+tfs_ticket_t tfsStatsAsyncOn(tfs_mount_t *mount, char *outputfile, tfs_callback_t callback, void *arg) {
+    return submitAsync(mount, TFS_OP_STATS, 's', outputfile, NULL, '\0', callback, arg);
+}
 
-    if(sendCommand(command))
+tfs_ticket_t tfsSnapshotAsyncOn(tfs_mount_t *mount, char *imagefile, tfs_callback_t callback, void *arg) {
+    return submitAsync(mount, TFS_OP_SNAPSHOT, 'i', imagefile, NULL, '\0', callback, arg);
+}
+
+/*
+ * Waits for the response to a request sent without a callback.
+ * Input:
+ *  - mount: mount the request was sent on
+ *  - ticket: ticket of the request
+ * Returns: response from the server socket.
+ */
+int tfsWaitOn(tfs_mount_t *mount, tfs_ticket_t ticket) {
+    int result = FAIL;
+
+    if (ticket < 0)
         return FAIL;
 
-    return receiveResponse();
+    pthread_mutex_lock(&mount->mountLock);
+    ticket_slot_t *slot = &mount->tickets[ticket % TFS_MAX_IN_FLIGHT];
+    while (slot->ticket == ticket && slot->state == TICKET_PENDING)
+        progress(mount);
+
+    if (slot->ticket == ticket && slot->state == TICKET_DONE) {
+        result = slot->result;
+        slot->state = TICKET_FREE;
+        pthread_cond_broadcast(&mount->completed);
+    }
+    pthread_mutex_unlock(&mount->mountLock);
+
+    return result;
 }
 
 /*
- * Sends print command to the server socket.
+ * Receives the responses that have already arrived, without blocking,
+ * running their callbacks.
+ * Returns: SUCCESS, or FAIL if the connection was lost
+ */
+int tfsPollOn(tfs_mount_t *mount) {
+    pthread_mutex_lock(&mount->mountLock);
+    if (!mount->receiving && !mount->broken) {
+        mount->receiving = 1;
+        pthread_mutex_unlock(&mount->mountLock);
+        int failed = receiveResponses(mount, MSG_DONTWAIT);
+        pthread_mutex_lock(&mount->mountLock);
+        mount->receiving = 0;
+        if (failed)
+            failTickets(mount);
+        pthread_cond_broadcast(&mount->completed);
+    }
+    runCallbacks(mount);
+    int result = mount->broken ? FAIL : SUCCESS;
+    pthread_mutex_unlock(&mount->mountLock);
+
+    return result;
+}
+
+/*
+ * Waits until every request with a callback has completed.
+ * Returns: SUCCESS, or FAIL if the connection was lost
+ */
+int tfsWaitAllOn(tfs_mount_t *mount) {
+    pthread_mutex_lock(&mount->mountLock);
+    for (int i = 0; i < TFS_MAX_IN_FLIGHT; i++) {
+        while (mount->tickets[i].state == TICKET_PENDING && mount->tickets[i].callback != NULL)
+            progress(mount);
+    }
+    runCallbacks(mount);
+    int result = mount->broken ? FAIL : SUCCESS;
+    pthread_mutex_unlock(&mount->mountLock);
+
+    return result;
+}
+
+/*
+ * Starts a new batch, dropping the entries queued so far. A batch is
+ * built by one thread at a time.
+ */
+void tfsBatchBeginOn(tfs_mount_t *mount) {
+    mount->batchLength = sizeof(tfs_request_header) + sizeof(uint16_t);
+    mount->batchCount = 0;
+}
+
+/*
+ * Queues an operation in the batch.
  * Input:
- *  - outputfile: path for the file to output the tree
+ *  - mount: mount whose batch to queue it in
+ *  - opcode: operation to queue
+ *  - path: first argument
+ *  - to: second path for moves, NULL otherwise
+ *  - nodeType: type of node for creates, '\0' otherwise
+ * Returns: index of the operation in the batch, or FAIL if the batch is full
+ */
+int batchQueue(tfs_mount_t *mount, tfs_opcode opcode, const char *path, const char *to, char nodeType) {
+    if (mount->batchCount == TFS_MAX_BATCH || mount->batchLength == TFS_MAX_MESSAGE)
+        return FAIL;
+
+    if (mount->batchCount == 0)
+        mount->batchShard = shardOf(mount, path);
+    mount->batchMessage[mount->batchLength] = opcode;
+    size_t length = encodeArguments(mount->batchMessage, mount->batchLength + 1, path, to, nodeType);
+    if (length == 0)
+        return FAIL;
+
+    mount->batchLength = length;
+    return mount->batchCount++;
+}
+
+/*
+ * Queue the operation of the matching tfs* call, see batchQueue.
+ */
+int tfsBatchCreateOn(tfs_mount_t *mount, char *path, char nodeType) {
+    return batchQueue(mount, TFS_OP_CREATE, path, NULL, nodeType);
+}
+
+int tfsBatchDeleteOn(tfs_mount_t *mount, char *path) {
+    return batchQueue(mount, TFS_OP_DELETE, path, NULL, '\0');
+}
+
+int tfsBatchMoveOn(tfs_mount_t *mount, char *from, char *to) {
+    return batchQueue(mount, TFS_OP_MOVE, from, to, '\0');
+}
+
+int tfsBatchLookupOn(tfs_mount_t *mount, char *path) {
+    return batchQueue(mount, TFS_OP_LOOKUP, path, NULL, '\0');
+}
+
+int tfsBatchPrintOn(tfs_mount_t *mount, char *outputfile) {
+    return batchQueue(mount, TFS_OP_PRINT, outputfile, NULL, '\0');
+}
+
+int tfsBatchStatsOn(tfs_mount_t *mount, char *outputfile) {
+    return batchQueue(mount, TFS_OP_STATS, outputfile, NULL, '\0');
+}
+
+int tfsBatchSnapshotOn(tfs_mount_t *mount, char *imagefile) {
+    return batchQueue(mount, TFS_OP_SNAPSHOT, imagefile, NULL, '\0');
+}
+
+/*
+ * Sends the queued batch in a single message and waits for the results,
+ * which are the same as the ones of the matching tfs* calls. Batches are
+ * always sent in the binary protocol. A new batch is started afterwards.
+ * Input:
+ *  - mount: mount whose batch to send
+ *  - results: where to store the result of each queued operation
+ * Returns: number of results, or FAIL
+ */
+int tfsBatchSendOn(tfs_mount_t *mount, int *results) {
+    tfs_ticket_t ticket = takeTicket(mount, NULL, NULL, results, mount->batchCount);
+    if (ticket == FAIL) {
+        tfsBatchBeginOn(mount);
+        return FAIL;
+    }
+
+    tfs_request_header header = {
+        .magic = TFS_MAGIC,
+        .version = TFS_VERSION,
+        .opcode = TFS_OP_BATCH,
+        .id = ticket
+    };
+    memcpy(mount->batchMessage, &header, sizeof(header));
+    memcpy(mount->batchMessage + sizeof(header), &mount->batchCount, sizeof(mount->batchCount));
+    int failed = sendCommand(mount, mount->batchShard, mount->batchMessage, mount->batchLength, ticket, -1);
+    tfsBatchBeginOn(mount);
+    if (failed) {
+        dropTicket(mount, ticket);
+        return FAIL;
+    }
+
+    return tfsWaitOn(mount, ticket);
+}
+
+/*
+ * Appends an integer argument to a message being encoded.
+ */
+void encodeInteger(char *message, size_t *length, const void *value, size_t size) {
+    memcpy(message + *length, value, size);
+    *length += size;
+}
+
+/*
+ * Sends a file operation and waits for its response. File operations are
+ * only sent in the binary protocol.
+ * Input:
+ *  - opcode: operation to request
+ *  - path: path of the file to open, NULL for other operations
+ *  - mode: mode to open the file with
+ *  - fd: descriptor of the file, for operations on an open file, or the
+ *    memfd to share
+ *  - offset: offset to read or write at, or size to truncate to
+ *  - data: bytes to write, in the shared memory for shared writes, NULL
+ *    for other operations
+ *  - length: bytes to read, write or share, set to the ones that fit in
+ *    the request
+ *  - buffer: where the bytes read go, in the shared memory for shared
+ *    reads, NULL for other operations
  * Returns: response from the server socket.
  */
-int tfsPrint(char *outputfile) {
-    char command[MAX_INPUT_SIZE];
-    if (sprintf(command, "p %s", outputfile) < 0)
+int fileRequest(tfs_mount_t *mount, tfs_opcode opcode, const char *path, uint8_t mode, int32_t fd, uint64_t offset,
+                const char *data, uint32_t *length, char *buffer) {
+    char message[TFS_MAX_MESSAGE];
+    size_t messageLength = sizeof(tfs_request_header);
+    int32_t session = mount->session;
+    int shared = opcode == TFS_OP_READ_SHARED || opcode == TFS_OP_WRITE_SHARED;
+
+    if (mount->textProtocol)
+        return FAIL;
+    tfs_ticket_t ticket = takeTicket(mount, NULL, NULL, NULL, 0);
+    if (ticket == FAIL)
         return FAIL;
 
-    if(sendCommand(command))
+    tfs_request_header header = {
+        .magic = TFS_MAGIC,
+        .version = TFS_VERSION,
+        .opcode = opcode,
+        .id = ticket
+    };
+    memcpy(message, &header, sizeof(header));
+    if (path != NULL && (messageLength = encodePath(message, messageLength, path)) == 0) {
+        dropTicket(mount, ticket);
         return FAIL;
+    }
+    /* only a path and the bytes written can make a request too long */
+    if (messageLength + sizeof(mode) + sizeof(session) > TFS_MAX_MESSAGE) {
+        dropTicket(mount, ticket);
+        return FAIL;
+    }
+
+    int onFile = opcode != TFS_OP_MOUNT && opcode != TFS_OP_UNMOUNT && opcode != TFS_OP_OPEN &&
+                 opcode != TFS_OP_SHARE;
+    if (opcode == TFS_OP_OPEN)
+        message[messageLength++] = mode;
+    if (opcode != TFS_OP_MOUNT)
+        encodeInteger(message, &messageLength, &session, sizeof(session));
+    if (onFile)
+        encodeInteger(message, &messageLength, &fd, sizeof(fd));
+    if (opcode == TFS_OP_READ || opcode == TFS_OP_WRITE || opcode == TFS_OP_TRUNCATE || shared)
+        encodeInteger(message, &messageLength, &offset, sizeof(offset));
+    if (shared) {
+        uint32_t sharedOffset = (opcode == TFS_OP_READ_SHARED ? buffer : data) - mount->shared;
+        encodeInteger(message, &messageLength, &sharedOffset, sizeof(sharedOffset));
+    }
+    if (opcode == TFS_OP_READ && *length > TFS_MAX_READ)
+        *length = TFS_MAX_READ;
+    if (opcode == TFS_OP_WRITE || opcode == TFS_OP_APPEND) {
+        if (*length > TFS_MAX_MESSAGE - messageLength - sizeof(*length))
+            *length = TFS_MAX_MESSAGE - messageLength - sizeof(*length);
+    }
+    if (length != NULL)
+        encodeInteger(message, &messageLength, length, sizeof(*length));
+    if (opcode == TFS_OP_WRITE || opcode == TFS_OP_APPEND)
+        encodeInteger(message, &messageLength, data, *length);
+
+    if (opcode == TFS_OP_READ) {
+        pthread_mutex_lock(&mount->mountLock);
+        mount->tickets[ticket % TFS_MAX_IN_FLIGHT].data = buffer;
+        mount->tickets[ticket % TFS_MAX_IN_FLIGHT].dataLength = *length;
+        pthread_mutex_unlock(&mount->mountLock);
+    }
+
+    /* every shard serves every session, so descriptors spread over them */
+    int shard = path != NULL ? shardOf(mount, path) : (onFile ? fd : 0) % mount->shardCount;
+    if (sendCommand(mount, shard, message, messageLength, ticket, opcode == TFS_OP_SHARE ? fd : -1)) {
+        dropTicket(mount, ticket);
+        return FAIL;
+    }
+    return tfsWaitOn(mount, ticket);
+}
+
+/*
+ * Shares memory with the session of the mount, for reads and writes too
+ * big for one message. Without it they go through the socket.
+ */
+void shareMemory(tfs_mount_t *mount) {
+    uint32_t size = SHARED_SLOTS * SHARED_SLOT_SIZE;
+    int memfd = memfd_create("tfs-shared", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0)
+        return;
+
+    char *shared = MAP_FAILED;
+    if (ftruncate(memfd, size) == 0 && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0)
+        shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shared != MAP_FAILED && fileRequest(mount, TFS_OP_SHARE, NULL, 0, memfd, 0, NULL, &size, NULL) == SUCCESS) {
+        mount->sharedFree = (1u << SHARED_SLOTS) - 1;
+        __atomic_store_n(&mount->shared, shared, __ATOMIC_RELEASE);
+    } else if (shared != MAP_FAILED) {
+        munmap(shared, size);
+    }
+    close(memfd);
+}
+
+/*
+ * Takes a free slot of the shared memory, waiting for one if needed.
+ */
+char *takeSharedSlot(tfs_mount_t *mount) {
+    pthread_mutex_lock(&mount->sessionLock);
+    while (mount->sharedFree == 0)
+        pthread_cond_wait(&mount->sharedReleased, &mount->sessionLock);
+    int slot = __builtin_ctz(mount->sharedFree);
+    mount->sharedFree &= ~(1u << slot);
+    pthread_mutex_unlock(&mount->sessionLock);
+
+    return mount->shared + slot * SHARED_SLOT_SIZE;
+}
+
+void releaseSharedSlot(tfs_mount_t *mount, char *slot) {
+    pthread_mutex_lock(&mount->sessionLock);
+    mount->sharedFree |= 1u << ((slot - mount->shared) / SHARED_SLOT_SIZE);
+    pthread_cond_signal(&mount->sharedReleased);
+    pthread_mutex_unlock(&mount->sessionLock);
+}
+
+/*
+ * Returns whether the length bytes at buffer lie in the shared memory,
+ * in a slot taken with tfsBufferAcquireOn.
+ */
+int inSharedMemory(tfs_mount_t *mount, char *buffer, size_t length) {
+    char *shared = __atomic_load_n(&mount->shared, __ATOMIC_ACQUIRE);
+    return shared != NULL && buffer >= shared && length <= SHARED_SLOTS * SHARED_SLOT_SIZE &&
+           buffer - shared <= SHARED_SLOTS * SHARED_SLOT_SIZE - length;
+}
+
+/*
+ * Takes a slot of the memory shared with the session of the mount, for
+ * reads and writes on it that the server makes in place. It is there
+ * once the mount opened a file, and the server supports it.
+ * Input:
+ *  - mount: mount to take it from
+ *  - size: reference to store the size of the slot
+ * Returns: the slot, waiting for one to be free, or NULL if there is no
+ * shared memory
+ */
+char *tfsBufferAcquireOn(tfs_mount_t *mount, size_t *size) {
+    if (__atomic_load_n(&mount->shared, __ATOMIC_ACQUIRE) == NULL)
+        return NULL;
+    *size = SHARED_SLOT_SIZE;
+    return takeSharedSlot(mount);
+}
+
+/*
+ * Gives back a slot taken with tfsBufferAcquireOn.
+ */
+void tfsBufferReleaseOn(tfs_mount_t *mount, char *buffer) {
+    if (inSharedMemory(mount, buffer, SHARED_SLOT_SIZE))
+        releaseSharedSlot(mount, buffer);
+}
+
+/*
+ * Reads or writes a part of a transfer through a slot of the shared
+ * memory, copying the bytes between it and buffer.
+ * Returns: the number of bytes read or written, or an error code
+ */
+int sharedRequest(tfs_mount_t *mount, tfs_opcode opcode, int fd, uint64_t offset, char *buffer, uint32_t length) {
+    char *slot = takeSharedSlot(mount);
+
+    if (length > SHARED_SLOT_SIZE)
+        length = SHARED_SLOT_SIZE;
+    if (opcode == TFS_OP_WRITE_SHARED)
+        memcpy(slot, buffer, length);
+    int result = fileRequest(mount, opcode, NULL, 0, fd, offset, slot, &length, slot);
+    if (opcode == TFS_OP_READ_SHARED && result > 0)
+        memcpy(buffer, slot, result <= length ? result : length);
+
+    releaseSharedSlot(mount, slot);
+    return result;
+}
+
+/*
+ * Opens a file on the server, in the session of the mount.
+ * Input:
+ *  - mount: mount to send it on
+ *  - path: path of the file
+ *  - mode: READ, WRITE or RW
+ * Returns: the descriptor of the file, or an error code
+ */
+int tfsOpenOn(tfs_mount_t *mount, char *path, permission mode) {
+    pthread_mutex_lock(&mount->sessionLock);
+    if (mount->session < 0) {
+        locksHeld++;
+        int session = fileRequest(mount, TFS_OP_MOUNT, NULL, 0, 0, 0, NULL, NULL, NULL);
+        locksHeld--;
+        if (session < 0) {
+            pthread_mutex_unlock(&mount->sessionLock);
+            return session;
+        }
+        mount->session = session;
+        pthread_mutex_unlock(&mount->sessionLock);
+        shareMemory(mount);
+    } else {
+        pthread_mutex_unlock(&mount->sessionLock);
+    }
+
+    return fileRequest(mount, TFS_OP_OPEN, path, mode, 0, 0, NULL, NULL, NULL);
+}
+
+/*
+ * Closes an open file.
+ * Returns: SUCCESS or an error code
+ */
+int tfsCloseOn(tfs_mount_t *mount, int fd) {
+    return fileRequest(mount, TFS_OP_CLOSE, NULL, 0, fd, 0, NULL, NULL, NULL);
+}
 
-    return receiveResponse();
+/*
+ * Reads from a file open for reading, in as many requests as needed. A
+ * buffer taken with tfsBufferAcquireOn is read into in place.
+ * Input:
+ *  - mount: mount to send it on
+ *  - fd: descriptor of the file
+ *  - offset: where to start reading
+ *  - buffer: where to copy the bytes read
+ *  - length: most bytes to read
+ * Returns: the number of bytes read, or an error code
+ */
+int tfsReadOn(tfs_mount_t *mount, int fd, size_t offset, char *buffer, size_t length) {
+    size_t done = 0;
+
+    if (length > INT_MAX)
+        length = INT_MAX;
+    while (done < length) {
+        uint32_t chunk = length - done > UINT32_MAX ? UINT32_MAX : length - done;
+        int result;
+        if (inSharedMemory(mount, buffer + done, chunk)) {
+            result = fileRequest(mount, TFS_OP_READ_SHARED, NULL, 0, fd, offset + done, NULL, &chunk, buffer + done);
+        /* what does not fit in a message goes through the shared memory */
+        } else if (mount->shared != NULL && chunk > TFS_MAX_READ) {
+            chunk = chunk > SHARED_SLOT_SIZE ? SHARED_SLOT_SIZE : chunk;
+            result = sharedRequest(mount, TFS_OP_READ_SHARED, fd, offset + done, buffer + done, chunk);
+        } else {
+            result = fileRequest(mount, TFS_OP_READ, NULL, 0, fd, offset + done, NULL, &chunk, buffer + done);
+        }
+        if (result < 0)
+            return done > 0 ? done : result;
+        done += result;
+        /* the end of the file */
+        if (result < chunk)
+            break;
+    }
+    return done;
 }
 
 /*
- * Creates client socket and sets the server address from the path.
+ * Writes to a file open for writing, growing it if needed, in as many
+ * requests as needed. A buffer taken with tfsBufferAcquireOn is written
+ * from in place.
  * Input:
+ *  - mount: mount to send it on
+ *  - fd: descriptor of the file
+ *  - offset: where to start writing
+ *  - buffer: bytes to write
+ *  - length: number of bytes to write
+ * Returns: the number of bytes written, or an error code
+ */
+int tfsWriteOn(tfs_mount_t *mount, int fd, size_t offset, char *buffer, size_t length) {
+    size_t done = 0;
+
+    if (length > INT_MAX)
+        length = INT_MAX;
+    do {
+        uint32_t chunk = length - done > UINT32_MAX ? UINT32_MAX : length - done;
+        int result;
+        if (inSharedMemory(mount, buffer + done, chunk)) {
+            result = fileRequest(mount, TFS_OP_WRITE_SHARED, NULL, 0, fd, offset + done, buffer + done, &chunk, NULL);
+        } else if (mount->shared != NULL && chunk > TFS_MAX_READ) {
+            chunk = chunk > SHARED_SLOT_SIZE ? SHARED_SLOT_SIZE : chunk;
+            result = sharedRequest(mount, TFS_OP_WRITE_SHARED, fd, offset + done, buffer + done, chunk);
+        } else {
+            result = fileRequest(mount, TFS_OP_WRITE, NULL, 0, fd, offset + done, buffer + done, &chunk, NULL);
+        }
+        if (result < 0)
+            return done > 0 ? done : result;
+        done += result;
+    } while (done < length);
+    return done;
+}
+
+/*
+ * Writes at the end of a file open for writing. A write too big for one
+ * request is split, and others may append between its parts.
+ * Returns: the number of bytes written, or an error code
+ */
+int tfsAppendOn(tfs_mount_t *mount, int fd, char *buffer, size_t length) {
+    size_t done = 0;
+
+    if (length > INT_MAX)
+        length = INT_MAX;
+    do {
+        uint32_t chunk = length - done > UINT32_MAX ? UINT32_MAX : length - done;
+        int result = fileRequest(mount, TFS_OP_APPEND, NULL, 0, fd, 0, buffer + done, &chunk, NULL);
+        if (result < 0)
+            return done > 0 ? done : result;
+        done += result;
+    } while (done < length);
+    return done;
+}
+
+/*
+ * Sets the size of a file open for writing.
+ * Returns: SUCCESS or an error code
+ */
+int tfsTruncateOn(tfs_mount_t *mount, int fd, size_t size) {
+    return fileRequest(mount, TFS_OP_TRUNCATE, NULL, 0, fd, size, NULL, NULL, NULL);
+}
+
+/*
+ * Initializes the state of a mount whose socket is connected.
+ */
+void initMount(tfs_mount_t *mount, int streamMount) {
+    for (int i = 0; i < TFS_MAX_IN_FLIGHT; i++)
+        mount->tickets[i].state = TICKET_FREE;
+    mount->streamMount = streamMount;
+    mount->textProtocol = 0;
+    mount->nextTicket = 0;
+    mount->receiving = 0;
+    mount->broken = 0;
+    mount->callbackHead = 0;
+    mount->callbackCount = 0;
+    mount->session = -1;
+    mount->shared = NULL;
+    mount->receiveLength = 0;
+    tfsBatchBeginOn(mount);
+    pthread_mutex_init(&mount->mountLock, NULL);
+    pthread_mutex_init(&mount->sendLock, NULL);
+    pthread_mutex_init(&mount->textLock, NULL);
+    pthread_mutex_init(&mount->sessionLock, NULL);
+    pthread_cond_init(&mount->sharedReleased, NULL);
+    pthread_cond_init(&mount->completed, NULL);
+}
+
+/*
+ * Closes the sockets of the mount.
+ * Returns: SUCCESS or FAIL
+ */
+int closeShards(tfs_mount_t *mount) {
+    int result = SUCCESS;
+
+    for (int i = 0; i < mount->shardCount; i++) {
+        char path[MAX_CLIENT_PATH + 4];
+        if (close(mount->clientfds[i]))
+            result = FAIL;
+        if (mount->streamMount)
+            continue;
+        if (i == 0)
+            strcpy(path, mount->clientPath);
+        else
+            sprintf(path, "%s-%d", mount->clientPath, i);
+        if (unlink(path))
+            result = FAIL;
+    }
+    return result;
+}
+
+/*
+ * Creates the socket to a shard of the server, bound to a path of its
+ * own and connected to the shard.
+ * Input:
+ *  - mount: mount to add it to
  *  - sockPath: path of the server socket
+ *  - shard: the shard
  * Returns: SUCCESS or FAIL
  */
-int tfsMount(char *sockPath) {
-    clientfd = socket(AF_UNIX, SOCK_DGRAM, 0);
-    if (clientfd < 0)
+int openShard(tfs_mount_t *mount, char *sockPath, int shard) {
+    struct sockaddr_un serv_addr, client_addr;
+    char path[sizeof(serv_addr.sun_path)];
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+    if (fd < 0)
+        return FAIL;
+
+    if (shard == 0)
+        strcpy(path, mount->clientPath);
+    else
+        sprintf(path, "%s-%d", mount->clientPath, shard);
+    if (unlink(path) && errno != ENOENT) {
+        close(fd);
         return FAIL;
-    
-    if (sprintf(clientPath, "/tmp/tfs-client-%d", getpid()) < 0)
+    }
+
+    socklen_t clientlen = setSocketAddress(path, &client_addr);
+    if (bind(fd, (struct sockaddr *) &client_addr, clientlen)) {
+        close(fd);
         return FAIL;
+    }
 
-    if (unlink(clientPath) && errno != ENOENT)
+    int n = shard == 0 ? snprintf(path, sizeof(path), "%s", sockPath)
+                       : snprintf(path, sizeof(path), "%s-%d", sockPath, shard);
+    socklen_t servlen = setSocketAddress(path, &serv_addr);
+    /* a connected socket polls as writable only when the server has room */
+    if (n < 0 || n >= sizeof(path) || connect(fd, (struct sockaddr *) &serv_addr, servlen)) {
+        close(fd);
+        unlink(client_addr.sun_path);
         return FAIL;
-    
-    clientlen = setSocketAddress(clientPath, &client_addr);
-    if(bind(clientfd, (struct sockaddr *) &client_addr, clientlen))
-      return FAIL;
-    servlen = setSocketAddress(sockPath, &serv_addr);
+    }
 
+    mount->clientfds[shard] = fd;
     return SUCCESS;
 }
 
 /*
- * Unlinks the client socket.
+ * Connects to a server listening on datagram sockets, asking it how many
+ * shards it has and opening a socket to each of them.
+ * Input:
+ *  - mount: mount to set up
+ *  - sockPath: path of the server socket
  * Returns: SUCCESS or FAIL
  */
+int mountDgram(tfs_mount_t *mount, char *sockPath) {
+    unsigned int id = __atomic_fetch_add(&mountCount, 1, __ATOMIC_RELAXED);
+    if (snprintf(mount->clientPath, MAX_CLIENT_PATH, "/tmp/tfs-client-%d-%u", getpid(), id) >= MAX_CLIENT_PATH)
+        return FAIL;
+
+    if (strlen(sockPath) + 4 > sizeof(((struct sockaddr_un *) NULL)->sun_path) || openShard(mount, sockPath, 0))
+        return FAIL;
+    mount->shardCount = 1;
+    initMount(mount, 0);
+
+    int shards = request(mount, TFS_OP_SHARDS, '\0', NULL, NULL, '\0');
+    for (int i = 1; i < shards && i < TFS_MAX_SHARDS; i++) {
+        if (openShard(mount, sockPath, i)) {
+            closeShards(mount);
+            return FAIL;
+        }
+        mount->shardCount++;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Connects to a server listening on a stream socket.
+ * Input:
+ *  - mount: mount to set up
+ *  - sockPath: path of the server socket
+ * Returns: SUCCESS or FAIL
+ */
+int mountStream(tfs_mount_t *mount, char *sockPath) {
+    struct sockaddr_un serv_addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return FAIL;
+
+    socklen_t servlen = setSocketAddress(sockPath, &serv_addr);
+    if (connect(fd, (struct sockaddr *) &serv_addr, servlen)) {
+        close(fd);
+        return FAIL;
+    }
+
+    mount->clientfds[0] = fd;
+    mount->shardCount = 1;
+    initMount(mount, 1);
+    return SUCCESS;
+}
+
+/*
+ * Opens a new mount, independent from every other one.
+ * Input:
+ *  - sockPath: path of the server socket
+ *  - stream: 1 to connect to a stream socket, 0 for a datagram one
+ * Returns: the mount, or NULL if it fails
+ */
+tfs_mount_t *tfsMountOpen(char *sockPath, int stream) {
+    tfs_mount_t *mount = malloc(sizeof(tfs_mount_t));
+    if (mount == NULL)
+        return NULL;
+
+    if ((stream ? mountStream(mount, sockPath) : mountDgram(mount, sockPath)) == FAIL) {
+        free(mount);
+        return NULL;
+    }
+    return mount;
+}
+
+/*
+ * Closes a mount, with the files open in its session, and unlinks its
+ * client socket. Requests still in flight are dropped.
+ * Returns: SUCCESS or FAIL
+ */
+int tfsMountClose(tfs_mount_t *mount) {
+    /* a stream connection closes its session as it closes */
+    if (mount->session >= 0 && !mount->streamMount) {
+        mount->textProtocol = 0;
+        fileRequest(mount, TFS_OP_UNMOUNT, NULL, 0, 0, 0, NULL, NULL, NULL);
+    }
+    int result = closeShards(mount);
+    if (mount->shared != NULL)
+        munmap(mount->shared, SHARED_SLOTS * SHARED_SLOT_SIZE);
+
+    pthread_mutex_destroy(&mount->mountLock);
+    pthread_mutex_destroy(&mount->sendLock);
+    pthread_mutex_destroy(&mount->textLock);
+    pthread_mutex_destroy(&mount->sessionLock);
+    pthread_cond_destroy(&mount->sharedReleased);
+    pthread_cond_destroy(&mount->completed);
+    if (mount != &defaultMount)
+        free(mount);
+    return result;
+}
+
+/*
+ * The calls below act on the default mount.
+ */
+int tfsMount(char *sockPath) {
+    return mountDgram(&defaultMount, sockPath);
+}
+
+int tfsMountStream(char *sockPath) {
+    return mountStream(&defaultMount, sockPath);
+}
+
 int tfsUnmount() {
-    return unlink(clientPath);
+    return tfsMountClose(&defaultMount);
+}
+
+void tfsSetTextProtocol(int text) {
+    tfsSetTextProtocolOn(&defaultMount, text);
+}
+
+int tfsCreate(char *path, char nodeType) {
+    return tfsCreateOn(&defaultMount, path, nodeType);
+}
+
+int tfsDelete(char *path) {
+    return tfsDeleteOn(&defaultMount, path);
+}
+
+int tfsLookup(char *path) {
+    return tfsLookupOn(&defaultMount, path);
+}
+
+int tfsMove(char *from, char *to) {
+    return tfsMoveOn(&defaultMount, from, to);
+}
+
+int tfsPrint(char *outputfile) {
+    return tfsPrintOn(&defaultMount, outputfile);
+}
+
+int tfsStats(char *outputfile) {
+    return tfsStatsOn(&defaultMount, outputfile);
+}
+
+int tfsSnapshot(char *imagefile) {
+    return tfsSnapshotOn(&defaultMount, imagefile);
+}
+
+tfs_ticket_t tfsCreateAsync(char *path, char nodeType, tfs_callback_t callback, void *arg) {
+    return tfsCreateAsyncOn(&defaultMount, path, nodeType, callback, arg);
+}
+
+tfs_ticket_t tfsDeleteAsync(char *path, tfs_callback_t callback, void *arg) {
+    return tfsDeleteAsyncOn(&defaultMount, path, callback, arg);
+}
+
+tfs_ticket_t tfsLookupAsync(char *path, tfs_callback_t callback, void *arg) {
+    return tfsLookupAsyncOn(&defaultMount, path, callback, arg);
+}
+
+tfs_ticket_t tfsMoveAsync(char *from, char *to, tfs_callback_t callback, void *arg) {
+    return tfsMoveAsyncOn(&defaultMount, from, to, callback, arg);
+}
+
+tfs_ticket_t tfsPrintAsync(char *outputfile, tfs_callback_t callback, void *arg) {
+    return tfsPrintAsyncOn(&defaultMount, outputfile, callback, arg);
+}
+
+tfs_ticket_t tfsStatsAsync(char *outputfile, tfs_callback_t callback, void *arg) {
+    return tfsStatsAsyncOn(&defaultMount, outputfile, callback, arg);
+}
+
+tfs_ticket_t tfsSnapshotAsync(char *imagefile, tfs_callback_t callback, void *arg) {
+    return tfsSnapshotAsyncOn(&defaultMount, imagefile, callback, arg);
+}
+
+int tfsOpen(char *path, permission mode) {
+    return tfsOpenOn(&defaultMount, path, mode);
+}
+
+int tfsClose(int fd) {
+    return tfsCloseOn(&defaultMount, fd);
+}
+
+int tfsRead(int fd, size_t offset, char *buffer, size_t length) {
+    return tfsReadOn(&defaultMount, fd, offset, buffer, length);
+}
+
+int tfsWrite(int fd, size_t offset, char *buffer, size_t length) {
+    return tfsWriteOn(&defaultMount, fd, offset, buffer, length);
+}
+
+int tfsAppend(int fd, char *buffer, size_t length) {
+    return tfsAppendOn(&defaultMount, fd, buffer, length);
+}
+
+int tfsTruncate(int fd, size_t size) {
+    return tfsTruncateOn(&defaultMount, fd, size);
+}
+
+char *tfsBufferAcquire(size_t *size) {
+    return tfsBufferAcquireOn(&defaultMount, size);
+}
+
+void tfsBufferRelease(char *buffer) {
+    tfsBufferReleaseOn(&defaultMount, buffer);
+}
+
+int tfsWait(tfs_ticket_t ticket) {
+    return tfsWaitOn(&defaultMount, ticket);
+}
+
+int tfsPoll() {
+    return tfsPollOn(&defaultMount);
+}
+
+int tfsWaitAll() {
+    return tfsWaitAllOn(&defaultMount);
+}
+
+void tfsBatchBegin() {
+    tfsBatchBeginOn(&defaultMount);
+}
+
+int tfsBatchCreate(char *path, char nodeType) {
+    return tfsBatchCreateOn(&defaultMount, path, nodeType);
+}
+
+int tfsBatchDelete(char *path) {
+    return tfsBatchDeleteOn(&defaultMount, path);
+}
+
+int tfsBatchLookup(char *path) {
+    return tfsBatchLookupOn(&defaultMount, path);
+}
+
+int tfsBatchMove(char *from, char *to) {
+    return tfsBatchMoveOn(&defaultMount, from, to);
+}
+
+int tfsBatchPrint(char *outputfile) {
+    return tfsBatchPrintOn(&defaultMount, outputfile);
+}
+
+int tfsBatchStats(char *outputfile) {
+    return tfsBatchStatsOn(&defaultMount, outputfile);
+}
+
+int tfsBatchSnapshot(char *imagefile) {
+    return tfsBatchSnapshotOn(&defaultMount, imagefile);
+}
+
+int tfsBatchSend(int *results) {
+    return tfsBatchSendOn(&defaultMount, results);
 }
@@ -1,18 +1,104 @@
 #ifndef API_H
 #define API_H
 
+#include <stddef.h>
 #include "../tecnicofs-api-constants.h"
 
 #define SUCCESS 0
 #define FAIL -1
-#define MAX_CLIENT_PATH 22
+#define MAX_CLIENT_PATH 40
+/* Most asynchronous requests in flight on a mount */
+#define TFS_MAX_IN_FLIGHT 1024
+
+/* Identifies an asynchronous request */
+typedef int tfs_ticket_t;
+/*
+ * Run when an asynchronous request completes. It must not wait for other
+ * requests, as it runs in the thread receiving the responses.
+ */
+typedef void (*tfs_callback_t)(tfs_ticket_t ticket, int result, void *arg);
+
+/*
+ * Connection to a server. The tfs*On calls act on the mount given, the
+ * others on a default mount, set up by tfsMount or tfsMountStream.
+ */
+typedef struct tfs_mount tfs_mount_t;
 
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsPrint(char *outputfile);
+int tfsStats(char *outputfile);
+int tfsSnapshot(char *imagefile);
+int tfsOpen(char *path, permission mode);
+int tfsClose(int fd);
+int tfsRead(int fd, size_t offset, char *buffer, size_t length);
+int tfsWrite(int fd, size_t offset, char *buffer, size_t length);
+int tfsAppend(int fd, char *buffer, size_t length);
+int tfsTruncate(int fd, size_t size);
+char *tfsBufferAcquire(size_t *size);
+void tfsBufferRelease(char *buffer);
 int tfsMount(char *serverName);
+int tfsMountStream(char *serverName);
 int tfsUnmount();
+void tfsSetTextProtocol(int text);
+tfs_ticket_t tfsCreateAsync(char *path, char nodeType, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsDeleteAsync(char *path, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsLookupAsync(char *path, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsMoveAsync(char *from, char *to, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsPrintAsync(char *outputfile, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsStatsAsync(char *outputfile, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsSnapshotAsync(char *imagefile, tfs_callback_t callback, void *arg);
+int tfsWait(tfs_ticket_t ticket);
+int tfsPoll();
+int tfsWaitAll();
+void tfsBatchBegin();
+int tfsBatchCreate(char *path, char nodeType);
+int tfsBatchDelete(char *path);
+int tfsBatchLookup(char *path);
+int tfsBatchMove(char *from, char *to);
+int tfsBatchPrint(char *outputfile);
+int tfsBatchStats(char *outputfile);
+int tfsBatchSnapshot(char *imagefile);
+int tfsBatchSend(int *results);
+
+tfs_mount_t *tfsMountOpen(char *serverName, int stream);
+int tfsMountClose(tfs_mount_t *mount);
+void tfsSetTextProtocolOn(tfs_mount_t *mount, int text);
+int tfsCreateOn(tfs_mount_t *mount, char *path, char nodeType);
+int tfsDeleteOn(tfs_mount_t *mount, char *path);
+int tfsLookupOn(tfs_mount_t *mount, char *path);
+int tfsMoveOn(tfs_mount_t *mount, char *from, char *to);
+int tfsPrintOn(tfs_mount_t *mount, char *outputfile);
+int tfsStatsOn(tfs_mount_t *mount, char *outputfile);
+int tfsSnapshotOn(tfs_mount_t *mount, char *imagefile);
+int tfsOpenOn(tfs_mount_t *mount, char *path, permission mode);
+int tfsCloseOn(tfs_mount_t *mount, int fd);
+int tfsReadOn(tfs_mount_t *mount, int fd, size_t offset, char *buffer, size_t length);
+int tfsWriteOn(tfs_mount_t *mount, int fd, size_t offset, char *buffer, size_t length);
+int tfsAppendOn(tfs_mount_t *mount, int fd, char *buffer, size_t length);
+int tfsTruncateOn(tfs_mount_t *mount, int fd, size_t size);
+char *tfsBufferAcquireOn(tfs_mount_t *mount, size_t *size);
+void tfsBufferReleaseOn(tfs_mount_t *mount, char *buffer);
+tfs_ticket_t tfsCreateAsyncOn(tfs_mount_t *mount, char *path, char nodeType, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsDeleteAsyncOn(tfs_mount_t *mount, char *path, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsLookupAsyncOn(tfs_mount_t *mount, char *path, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsMoveAsyncOn(tfs_mount_t *mount, char *from, char *to, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsPrintAsyncOn(tfs_mount_t *mount, char *outputfile, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsStatsAsyncOn(tfs_mount_t *mount, char *outputfile, tfs_callback_t callback, void *arg);
+tfs_ticket_t tfsSnapshotAsyncOn(tfs_mount_t *mount, char *imagefile, tfs_callback_t callback, void *arg);
+int tfsWaitOn(tfs_mount_t *mount, tfs_ticket_t ticket);
+int tfsPollOn(tfs_mount_t *mount);
+int tfsWaitAllOn(tfs_mount_t *mount);
+void tfsBatchBeginOn(tfs_mount_t *mount);
+int tfsBatchCreateOn(tfs_mount_t *mount, char *path, char nodeType);
+int tfsBatchDeleteOn(tfs_mount_t *mount, char *path);
+int tfsBatchLookupOn(tfs_mount_t *mount, char *path);
+int tfsBatchMoveOn(tfs_mount_t *mount, char *from, char *to);
+int tfsBatchPrintOn(tfs_mount_t *mount, char *outputfile);
+int tfsBatchStatsOn(tfs_mount_t *mount, char *outputfile);
+int tfsBatchSnapshotOn(tfs_mount_t *mount, char *imagefile);
+int tfsBatchSendOn(tfs_mount_t *mount, int *results);
 
 #endif /* CLIENT_H */
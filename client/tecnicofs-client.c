@@ -1,25 +1,66 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-protocol.h"
 
 FILE* inputFile;
 char* serverName;
+int useStream = 0;
+int useText = 0;
+/* commands sent per message, 0 sends them one at a time */
+int batchSize = 0;
+
+typedef struct command {
+    char op;
+    char arg1[MAX_INPUT_SIZE];
+    char arg2[MAX_INPUT_SIZE];
+} command_t;
 
 static void displayUsage(const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s [-m dgram|stream] [-t | -b batchsize] inputfile server_socket_name\n", appName);
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs(long argc, char* const argv[]) {
-    if (argc != 3) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:tb:")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "stream") == 0)
+                    useStream = 1;
+                else if (strcmp(optarg, "dgram") == 0)
+                    useStream = 0;
+                else
+                    displayUsage(argv[0]);
+                break;
+            case 't':
+                useText = 1;
+                break;
+            case 'b':
+                batchSize = atoi(optarg);
+                if (batchSize < 1 || batchSize > TFS_MAX_BATCH)
+                    displayUsage(argv[0]);
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+
+    /* batches only exist in the binary protocol */
+    if (useText && batchSize > 0)
+        displayUsage(argv[0]);
+
+    if (argc - optind != 2) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
-    serverName = argv[2];
+    serverName = argv[optind + 1];
 
-    inputFile = fopen(argv[1], "r");
+    inputFile = fopen(argv[optind], "r");
 
     if (inputFile== NULL) {
         fprintf(stderr, "Error: cannot open input file\n");
@@ -27,93 +68,351 @@ static void parseArgs(long argc, char* const argv[]) {
     }
 }
 
+/*
+ * Parses the mode of an open or close command: r, w or rw.
+ * Returns: the mode, or NONE if it is invalid
+ */
+permission parseMode(char *mode) {
+    if (strcmp(mode, "r") == 0)
+        return READ;
+    if (strcmp(mode, "w") == 0)
+        return WRITE;
+    if (strcmp(mode, "rw") == 0)
+        return RW;
+    return NONE;
+}
+
 void errorParse() {
     fprintf(stderr, "Error: command invalid\n");
     exit(EXIT_FAILURE);
 }
 
-void *processInput() {
-    char line[MAX_INPUT_SIZE];
+/*
+ * Parses a line of the input file.
+ * Returns: 1 if it holds a command to run, 0 if it is to be skipped
+ */
+int parseCommand(char *line, command_t *command) {
+    int numTokens = sscanf(line, "%c %s %s", &command->op, command->arg1, command->arg2);
 
-    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
-        char op;
-        char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
-        int res;
+    /* perform minimal validation */
+    if (numTokens < 1) {
+        return 0;
+    }
+    switch (command->op) {
+        case 'c':
+            if(numTokens != 3)
+                errorParse();
+            if (command->arg2[0] != 'f' && command->arg2[0] != 'd') {
+                fprintf(stderr, "Error: invalid node type\n");
+                return 0;
+            }
+            return 1;
+        case 'l':
+        case 'd':
+        case 'p':
+        case 's':
+        case 'i':
+            if(numTokens != 2)
+                errorParse();
+            return 1;
+        case 'm':
+        case 'a':
+        case 'w':
+        case 't':
+            if(numTokens != 3)
+                errorParse();
+            return 1;
+        case 'o':
+            if(numTokens != 3)
+                errorParse();
+            if (parseMode(command->arg2) == NONE) {
+                fprintf(stderr, "Error: invalid mode\n");
+                return 0;
+            }
+            return 1;
+        case 'x':
+        case 'r':
+            if(numTokens != 2)
+                errorParse();
+            return 1;
+        case '#':
+            return 0;
+        default: { /* error */
+            errorParse();
+        }
+    }
+    return 0;
+}
 
-        int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
+/* contents of the file read by the last 'r' command */
+char readBuffer[MAX_INPUT_SIZE];
+/* path each descriptor was opened with, empty while it is closed */
+char openPaths[TFS_MAX_OPEN_FILES][MAX_INPUT_SIZE];
+permission openModes[TFS_MAX_OPEN_FILES];
 
-        /* perform minimal validation */
-        if (numTokens < 1) {
-            continue;
+/*
+ * Returns a descriptor of the file at path, preferably one whose mode
+ * allows access, or -1 if the file is not open.
+ */
+int descriptorOf(char *path, permission access) {
+    int found = -1;
+
+    for (int fd = 0; fd < TFS_MAX_OPEN_FILES; fd++) {
+        if (strcmp(openPaths[fd], path) == 0) {
+            if (openModes[fd] & access)
+                return fd;
+            if (found < 0)
+                found = fd;
         }
-        switch (op) {
-            case 'c':
-                if(numTokens != 3) {
-                    errorParse();
-                    break;
-                }
-                switch (arg2[0]) {
-                    case 'f':
-                        res = tfsCreate(arg1, 'f');
-                        if (!res)
-                          printf("Created file: %s\n", arg1);
-                        else
-                          printf("Unable to create file: %s\n", arg1);
-                        break;
-                    case 'd':
-                        res = tfsCreate(arg1, 'd');
-                        if (!res)
-                          printf("Created directory: %s\n", arg1);
-                        else
-                          printf("Unable to create directory: %s\n", arg1);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
-                }
-                break;
-            case 'l':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsLookup(arg1);
-                if (res >= 0)
-                    printf("Search: %s found\n", arg1);
-                else
-                    printf("Search: %s not found\n", arg1);
-                break;
-            case 'd':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsDelete(arg1);
-                if (!res)
-                  printf("Deleted: %s\n", arg1);
-                else
-                  printf("Unable to delete: %s\n", arg1);
-                break;
-            case 'm':
-                if(numTokens != 3)
-                    errorParse();
-                res = tfsMove(arg1, arg2);
+    }
+    return found;
+}
+
+/*
+ * Opens a file, remembering its descriptor for the commands that use it.
+ */
+int openFile(char *path, permission mode) {
+    int fd = tfsOpen(path, mode);
+    if (fd >= 0 && fd < TFS_MAX_OPEN_FILES) {
+        strcpy(openPaths[fd], path);
+        openModes[fd] = mode;
+    }
+    return fd;
+}
+
+/*
+ * Closes a descriptor opened by an 'o' command for path. A path that is
+ * not open is still sent, for the server to refuse.
+ */
+int closeFile(char *path) {
+    int fd = descriptorOf(path, NONE);
+    if (fd >= 0)
+        openPaths[fd][0] = '\0';
+    return tfsClose(fd);
+}
+
+/*
+ * Sends a command to the server and returns its result. File commands on
+ * a path that is not open go with descriptor -1, which the server refuses.
+ */
+int runCommand(command_t *command) {
+    int fd = descriptorOf(command->arg1, command->op == 'r' ? READ : WRITE);
+
+    switch (command->op) {
+        case 'o':
+            return openFile(command->arg1, parseMode(command->arg2));
+        case 'x':
+            return closeFile(command->arg1);
+        case 'a':
+            return tfsAppend(fd, command->arg2, strlen(command->arg2));
+        case 'w':
+            return tfsWrite(fd, 0, command->arg2, strlen(command->arg2));
+        case 't':
+            return tfsTruncate(fd, atol(command->arg2));
+        case 'r':
+            return tfsRead(fd, 0, readBuffer, sizeof(readBuffer) - 1);
+        case 'c':
+            return tfsCreate(command->arg1, command->arg2[0]);
+        case 'l':
+            return tfsLookup(command->arg1);
+        case 'd':
+            return tfsDelete(command->arg1);
+        case 'm':
+            return tfsMove(command->arg1, command->arg2);
+        case 'p':
+            return tfsPrint(command->arg1);
+        case 's':
+            return tfsStats(command->arg1);
+        case 'i':
+            return tfsSnapshot(command->arg1);
+    }
+    return -1;
+}
+
+/*
+ * Returns whether the command can be queued in a batch.
+ */
+int batchable(command_t *command) {
+    return strchr("cldmpsi", command->op) != NULL;
+}
+
+/*
+ * Queues a command in the batch.
+ * Returns: its index in the batch, or -1 if the batch is full
+ */
+int queueCommand(command_t *command) {
+    switch (command->op) {
+        case 'c':
+            return tfsBatchCreate(command->arg1, command->arg2[0]);
+        case 'l':
+            return tfsBatchLookup(command->arg1);
+        case 'd':
+            return tfsBatchDelete(command->arg1);
+        case 'm':
+            return tfsBatchMove(command->arg1, command->arg2);
+        case 'p':
+            return tfsBatchPrint(command->arg1);
+        case 's':
+            return tfsBatchStats(command->arg1);
+        case 'i':
+            return tfsBatchSnapshot(command->arg1);
+    }
+    return -1;
+}
+
+void printResult(command_t *command, int res) {
+    char *arg1 = command->arg1, *arg2 = command->arg2;
+
+    switch (command->op) {
+        case 'c':
+            if (arg2[0] == 'f') {
                 if (!res)
-                  printf("Moved: %s to %s\n", arg1, arg2);
+                  printf("Created file: %s\n", arg1);
                 else
-                  printf("Unable to move: %s to %s\n", arg1, arg2);
-                break;
-            case 'p':
-                if(numTokens != 2)
-                    errorParse();                
-                res = tfsPrint(arg1);
+                  printf("Unable to create file: %s\n", arg1);
+            } else {
                 if (!res)
-                  printf("Printed tecnicofs to: %s\n", arg1);
+                  printf("Created directory: %s\n", arg1);
                 else
-                  printf("Unable to print tecnicofs to: %s\n", arg1);
-                break;
-            case '#':
-                break;
-            default: { /* error */
-                errorParse();
+                  printf("Unable to create directory: %s\n", arg1);
+            }
+            break;
+        case 'l':
+            if (res >= 0)
+                printf("Search: %s found\n", arg1);
+            else
+                printf("Search: %s not found\n", arg1);
+            break;
+        case 'd':
+            if (!res)
+              printf("Deleted: %s\n", arg1);
+            else
+              printf("Unable to delete: %s\n", arg1);
+            break;
+        case 'm':
+            if (!res)
+              printf("Moved: %s to %s\n", arg1, arg2);
+            else
+              printf("Unable to move: %s to %s\n", arg1, arg2);
+            break;
+        case 'p':
+            if (!res)
+              printf("Printed tecnicofs to: %s\n", arg1);
+            else
+              printf("Unable to print tecnicofs to: %s\n", arg1);
+            break;
+        case 's':
+            if (!res)
+              printf("Printed statistics to: %s\n", arg1);
+            else
+              printf("Unable to print statistics to: %s\n", arg1);
+            break;
+        case 'i':
+            if (!res)
+              printf("Snapshot of tecnicofs begun to: %s\n", arg1);
+            else
+              printf("Unable to snapshot tecnicofs to: %s\n", arg1);
+            break;
+        case 'o':
+            if (res >= 0)
+              printf("Opened: %s (%s)\n", arg1, arg2);
+            else
+              printf("Unable to open: %s (%s), error %d\n", arg1, arg2, res);
+            break;
+        case 'x':
+            if (!res)
+              printf("Closed: %s\n", arg1);
+            else
+              printf("Unable to close: %s, error %d\n", arg1, res);
+            break;
+        case 'a':
+            if (res >= 0)
+              printf("Appended to %s: %s\n", arg1, arg2);
+            else
+              printf("Unable to append to: %s, error %d\n", arg1, res);
+            break;
+        case 'w':
+            if (res >= 0)
+              printf("Wrote to %s: %s\n", arg1, arg2);
+            else
+              printf("Unable to write to: %s, error %d\n", arg1, res);
+            break;
+        case 't':
+            if (!res)
+              printf("Truncated %s to %s bytes\n", arg1, arg2);
+            else
+              printf("Unable to truncate: %s, error %d\n", arg1, res);
+            break;
+        case 'r':
+            if (res >= 0)
+              printf("Read %s: %.*s\n", arg1, res, readBuffer);
+            else
+              printf("Unable to read: %s, error %d\n", arg1, res);
+            break;
+    }
+}
+
+/*
+ * Sends the queued commands and prints their results.
+ */
+void flushBatch(command_t *commands, int count) {
+    int results[TFS_MAX_BATCH];
+
+    if (count == 0)
+        return;
+
+    int sent = tfsBatchSend(results);
+    for (int i = 0; i < count; i++)
+        printResult(&commands[i], sent == count ? results[i] : -1);
+}
+
+void *processInput() {
+    char line[MAX_INPUT_SIZE];
+    command_t *commands = malloc(sizeof(command_t) * (batchSize > 0 ? batchSize : 1));
+    int count = 0;
+
+    if (commands == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
+        command_t *command = &commands[count];
+
+        if (!parseCommand(line, command))
+            continue;
+
+        if (batchSize == 0) {
+            printResult(command, runCommand(command));
+            continue;
+        }
+
+        /* file operations run on their own, after the commands queued before them */
+        if (!batchable(command)) {
+            flushBatch(commands, count);
+            count = 0;
+            printResult(command, runCommand(command));
+            continue;
+        }
+
+        /* the command did not fit, send the ones before it first */
+        if (queueCommand(command) < 0) {
+            flushBatch(commands, count);
+            commands[0] = *command;
+            command = &commands[count = 0];
+            if (queueCommand(command) < 0) {
+                printResult(command, -1);
+                continue;
             }
         }
+        if (++count == batchSize) {
+            flushBatch(commands, count);
+            count = 0;
+        }
     }
+    flushBatch(commands, count);
+
+    free(commands);
     fclose(inputFile);
     return NULL;
 }
@@ -121,12 +420,13 @@ void *processInput() {
 int main(int argc, char* argv[]) {
     parseArgs(argc, argv);
 
-    if (tfsMount(serverName) == 0)
+    if ((useStream ? tfsMountStream(serverName) : tfsMount(serverName)) == 0)
       printf("Mounted! (socket = %s)\n", serverName);
     else {
       fprintf(stderr, "Unable to mount socket: %s\n", serverName);
       exit(EXIT_FAILURE);
     }
+    tfsSetTextProtocol(useText);
 
     processInput();
 
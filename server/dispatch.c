@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+#include "dispatch.h"
+
+dispatch_worker_t *workers;
+int workerCount;
+/* requests of group g go to the workers from groupStart[g] to groupStart[g + 1] */
+int *groupStart;
+int groupCount;
+void (*dispatch_handler)(void *);
+/* where the producers of each group start looking for a worker */
+unsigned int *nextWorker;
+/* times a producer found every queue full */
+unsigned long stalls = 0;
+
+/* start of the window reported by the next statistics */
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long long windowStart;
+unsigned long long *windowBusy;
+unsigned long *windowExecuted;
+
+unsigned long long dispatch_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void dispatch_queue_init(dispatch_queue_t *queue) {
+    for (size_t i = 0; i < DISPATCH_QUEUE_SIZE; i++) {
+        queue->cells[i].seq = i;
+    }
+    queue->enqueuePos = 0;
+    queue->dequeuePos = 0;
+}
+
+/*
+ * Adds an item to the queue.
+ * Returns: 0, or -1 if the queue is full
+ */
+int dispatch_queue_push(dispatch_queue_t *queue, void *item) {
+    size_t pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+
+    while (1) {
+        dispatch_cell_t *cell = &queue->cells[pos & (DISPATCH_QUEUE_SIZE - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->enqueuePos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->item = item;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Takes the oldest item of the queue.
+ * Returns: the item, or NULL if the queue is empty
+ */
+void *dispatch_queue_pop(dispatch_queue_t *queue) {
+    size_t pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+
+    while (1) {
+        dispatch_cell_t *cell = &queue->cells[pos & (DISPATCH_QUEUE_SIZE - 1)];
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) (pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeuePos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                void *item = cell->item;
+                __atomic_store_n(&cell->seq, pos + DISPATCH_QUEUE_SIZE, __ATOMIC_RELEASE);
+                return item;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Returns the number of items in the queue, which may be stale.
+ */
+size_t dispatch_queue_depth(dispatch_queue_t *queue) {
+    size_t dequeuePos = __atomic_load_n(&queue->dequeuePos, __ATOMIC_RELAXED);
+    size_t enqueuePos = __atomic_load_n(&queue->enqueuePos, __ATOMIC_RELAXED);
+    return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+}
+
+/*
+ * Takes the next item for the worker, from its own queue or else from
+ * the queue of another worker.
+ * Returns: the item, or NULL if every queue is empty
+ */
+void *dispatch_take(dispatch_worker_t *worker) {
+    void *item = dispatch_queue_pop(&worker->queue);
+    if (item != NULL) {
+        return item;
+    }
+
+    int self = worker - workers;
+    for (int i = 1; i < workerCount; i++) {
+        item = dispatch_queue_pop(&workers[(self + i) % workerCount].queue);
+        if (item != NULL) {
+            worker->stolen++;
+            return item;
+        }
+    }
+    return NULL;
+}
+
+void *dispatch_worker(void *arg) {
+    dispatch_worker_t *worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (worker->cpu < CPU_SETSIZE) {
+            CPU_SET(worker->cpu, &set);
+        }
+        if (worker->cpu >= CPU_SETSIZE || pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+            fprintf(stderr, "Error: could not pin worker to cpu %d\n", worker->cpu);
+            worker->cpu = -1;
+        }
+    }
+
+    while (1) {
+        void *item = dispatch_take(worker);
+        if (item == NULL) {
+            /* announce the sleep before checking again, so no submit is missed */
+            __atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            item = dispatch_take(worker);
+            if (item == NULL) {
+                while (sem_wait(&worker->wake) && errno == EINTR);
+                continue;
+            }
+            __atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+        }
+
+        unsigned long long start = dispatch_now();
+        dispatch_handler(item);
+        __atomic_store_n(&worker->busyNs, worker->busyNs + dispatch_now() - start, __ATOMIC_RELAXED);
+        __atomic_store_n(&worker->executed, worker->executed + 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/*
+ * Wakes the worker if it is sleeping. Called after pushing to its queue:
+ * the fence pairs with the one of the worker between announcing its sleep
+ * and checking its queue again, so either the worker sees the item or
+ * this sees the worker asleep.
+ */
+void dispatch_wake(dispatch_worker_t *worker) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        sem_post(&worker->wake);
+    }
+}
+
+/*
+ * Starts the workers.
+ * Input:
+ *  - numberWorkers: number of worker threads
+ *  - numberGroups: number of groups the workers are split in, at most numberWorkers
+ *  - handler: function run by the workers on each item submitted
+ *  - cpus: cpus to pin the workers to, in turn, or NULL not to pin them
+ *  - numberCpus: length of cpus
+ */
+void dispatch_init(int numberWorkers, int numberGroups, void (*handler)(void *), int *cpus, int numberCpus) {
+    workers = aligned_alloc(DISPATCH_CACHE_LINE, sizeof(dispatch_worker_t) * numberWorkers);
+    windowBusy = calloc(numberWorkers, sizeof(unsigned long long));
+    windowExecuted = calloc(numberWorkers, sizeof(unsigned long));
+    groupStart = malloc(sizeof(int) * (numberGroups + 1));
+    nextWorker = calloc(numberGroups, sizeof(unsigned int));
+    if (workers == NULL || windowBusy == NULL || windowExecuted == NULL || groupStart == NULL || nextWorker == NULL) {
+        fprintf(stderr, "Error: failed to allocate workers\n");
+        exit(EXIT_FAILURE);
+    }
+    workerCount = numberWorkers;
+    groupCount = numberGroups;
+    for (int g = 0; g <= numberGroups; g++) {
+        groupStart[g] = g * numberWorkers / numberGroups;
+    }
+    dispatch_handler = handler;
+    windowStart = dispatch_now();
+
+    for (int i = 0; i < numberWorkers; i++) {
+        dispatch_worker_t *worker = &workers[i];
+        dispatch_queue_init(&worker->queue);
+        if (sem_init(&worker->wake, 0, 0)) {
+            fprintf(stderr, "Error: failed to init semaphore\n");
+            exit(EXIT_FAILURE);
+        }
+        worker->sleeping = 0;
+        worker->cpu = cpus != NULL ? cpus[i % numberCpus] : -1;
+        worker->maxDepth = 0;
+        worker->executed = 0;
+        worker->stolen = 0;
+        worker->busyNs = 0;
+    }
+
+    for (int i = 0; i < numberWorkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, dispatch_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Error: could not create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Hands an item to the workers of a group. It goes to an idle worker of
+ * the group if there is one, or else is queued for the next worker of
+ * the group in turn. Only when every queue of the group is full does it
+ * go to other groups, waiting while every queue is full.
+ */
+void dispatch_submit(void *item, int group) {
+    int first = groupStart[group];
+    int size = groupStart[group + 1] - first;
+    int start = first + __atomic_fetch_add(&nextWorker[group], 1, __ATOMIC_RELAXED) % size;
+    dispatch_worker_t *target = &workers[start];
+
+    for (int i = 0; i < size; i++) {
+        dispatch_worker_t *worker = &workers[first + (start - first + i) % size];
+        if (__atomic_load_n(&worker->sleeping, __ATOMIC_RELAXED)) {
+            target = worker;
+            break;
+        }
+    }
+
+    int stalled = 0;
+    while (dispatch_queue_push(&target->queue, item)) {
+        /* every queue full means the workers are the bottleneck */
+        target = &workers[(target - workers + 1) % workerCount];
+        if (target == &workers[start]) {
+            if (!stalled) {
+                __atomic_fetch_add(&stalls, 1, __ATOMIC_RELAXED);
+                stalled = 1;
+            }
+            sched_yield();
+        }
+    }
+
+    size_t depth = dispatch_queue_depth(&target->queue);
+    if (depth > __atomic_load_n(&target->maxDepth, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&target->maxDepth, depth, __ATOMIC_RELAXED);
+    }
+    dispatch_wake(target);
+}
+
+/*
+ * Returns the number of workers of a group.
+ */
+int dispatch_group_size(int group) {
+    return groupStart[group + 1] - groupStart[group];
+}
+
+/*
+ * Waits for the workers, which never return.
+ */
+void dispatch_wait() {
+    for (int i = 0; i < workerCount; i++) {
+        if (pthread_join(workers[i].thread, NULL)) {
+            fprintf(stderr, "Error: error waiting for thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Prints the state of the queues and the work done by each worker since
+ * the previous call. Busy workers with deep queues mean the file system
+ * is the bottleneck, idle workers with empty queues mean receiving is.
+ */
+void dispatch_print_stats(FILE *fp) {
+    if (pthread_mutex_lock(&statsLock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned long long now = dispatch_now();
+    unsigned long long elapsed = now - windowStart;
+    windowStart = now;
+
+    fprintf(fp, "dispatch: %d workers in %d groups, %lu stalls with every queue full\n", workerCount, groupCount,
+            __atomic_load_n(&stalls, __ATOMIC_RELAXED));
+    fprintf(fp, "%-6s %4s %6s %8s %12s %10s %8s %6s\n",
+            "worker", "cpu", "depth", "maxdepth", "executed", "stolen", "window", "util%");
+    for (int i = 0; i < workerCount; i++) {
+        dispatch_worker_t *worker = &workers[i];
+        unsigned long long busy = __atomic_load_n(&worker->busyNs, __ATOMIC_RELAXED);
+        unsigned long executed = __atomic_load_n(&worker->executed, __ATOMIC_RELAXED);
+
+        fprintf(fp, "%-6d %4d %6zu %8zu %12lu %10lu %8lu %6.1f\n", i, worker->cpu,
+                dispatch_queue_depth(&worker->queue),
+                __atomic_load_n(&worker->maxDepth, __ATOMIC_RELAXED), executed,
+                __atomic_load_n(&worker->stolen, __ATOMIC_RELAXED), executed - windowExecuted[i],
+                elapsed ? 100.0 * (busy - windowBusy[i]) / elapsed : 0.0);
+        windowBusy[i] = busy;
+        windowExecuted[i] = executed;
+    }
+
+    if (pthread_mutex_unlock(&statsLock)) {
+        fprintf(stderr, "Error: mutex failed to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/* Requests each worker queue can hold, a power of 2 */
+#define DISPATCH_QUEUE_SIZE 1024
+#define DISPATCH_CACHE_LINE 64
+
+/*
+ * Slot of a queue. Its sequence number tells producers and consumers
+ * whose turn it is to use it.
+ */
+typedef struct dispatch_cell_t {
+    size_t seq;
+    void *item;
+} dispatch_cell_t;
+
+/*
+ * Bounded lock-free queue with any number of producers and consumers
+ */
+typedef struct dispatch_queue_t {
+    dispatch_cell_t cells[DISPATCH_QUEUE_SIZE];
+    size_t enqueuePos __attribute__((aligned(DISPATCH_CACHE_LINE)));
+    size_t dequeuePos __attribute__((aligned(DISPATCH_CACHE_LINE)));
+} dispatch_queue_t;
+
+/*
+ * Worker thread with its own queue, from which idle workers steal
+ */
+typedef struct dispatch_worker_t {
+    dispatch_queue_t queue;
+    sem_t wake;
+    int sleeping __attribute__((aligned(DISPATCH_CACHE_LINE)));
+    int cpu; /* -1 when not pinned */
+    pthread_t thread;
+    size_t maxDepth; /* updated by the producers */
+    /* only written by the worker, read when reporting */
+    unsigned long executed __attribute__((aligned(DISPATCH_CACHE_LINE)));
+    unsigned long stolen;
+    unsigned long long busyNs;
+} dispatch_worker_t;
+
+void dispatch_queue_init(dispatch_queue_t *queue);
+int dispatch_queue_push(dispatch_queue_t *queue, void *item);
+void *dispatch_queue_pop(dispatch_queue_t *queue);
+void dispatch_init(int numberWorkers, int numberGroups, void (*handler)(void *), int *cpus, int numberCpus);
+void dispatch_submit(void *item, int group);
+int dispatch_group_size(int group);
+void dispatch_wait();
+void dispatch_print_stats(FILE *fp);
+
+#endif /* DISPATCH_H */
@@ -0,0 +1,149 @@
+#include <string.h>
+#include "dcache.h"
+#include "directory.h"
+#include "state.h"
+
+/*
+ * Hit and miss counters of a stripe, padded to a cache line
+ */
+typedef struct dcache_counters_t {
+    unsigned long hits;
+    unsigned long negativeHits;
+    unsigned long misses;
+    char padding[64 - 3 * sizeof(unsigned long)];
+} dcache_counters_t;
+
+dcache_entry_t dcache_entries[DCACHE_SIZE];
+dcache_counters_t dcache_counters[DCACHE_STRIPES];
+
+int dcache_next_stripe = 0;
+__thread int dcache_stripe = -1;
+
+/*
+ * Returns the counters of the calling thread.
+ */
+dcache_counters_t *dcache_counters_self() {
+    if (dcache_stripe < 0) {
+        dcache_stripe = __atomic_fetch_add(&dcache_next_stripe, 1, __ATOMIC_RELAXED) % DCACHE_STRIPES;
+    }
+    return &dcache_counters[dcache_stripe];
+}
+
+void dcache_count(unsigned long *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Looks for a path in the cache with a single probe, without locking.
+ * Entries resolved through a directory whose entries changed since are
+ * ignored, so only changes along the path invalidate it.
+ * Input:
+ *  - path: full path
+ *  - inumber: reference to store the cached i-number, FAIL if the path
+ *             is known not to exist
+ * Returns: 1 on a hit, 0 on a miss
+ */
+int dcache_lookup(char *path, int *inumber) {
+    dcache_counters_t *counters = dcache_counters_self();
+    dcache_entry_t *entry = &dcache_entries[directory_hash(path) & (DCACHE_SIZE - 1)];
+
+    unsigned int seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    int match = !(seq & 1) && strncmp(entry->path, path, MAX_FILE_NAME) == 0;
+    int cached = __atomic_load_n(&entry->inumber, __ATOMIC_RELAXED);
+    int depth = __atomic_load_n(&entry->trace.depth, __ATOMIC_RELAXED);
+    int dirs[DCACHE_MAX_DEPTH];
+    unsigned int gens[DCACHE_MAX_DEPTH];
+    for (int i = 0; match && i < depth && i < DCACHE_MAX_DEPTH; i++) {
+        dirs[i] = __atomic_load_n(&entry->trace.dirs[i], __ATOMIC_RELAXED);
+        gens[i] = __atomic_load_n(&entry->trace.gens[i], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (match && depth <= DCACHE_MAX_DEPTH && __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq) {
+        int fresh = 1;
+        for (int i = 0; fresh && i < depth; i++) {
+            inode_t *dir = inode_at(dirs[i]);
+            fresh = dir != NULL && __atomic_load_n(&dir->entriesGen, __ATOMIC_ACQUIRE) == gens[i];
+        }
+        if (fresh) {
+            dcache_count(cached == FAIL ? &counters->negativeHits : &counters->hits);
+            *inumber = cached;
+            return 1;
+        }
+    }
+
+    dcache_count(&counters->misses);
+    return 0;
+}
+
+/*
+ * Starts the trace of a path about to be resolved.
+ */
+void dcache_trace_init(dcache_trace_t *trace) {
+    trace->depth = 0;
+}
+
+/*
+ * Adds a directory searched while resolving a path to its trace.
+ * Input:
+ *  - inumber: the directory
+ *  - gen: generation of its entries, read consistently with the search
+ */
+void dcache_trace(dcache_trace_t *trace, int inumber, unsigned int gen) {
+    if (trace->depth < DCACHE_MAX_DEPTH) {
+        trace->dirs[trace->depth] = inumber;
+        trace->gens[trace->depth] = gen;
+    }
+    trace->depth++;
+}
+
+/*
+ * Caches the resolution of a path. If a directory of the trace changed
+ * since it was searched the entry is already stale and will be ignored.
+ * Input:
+ *  - path: full path
+ *  - inumber: i-number of the path or FAIL if it does not exist
+ *  - trace: directories the path was resolved through
+ */
+void dcache_insert(char *path, int inumber, dcache_trace_t *trace) {
+    if (strlen(path) >= MAX_FILE_NAME || trace->depth > DCACHE_MAX_DEPTH) {
+        return;
+    }
+
+    dcache_entry_t *entry = &dcache_entries[directory_hash(path) & (DCACHE_SIZE - 1)];
+
+    /* skip the insertion if someone else is writing the entry */
+    unsigned int seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    strcpy(entry->path, path);
+    entry->inumber = inumber;
+    entry->trace.depth = trace->depth;
+    for (int i = 0; i < trace->depth; i++) {
+        entry->trace.dirs[i] = trace->dirs[i];
+        entry->trace.gens[i] = trace->gens[i];
+    }
+
+    __atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Prints the hit and miss counters of the cache.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void dcache_print_stats(FILE *fp) {
+    unsigned long hits = 0, negativeHits = 0, misses = 0;
+
+    for (int i = 0; i < DCACHE_STRIPES; i++) {
+        hits += __atomic_load_n(&dcache_counters[i].hits, __ATOMIC_RELAXED);
+        negativeHits += __atomic_load_n(&dcache_counters[i].negativeHits, __ATOMIC_RELAXED);
+        misses += __atomic_load_n(&dcache_counters[i].misses, __ATOMIC_RELAXED);
+    }
+
+    fprintf(fp, "dcache: hits %lu negative hits %lu misses %lu\n", hits, negativeHits, misses);
+}
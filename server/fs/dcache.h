@@ -0,0 +1,43 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdio.h>
+
+#include "../../tecnicofs-api-constants.h"
+
+/* Number of cached paths, must be a power of 2 */
+#define DCACHE_SIZE 16384
+/* Hit and miss counters are spread over stripes to avoid sharing */
+#define DCACHE_STRIPES 64
+/* Most directories a cached path goes through, deeper paths are not cached */
+#define DCACHE_MAX_DEPTH 8
+
+/*
+ * Directories a path was resolved through, each with the generation of
+ * its entries when it was searched (see entriesGen in state.h)
+ */
+typedef struct dcache_trace_t {
+	int depth; /* more than DCACHE_MAX_DEPTH once it overflows */
+	int dirs[DCACHE_MAX_DEPTH];
+	unsigned int gens[DCACHE_MAX_DEPTH];
+} dcache_trace_t;
+
+/*
+ * Cached resolution of a full path. Negative entries (inumber FAIL)
+ * remember paths that do not exist. Either goes stale once a directory
+ * it was resolved through changes its entries.
+ */
+typedef struct dcache_entry_t {
+	unsigned int seq; /* odd while the entry is being written */
+	int inumber;
+	dcache_trace_t trace;
+	char path[MAX_FILE_NAME];
+} dcache_entry_t;
+
+int dcache_lookup(char *path, int *inumber);
+void dcache_trace_init(dcache_trace_t *trace);
+void dcache_trace(dcache_trace_t *trace, int inumber, unsigned int gen);
+void dcache_insert(char *path, int inumber, dcache_trace_t *trace);
+void dcache_print_stats(FILE *fp);
+
+#endif /* DCACHE_H */
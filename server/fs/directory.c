@@ -0,0 +1,386 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "directory.h"
+#include "state.h"
+#include "slab.h"
+
+/*
+ * Hashes an entry name (FNV-1a).
+ */
+unsigned int directory_hash(char *name) {
+    unsigned int hash = 2166136261u;
+
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Allocates an empty hash table with the given number of buckets. Tables
+ * and directories come from stable memory, as lookups read them without
+ * locks, see directory_view_lookup.
+ */
+DirEntry *directory_alloc_table(int capacity) {
+    DirEntry *entries = slab_alloc_stable(sizeof(DirEntry) * capacity);
+
+    for (int i = 0; i < capacity; i++) {
+        entries[i].inumber = FREE_INODE;
+    }
+    return entries;
+}
+
+/*
+ * Finds the slot of the entry with the given name.
+ * Returns: the slot index or FAIL if there is no such entry
+ */
+int directory_find(Directory *dir, char *name) {
+    if (!dir->hashed) {
+        for (int i = 0; i < dir->capacity; i++) {
+            if (dir->entries[i].inumber != FREE_INODE && strcmp(dir->entries[i].name, name) == 0) {
+                return i;
+            }
+        }
+        return FAIL;
+    }
+
+    unsigned int mask = dir->capacity - 1;
+    for (unsigned int i = directory_hash(name) & mask; ; i = (i + 1) & mask) {
+        int inumber = dir->entries[i].inumber;
+        if (inumber == FREE_INODE) {
+            return FAIL;
+        }
+        if (inumber != DIR_TOMBSTONE && strcmp(dir->entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+}
+
+/*
+ * Puts an entry in the first free slot of its probe sequence, the name must
+ * not be in the table already.
+ */
+void directory_place(DirEntry *entries, int capacity, char *name, int inumber) {
+    unsigned int mask = capacity - 1;
+    unsigned int i = directory_hash(name) & mask;
+
+    while (entries[i].inumber != FREE_INODE && entries[i].inumber != DIR_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+
+    entries[i].inumber = inumber;
+    strcpy(entries[i].name, name);
+}
+
+/*
+ * Moves every entry to a new hash table with the given number of buckets,
+ * dropping the tombstones.
+ */
+void directory_rehash(Directory *dir, int capacity) {
+    DirEntry *entries = directory_alloc_table(capacity);
+
+    for (int i = 0; i < dir->capacity; i++) {
+        int inumber = dir->entries[i].inumber;
+        if (inumber != FREE_INODE && inumber != DIR_TOMBSTONE) {
+            directory_place(entries, capacity, dir->entries[i].name, inumber);
+        }
+    }
+
+    if (dir->hashed && !dir->mapped) {
+        slab_free_stable(dir->entries, sizeof(DirEntry) * dir->capacity);
+    }
+
+    dir->entries = entries;
+    dir->capacity = capacity;
+    dir->used = dir->count;
+    dir->hashed = 1;
+}
+
+/*
+ * Creates an empty directory.
+ */
+Directory *directory_create() {
+    Directory *dir = slab_alloc_stable(sizeof(Directory));
+
+    dir->count = 0;
+    dir->used = 0;
+    dir->hashed = 0;
+    dir->mapped = 0;
+    dir->capacity = DIR_INLINE_ENTRIES;
+    dir->entries = dir->inlineEntries;
+    for (int i = 0; i < DIR_INLINE_ENTRIES; i++) {
+        dir->inlineEntries[i].inumber = FREE_INODE;
+    }
+    return dir;
+}
+
+/*
+ * Releases the memory of the directory.
+ */
+void directory_destroy(Directory *dir) {
+    if (dir == NULL) {
+        return;
+    }
+    if (dir->hashed && !dir->mapped) {
+        slab_free_stable(dir->entries, sizeof(DirEntry) * dir->capacity);
+    }
+    slab_free_stable(dir, sizeof(Directory));
+}
+
+/*
+ * Copies the directory, slots included, so that the copy lists its
+ * entries in the same order.
+ */
+Directory *directory_copy(Directory *dir) {
+    Directory *copy = slab_alloc_stable(sizeof(Directory));
+
+    memcpy(copy, dir, sizeof(Directory));
+    if (dir->mapped) {
+        /* the entries in the image never change, both can use them */
+    } else if (dir->hashed) {
+        copy->entries = slab_alloc_stable(sizeof(DirEntry) * dir->capacity);
+        memcpy(copy->entries, dir->entries, sizeof(DirEntry) * dir->capacity);
+    } else {
+        copy->entries = copy->inlineEntries;
+    }
+    return copy;
+}
+
+/*
+ * Creates a directory whose entries stay in an image until it changes.
+ * Input:
+ *  - entries: the block of the directory in the image
+ *  - count: number of entries
+ *  - capacity: slots of the block, see directory_map_capacity
+ */
+Directory *directory_map(DirEntry *entries, int count, int capacity) {
+    Directory *dir = slab_alloc_stable(sizeof(Directory));
+
+    dir->count = count;
+    dir->used = count;
+    dir->capacity = capacity;
+    dir->hashed = capacity > DIR_INLINE_ENTRIES;
+    dir->mapped = 1;
+    dir->entries = entries;
+    return dir;
+}
+
+/*
+ * Returns the number of slots of the block of a directory with count
+ * entries in an image: a plain array while they fit the inline array,
+ * otherwise a hash table loaded at most one half.
+ */
+int directory_map_capacity(int count) {
+    if (count <= DIR_INLINE_ENTRIES) {
+        return count;
+    }
+
+    int capacity = DIR_MIN_BUCKETS;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+/*
+ * Lays out entries in the block of a directory in an image.
+ * Input:
+ *  - entries: the entries
+ *  - count: number of entries
+ *  - block: the block, zeroed
+ *  - capacity: slots of the block, from directory_map_capacity
+ */
+void directory_layout(DirEntry *entries, int count, DirEntry *block, int capacity) {
+    if (capacity <= DIR_INLINE_ENTRIES) {
+        for (int i = 0; i < count; i++) {
+            block[i].inumber = entries[i].inumber;
+            strcpy(block[i].name, entries[i].name);
+        }
+        return;
+    }
+
+    for (int i = 0; i < capacity; i++) {
+        block[i].inumber = FREE_INODE;
+    }
+    for (int i = 0; i < count; i++) {
+        directory_place(block, capacity, entries[i].name, entries[i].inumber);
+    }
+}
+
+/*
+ * Moves the entries of a directory out of its image, before it changes.
+ */
+void directory_unmap(Directory *dir) {
+    DirEntry *entries = dir->entries;
+
+    if (dir->hashed) {
+        dir->entries = slab_alloc_stable(sizeof(DirEntry) * dir->capacity);
+        memcpy(dir->entries, entries, sizeof(DirEntry) * dir->capacity);
+    } else {
+        for (int i = 0; i < DIR_INLINE_ENTRIES; i++) {
+            dir->inlineEntries[i].inumber = FREE_INODE;
+        }
+        memcpy(dir->inlineEntries, entries, sizeof(DirEntry) * dir->count);
+        dir->entries = dir->inlineEntries;
+        dir->capacity = DIR_INLINE_ENTRIES;
+    }
+    dir->mapped = 0;
+}
+
+/*
+ * Looks for an entry of the directory.
+ * Input:
+ *  - dir: the directory
+ *  - name: name of the entry
+ * Returns:
+ *  - inumber: the i-number of the entry
+ *  - FAIL: if not found
+ */
+int directory_lookup(Directory *dir, char *name) {
+    if (dir == NULL) {
+        return FAIL;
+    }
+
+    int slot = directory_find(dir, name);
+    return slot == FAIL ? FAIL : dir->entries[slot].inumber;
+}
+
+/*
+ * Adds an entry to the directory.
+ * Input:
+ *  - dir: the directory
+ *  - name: name of the entry
+ *  - inumber: i-number of the entry
+ * Returns: SUCCESS or FAIL if the name already exists
+ */
+int directory_insert(Directory *dir, char *name, int inumber) {
+    if (directory_find(dir, name) != FAIL) {
+        return FAIL;
+    }
+    if (dir->mapped) {
+        directory_unmap(dir);
+    }
+
+    if (!dir->hashed) {
+        for (int i = 0; i < DIR_INLINE_ENTRIES; i++) {
+            if (dir->entries[i].inumber == FREE_INODE) {
+                dir->entries[i].inumber = inumber;
+                strcpy(dir->entries[i].name, name);
+                dir->count++;
+                return SUCCESS;
+            }
+        }
+        /* the inline array is full */
+        directory_rehash(dir, DIR_MIN_BUCKETS);
+    } else if ((dir->used + 1) * 2 > dir->capacity) {
+        /* keep the load (tombstones included) at most one half */
+        int capacity = dir->capacity;
+        if ((dir->count + 1) * 4 > capacity) {
+            capacity *= 2;
+        }
+        directory_rehash(dir, capacity);
+    }
+
+    unsigned int mask = dir->capacity - 1;
+    unsigned int i = directory_hash(name) & mask;
+    while (dir->entries[i].inumber != FREE_INODE && dir->entries[i].inumber != DIR_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+
+    if (dir->entries[i].inumber == FREE_INODE) {
+        dir->used++;
+    }
+    dir->entries[i].inumber = inumber;
+    strcpy(dir->entries[i].name, name);
+    dir->count++;
+    return SUCCESS;
+}
+
+/*
+ * Removes an entry from the directory.
+ * Input:
+ *  - dir: the directory
+ *  - name: name of the entry
+ *  - inumber: expected i-number of the entry
+ * Returns: SUCCESS or FAIL if there is no such entry
+ */
+int directory_remove(Directory *dir, char *name, int inumber) {
+    int slot = directory_find(dir, name);
+    if (slot == FAIL || dir->entries[slot].inumber != inumber) {
+        return FAIL;
+    }
+    if (dir->mapped) {
+        directory_unmap(dir);
+    }
+
+    dir->entries[slot].inumber = dir->hashed ? DIR_TOMBSTONE : FREE_INODE;
+    dir->entries[slot].name[0] = '\0';
+    dir->count--;
+    return SUCCESS;
+}
+
+/*
+ * Returns the number of entries of the directory.
+ */
+int directory_count(Directory *dir) {
+    return dir == NULL ? 0 : dir->count;
+}
+
+/*
+ * Iterates over the entries of the directory. pos must start at 0.
+ * Returns: the next entry or NULL after the last one
+ */
+DirEntry *directory_next(Directory *dir, int *pos) {
+    while (*pos < dir->capacity) {
+        DirEntry *entry = &dir->entries[(*pos)++];
+        if (entry->inumber != FREE_INODE && entry->inumber != DIR_TOMBSTONE) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Reads the fields needed to search the directory into view, without
+ * locking. The caller must validate the read before using the view.
+ */
+void directory_view(Directory *dir, DirectoryView *view) {
+    view->entries = __atomic_load_n(&dir->entries, __ATOMIC_RELAXED);
+    view->capacity = __atomic_load_n(&dir->capacity, __ATOMIC_RELAXED);
+    view->hashed = __atomic_load_n(&dir->hashed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Looks for an entry through a view of a directory that may be changing
+ * concurrently. The entries block can be reused meanwhile, but stable
+ * memory stays mapped and keeps at least its size, so the search stays
+ * within bounds and ends; the result is only meaningful once validated by
+ * the caller.
+ * Returns:
+ *  - inumber: the i-number of the entry
+ *  - FAIL: if not found
+ */
+int directory_view_lookup(DirectoryView *view, char *name) {
+    if (view->entries == NULL || view->capacity <= 0) {
+        return FAIL;
+    }
+
+    unsigned int mask = view->capacity - 1;
+    unsigned int i = view->hashed ? directory_hash(name) & mask : 0;
+
+    for (int n = 0; n < view->capacity; n++, i = view->hashed ? (i + 1) & mask : i + 1) {
+        int inumber = __atomic_load_n(&view->entries[i].inumber, __ATOMIC_RELAXED);
+        if (inumber == FREE_INODE) {
+            if (view->hashed) {
+                return FAIL;
+            }
+            continue;
+        }
+        if (inumber != DIR_TOMBSTONE && strncmp(view->entries[i].name, name, MAX_FILE_NAME) == 0) {
+            return inumber;
+        }
+    }
+    return FAIL;
+}
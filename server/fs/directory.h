@@ -0,0 +1,69 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "../../tecnicofs-api-constants.h"
+
+/* Entries kept in the inline array before switching to a hash table */
+#define DIR_INLINE_ENTRIES 8
+/* Initial number of buckets of a hashed directory, must be a power of 2 */
+#define DIR_MIN_BUCKETS 32
+
+/* Marks an entry slot of a hashed directory whose entry was removed */
+#define DIR_TOMBSTONE -2
+
+/*
+ * Contains the name of the entry and respective i-number
+ */
+typedef struct dirEntry {
+	char name[MAX_FILE_NAME];
+	int inumber;
+} DirEntry;
+
+/*
+ * Directory contents. Small directories keep their entries in the inline
+ * array and are searched linearly. Once they outgrow it, entries move to an
+ * open-addressing hash table keyed on the entry name, using linear probing.
+ */
+typedef struct directory_t {
+	int count; /* number of entries in the directory */
+	int capacity; /* number of slots in entries */
+	int used; /* slots holding an entry or a tombstone */
+	int hashed; /* whether entries is a hash table */
+	int mapped; /* whether entries is in an image, read-only and never freed */
+	DirEntry *entries;
+	DirEntry inlineEntries[DIR_INLINE_ENTRIES];
+} Directory;
+
+/*
+ * A directory restored from an image keeps its entries in the image until
+ * it first changes. Up to DIR_INLINE_ENTRIES entries are a plain array of
+ * count slots, more are a hash table of capacity slots, laid out as
+ * directory_insert would lay them out.
+ */
+
+/*
+ * Copy of the fields of a directory needed to search it, read without
+ * holding its lock. Only meaningful once validated by the caller.
+ */
+typedef struct directory_view_t {
+	DirEntry *entries;
+	int capacity;
+	int hashed;
+} DirectoryView;
+
+unsigned int directory_hash(char *name);
+Directory *directory_create();
+void directory_destroy(Directory *dir);
+Directory *directory_copy(Directory *dir);
+Directory *directory_map(DirEntry *entries, int count, int capacity);
+int directory_map_capacity(int count);
+void directory_layout(DirEntry *entries, int count, DirEntry *block, int capacity);
+int directory_lookup(Directory *dir, char *name);
+int directory_insert(Directory *dir, char *name, int inumber);
+int directory_remove(Directory *dir, char *name, int inumber);
+int directory_count(Directory *dir);
+DirEntry *directory_next(Directory *dir, int *pos);
+void directory_view(Directory *dir, DirectoryView *view);
+int directory_view_lookup(DirectoryView *view, char *name);
+
+#endif /* DIRECTORY_H */
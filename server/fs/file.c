@@ -0,0 +1,194 @@
+#include <string.h>
+#include "file.h"
+#include "slab.h"
+
+/* Extents that double in size, after which they all have the largest size */
+#define FILE_GROWING_EXTENTS (FILE_MAX_SHIFT - FILE_MIN_SHIFT)
+/* Bytes held by the growing extents */
+#define FILE_GROWING_BYTES ((((size_t) 1 << FILE_GROWING_EXTENTS) - 1) << FILE_MIN_SHIFT)
+
+/*
+ * Returns the size of extent i.
+ */
+size_t file_extent_size(int i) {
+    int shift = i < FILE_GROWING_EXTENTS ? FILE_MIN_SHIFT + i : FILE_MAX_SHIFT;
+    return (size_t) 1 << shift;
+}
+
+/*
+ * Returns the offset of the first byte of extent i.
+ */
+size_t file_extent_start(int i) {
+    if (i < FILE_GROWING_EXTENTS) {
+        return (((size_t) 1 << i) - 1) << FILE_MIN_SHIFT;
+    }
+    return FILE_GROWING_BYTES + ((size_t) (i - FILE_GROWING_EXTENTS) << FILE_MAX_SHIFT);
+}
+
+/*
+ * Returns the index of the extent holding the byte at offset.
+ */
+int file_extent_index(size_t offset) {
+    if (offset < FILE_GROWING_BYTES) {
+        /* extent i starts at (2^i - 1) * 2^FILE_MIN_SHIFT */
+        return 63 - __builtin_clzll((offset >> FILE_MIN_SHIFT) + 1);
+    }
+    return FILE_GROWING_EXTENTS + ((offset - FILE_GROWING_BYTES) >> FILE_MAX_SHIFT);
+}
+
+/*
+ * Creates an empty file.
+ */
+File *file_create() {
+    File *file = slab_alloc(sizeof(File));
+
+    file->size = 0;
+    file->count = 0;
+    file->capacity = FILE_INLINE_EXTENTS;
+    file->extents = file->inlineExtents;
+    return file;
+}
+
+/*
+ * Releases the extents from index count on.
+ */
+void file_release_extents(File *file, int count) {
+    for (int i = count; i < file->count; i++) {
+        slab_free(file->extents[i], file_extent_size(i));
+    }
+    if (count < file->count) {
+        file->count = count;
+    }
+}
+
+/*
+ * Releases the memory of the file.
+ */
+void file_destroy(File *file) {
+    if (file == NULL) {
+        return;
+    }
+    file_release_extents(file, 0);
+    if (file->extents != file->inlineExtents) {
+        slab_free(file->extents, sizeof(char *) * file->capacity);
+    }
+    slab_free(file, sizeof(File));
+}
+
+/*
+ * Returns the number of bytes in the file.
+ */
+size_t file_size(File *file) {
+    return file->size;
+}
+
+/*
+ * Allocates extents until the file can hold size bytes.
+ */
+void file_reserve(File *file, size_t size) {
+    while (file_extent_start(file->count) < size) {
+        if (file->count == file->capacity) {
+            char **extents = slab_alloc(sizeof(char *) * file->capacity * 2);
+            memcpy(extents, file->extents, sizeof(char *) * file->count);
+            if (file->extents != file->inlineExtents) {
+                slab_free(file->extents, sizeof(char *) * file->capacity);
+            }
+            file->extents = extents;
+            file->capacity *= 2;
+        }
+        file->extents[file->count] = slab_alloc(file_extent_size(file->count));
+        file->count++;
+    }
+}
+
+/*
+ * Copies length bytes of the file, from offset on, into buffer, or else
+ * from source into the file; with neither the bytes are set to zero.
+ * The extents must already be allocated.
+ */
+void file_copy(File *file, size_t offset, char *buffer, const char *source, size_t length) {
+    int i = file_extent_index(offset);
+    size_t within = offset - file_extent_start(i);
+
+    while (length > 0) {
+        size_t chunk = file_extent_size(i) - within;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        char *extent = file->extents[i] + within;
+        if (buffer != NULL) {
+            memcpy(buffer, extent, chunk);
+            buffer += chunk;
+        } else if (source != NULL) {
+            memcpy(extent, source, chunk);
+            source += chunk;
+        } else {
+            memset(extent, 0, chunk);
+        }
+
+        length -= chunk;
+        within = 0;
+        i++;
+    }
+}
+
+/*
+ * Reads from the file.
+ * Input:
+ *  - file: the file
+ *  - offset: where to start reading
+ *  - buffer: where to copy the bytes read
+ *  - length: most bytes to read
+ * Returns: the number of bytes read, 0 at the end of the file
+ */
+size_t file_read(File *file, size_t offset, char *buffer, size_t length) {
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (length > file->size - offset) {
+        length = file->size - offset;
+    }
+
+    file_copy(file, offset, buffer, NULL, length);
+    return length;
+}
+
+/*
+ * Writes to the file, growing it if needed. A gap between the end of the
+ * file and offset reads as zeros.
+ * Input:
+ *  - file: the file
+ *  - offset: where to start writing
+ *  - buffer: bytes to write
+ *  - length: number of bytes to write
+ */
+void file_write(File *file, size_t offset, const char *buffer, size_t length) {
+    if (length == 0) {
+        return;
+    }
+
+    file_reserve(file, offset + length);
+    if (offset > file->size) {
+        file_copy(file, file->size, NULL, NULL, offset - file->size);
+    }
+    file_copy(file, offset, NULL, buffer, length);
+
+    if (offset + length > file->size) {
+        file->size = offset + length;
+    }
+}
+
+/*
+ * Sets the size of the file, releasing the extents past its new end or
+ * filling the new bytes with zeros.
+ */
+void file_truncate(File *file, size_t size) {
+    if (size < file->size) {
+        file_release_extents(file, size == 0 ? 0 : file_extent_index(size - 1) + 1);
+    } else if (size > file->size) {
+        file_reserve(file, size);
+        file_copy(file, file->size, NULL, NULL, size - file->size);
+    }
+    file->size = size;
+}
@@ -0,0 +1,35 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stddef.h>
+
+/* Extent i holds 2^(FILE_MIN_SHIFT + i) bytes, up to 2^FILE_MAX_SHIFT */
+#define FILE_MIN_SHIFT 8
+#define FILE_MAX_SHIFT 16
+/* Extents kept in the inline array before the array moves to the heap */
+#define FILE_INLINE_EXTENTS 4
+/* Largest size of a file */
+#define FILE_MAX_SIZE ((size_t) 1 << 32)
+
+/*
+ * File contents, split in extents allocated as the file grows. Extents
+ * double in size up to the largest one and every extent but the last is
+ * full, so the extent holding an offset is computed rather than searched
+ * and appending never moves the bytes already written.
+ */
+typedef struct file_t {
+	size_t size; /* bytes in the file */
+	int count; /* number of extents allocated */
+	int capacity; /* number of slots in extents */
+	char **extents; /* inlineExtents, unless it outgrew it */
+	char *inlineExtents[FILE_INLINE_EXTENTS];
+} File;
+
+File *file_create();
+void file_destroy(File *file);
+size_t file_size(File *file);
+size_t file_read(File *file, size_t offset, char *buffer, size_t length);
+void file_write(File *file, size_t offset, const char *buffer, size_t length);
+void file_truncate(File *file, size_t size);
+
+#endif /* FILE_H */
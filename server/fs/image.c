@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "image.h"
+#include "state.h"
+
+/*
+ * Exits on an image that can not be restored.
+ */
+void image_invalid(char *path) {
+    fprintf(stderr, "Error: invalid image %s\n", path);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Builds the contents of an i-node of an image, checking that they are
+ * within the image.
+ * Returns: SUCCESS or FAIL if the i-node is invalid
+ */
+int image_restore_data(char *image, image_header_t *header, image_inode_t *inode, union Data *data) {
+    if (inode->nodeType == T_FILE) {
+        data->file = file_create();
+        return SUCCESS;
+    }
+    if (inode->nodeType != T_DIRECTORY) {
+        return FAIL;
+    }
+    if (inode->count == 0) {
+        data->dir = directory_create();
+        return SUCCESS;
+    }
+
+    if (inode->count > INT32_MAX / 2 || inode->capacity != directory_map_capacity(inode->count) ||
+        inode->entries % sizeof(uint64_t) != 0 || inode->entries > header->size ||
+        (header->size - inode->entries) / sizeof(DirEntry) < inode->capacity) {
+        return FAIL;
+    }
+    data->dir = directory_map((DirEntry *) (image + inode->entries), inode->count, inode->capacity);
+    return SUCCESS;
+}
+
+/*
+ * Restores the tree from an image, serving it where the image is mapped:
+ * only the i-node table is read, the blocks of the directories are paged
+ * in when they are first looked at and copied when they first change.
+ * The image stays mapped for good. Must be called before the tree exists.
+ * Input:
+ *  - path: path of the image
+ *  - header: where to store the header of the image
+ * Returns: SUCCESS or FAIL if the image can not be opened, with errno set
+ */
+int image_load(char *path, image_header_t *header) {
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return FAIL;
+    }
+    if (fstat(fd, &st)) {
+        close(fd);
+        return FAIL;
+    }
+    if (st.st_size < sizeof(image_header_t)) {
+        image_invalid(path);
+    }
+    char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return FAIL;
+    }
+
+    memcpy(header, image, sizeof(image_header_t));
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->size != st.st_size ||
+        header->count == 0 || header->count > (uint64_t) INODE_SHARD_SIZE * INODE_MAX_SHARDS ||
+        header->inodes % sizeof(uint64_t) != 0 || header->inodes > header->size ||
+        (header->size - header->inodes) / sizeof(image_inode_t) < header->count) {
+        image_invalid(path);
+    }
+
+    image_inode_t *inodes = (image_inode_t *) (image + header->inodes);
+    if (inodes[FS_ROOT].nodeType != T_DIRECTORY) {
+        image_invalid(path);
+    }
+
+    inode_table_init();
+    for (uint64_t i = 0; i < header->count; i++) {
+        union Data data;
+        if (image_restore_data(image, header, &inodes[i], &data) == FAIL ||
+            inode_restore(inodes[i].nodeType, data) != i) {
+            image_invalid(path);
+        }
+    }
+    return SUCCESS;
+}
+
+/*
+ * Writes the tree, as a snapshot sees it, as an image. The i-nodes are
+ * numbered again in breadth-first order, so that the block of each
+ * directory is written as soon as it is read, in one sequential pass.
+ * The header is left to image_finish.
+ * Input:
+ *  - fp: the file, at its start
+ *  - epoch: the snapshot, which must be running
+ *  - header: where to store the header of the image
+ * Returns: SUCCESS or FAIL if the file could not be written
+ */
+int image_dump(FILE *fp, unsigned int epoch, image_header_t *header) {
+    /* the inumber in the tree of each i-node of the image, and the i-node */
+    int capacity = 1024, count = 1;
+    int *queue = malloc(sizeof(int) * capacity);
+    image_inode_t *inodes = malloc(sizeof(image_inode_t) * capacity);
+    DirEntry *block = NULL;
+    int blockCapacity = 0;
+    uint64_t offset = sizeof(image_header_t);
+
+    if (queue == NULL || inodes == NULL) {
+        fprintf(stderr, "Error: failed to allocate image\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(header, 0, sizeof(image_header_t));
+    memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+    queue[0] = FS_ROOT;
+
+    if (fseek(fp, offset, SEEK_SET)) {
+        free(queue);
+        free(inodes);
+        return FAIL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        type nType;
+        DirEntry *entries;
+        int entryCount;
+
+        memset(&inodes[i], 0, sizeof(image_inode_t));
+        if (inode_snapshot_entries(queue[i], epoch, &nType, &entries, &entryCount) == FAIL) {
+            nType = T_FILE;
+        }
+        inodes[i].nodeType = nType;
+        if (entryCount == 0) {
+            continue;
+        }
+
+        if (count + entryCount > capacity) {
+            while (count + entryCount > capacity) {
+                capacity *= 2;
+            }
+            queue = realloc(queue, sizeof(int) * capacity);
+            inodes = realloc(inodes, sizeof(image_inode_t) * capacity);
+            if (queue == NULL || inodes == NULL) {
+                fprintf(stderr, "Error: failed to allocate image\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int j = 0; j < entryCount; j++) {
+            queue[count] = entries[j].inumber;
+            entries[j].inumber = count++;
+        }
+
+        int slots = directory_map_capacity(entryCount);
+        if (slots > blockCapacity) {
+            free(block);
+            blockCapacity = slots;
+            block = malloc(sizeof(DirEntry) * blockCapacity);
+            if (block == NULL) {
+                fprintf(stderr, "Error: failed to allocate image\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        /* the unused bytes of the names are zeros too */
+        memset(block, 0, sizeof(DirEntry) * slots);
+        directory_layout(entries, entryCount, block, slots);
+        free(entries);
+        fwrite(block, sizeof(DirEntry), slots, fp);
+
+        inodes[i].entries = offset;
+        inodes[i].count = entryCount;
+        inodes[i].capacity = slots;
+        offset += sizeof(DirEntry) * slots;
+    }
+
+    fwrite(inodes, sizeof(image_inode_t), count, fp);
+    header->inodes = offset;
+    header->count = count;
+    header->size = offset + sizeof(image_inode_t) * count;
+
+    free(queue);
+    free(inodes);
+    free(block);
+    return ferror(fp) ? FAIL : SUCCESS;
+}
+
+/*
+ * Writes the header of an image written by image_dump and waits for the
+ * whole image to be on disk.
+ * Returns: SUCCESS or FAIL
+ */
+int image_finish(FILE *fp, image_header_t *header) {
+    if (fseek(fp, 0, SEEK_SET) || fwrite(header, sizeof(image_header_t), 1, fp) != 1 || fflush(fp) ||
+        ferror(fp) || fdatasync(fileno(fp))) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Snapshot being written to an image by a thread of its own
+ */
+typedef struct image_snapshot_t {
+    FILE *fp;
+    char path[MAX_FILE_NAME];
+    char temp[MAX_FILE_NAME + sizeof(IMAGE_TEMP_SUFFIX)];
+    /* tells the caller of image_snapshot that the snapshot began, and is
+     * not touched after, as it goes away with the caller */
+    struct image_snapshot_begun_t {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int done;
+    } *begun;
+} image_snapshot_t;
+
+/*
+ * Writes a snapshot to its temporary file and renames it to its path once
+ * it is whole. The snapshot begins and ends in this thread, see
+ * snapshot_begin.
+ */
+void *image_snapshot_run(void *arg) {
+    image_snapshot_t *snapshot = arg;
+    image_header_t header;
+
+    unsigned int epoch = snapshot_begin();
+    pthread_mutex_lock(&snapshot->begun->lock);
+    snapshot->begun->done = 1;
+    pthread_cond_signal(&snapshot->begun->cond);
+    pthread_mutex_unlock(&snapshot->begun->lock);
+
+    int result = image_dump(snapshot->fp, epoch, &header);
+    snapshot_end();
+    if (result == FAIL || image_finish(snapshot->fp, &header) == FAIL) {
+        result = FAIL;
+    }
+    if (fclose(snapshot->fp)) {
+        result = FAIL;
+    }
+    if (result == FAIL || rename(snapshot->temp, snapshot->path)) {
+        fprintf(stderr, "Error: could not write snapshot %s\n", snapshot->path);
+        unlink(snapshot->temp);
+    }
+    free(snapshot);
+    return NULL;
+}
+
+/*
+ * Saves the tree as an image at path, which the server restores with -i,
+ * without stopping the operations. Returns as soon as the snapshot began:
+ * the image is written by a thread of its own, in large sequential
+ * writes, to path IMAGE_TEMP_SUFFIX, and renamed to path once it is on
+ * disk, so path is either the old file or the whole snapshot.
+ * Input:
+ *  - path: path of the image
+ * Returns: SUCCESS or FAIL if the image can not be created
+ */
+int image_snapshot(char *path) {
+    struct image_snapshot_begun_t begun;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    image_snapshot_t *snapshot = malloc(sizeof(image_snapshot_t));
+    if (snapshot == NULL) {
+        return FAIL;
+    }
+    snprintf(snapshot->path, sizeof(snapshot->path), "%s", path);
+    snprintf(snapshot->temp, sizeof(snapshot->temp), "%s" IMAGE_TEMP_SUFFIX, path);
+    snapshot->fp = fopen(snapshot->temp, "we");
+    if (snapshot->fp == NULL) {
+        fprintf(stderr, "Error: could not open snapshot %s\n", path);
+        free(snapshot);
+        return FAIL;
+    }
+    setvbuf(snapshot->fp, NULL, _IOFBF, IMAGE_BUFFER_SIZE);
+    pthread_mutex_init(&begun.lock, NULL);
+    pthread_cond_init(&begun.cond, NULL);
+    begun.done = 0;
+    snapshot->begun = &begun;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int failed = pthread_create(&thread, &attr, image_snapshot_run, snapshot);
+    pthread_attr_destroy(&attr);
+    if (failed) {
+        fclose(snapshot->fp);
+        unlink(snapshot->temp);
+        free(snapshot);
+    } else {
+        pthread_mutex_lock(&begun.lock);
+        while (!begun.done) {
+            pthread_cond_wait(&begun.cond, &begun.lock);
+        }
+        pthread_mutex_unlock(&begun.lock);
+    }
+
+    pthread_mutex_destroy(&begun.lock);
+    pthread_cond_destroy(&begun.cond);
+    return failed ? FAIL : SUCCESS;
+}
@@ -0,0 +1,51 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../../tecnicofs-api-constants.h"
+
+#define IMAGE_MAGIC "TFSIMG01"
+/* Buffer of the file an image is written to */
+#define IMAGE_BUFFER_SIZE (1 << 20)
+/* Appended to the path of a snapshot while it is being written */
+#define IMAGE_TEMP_SUFFIX ".tmp"
+
+/*
+ * Header of an image of the tree. It is followed by the blocks of the
+ * directories and then by the i-node table, count image_inode_t indexed
+ * by inumber, the root first. Every reference is an offset from the start
+ * of the image or an inumber, so the image is used where it is mapped.
+ */
+typedef struct image_header_t {
+    char magic[8];
+    uint64_t size; /* bytes of the image */
+    uint64_t count; /* i-nodes in the table */
+    uint64_t inodes; /* offset of the table */
+    /* where in the log a checkpoint was taken, zero for other images,
+     * see wal_checkpoint */
+    uint64_t logBegin;
+    uint64_t logEnd;
+    uint32_t logEpoch;
+    uint32_t reserved[3];
+} image_header_t;
+
+/*
+ * I-node in an image. A directory with entries has a block of capacity
+ * DirEntry at offset entries, see directory_map.
+ */
+typedef struct image_inode_t {
+    uint64_t entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t nodeType;
+    uint8_t reserved[7];
+} image_inode_t;
+
+int image_load(char *path, image_header_t *header);
+int image_dump(FILE *fp, unsigned int epoch, image_header_t *header);
+int image_finish(FILE *fp, image_header_t *header);
+int image_snapshot(char *path);
+
+#endif /* IMAGE_H */
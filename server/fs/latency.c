@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "latency.h"
+
+/*
+ * Histograms of a thread, one per metric. Only the thread that owns them
+ * writes them, so recording takes no lock and no atomic operation. They
+ * are kept in a list for the statistics, and handed to a new thread when
+ * their thread exits.
+ */
+typedef struct latency_thread_t {
+    unsigned long counts[LATENCY_METRICS][LATENCY_BUCKETS];
+    int owned;
+    struct latency_thread_t *next;
+} latency_thread_t;
+
+latency_thread_t *latency_threads = NULL;
+pthread_mutex_t latency_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t latency_once = PTHREAD_ONCE_INIT;
+pthread_key_t latency_key;
+__thread latency_thread_t *latency_self = NULL;
+
+/* histograms summed at the previous statistics, to report the window since */
+pthread_mutex_t latency_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long latency_previous[LATENCY_METRICS][LATENCY_BUCKETS];
+
+char *latency_names[LATENCY_METRICS] = {
+    [LATENCY_READ_LOCK] = "lock_read",
+    [LATENCY_WRITE_LOCK] = "lock_write",
+    [LATENCY_RECEIVE] = "receive",
+    [LATENCY_SEND] = "send",
+    [LATENCY_OPS + TFS_OP_CREATE] = "create",
+    [LATENCY_OPS + TFS_OP_DELETE] = "delete",
+    [LATENCY_OPS + TFS_OP_LOOKUP] = "lookup",
+    [LATENCY_OPS + TFS_OP_MOVE] = "move",
+    [LATENCY_OPS + TFS_OP_PRINT] = "print",
+    [LATENCY_OPS + TFS_OP_STATS] = "stats",
+    [LATENCY_OPS + TFS_OP_BATCH] = "batch",
+    [LATENCY_OPS + TFS_OP_SHARDS] = "shards",
+    [LATENCY_OPS + TFS_OP_OPEN] = "open",
+    [LATENCY_OPS + TFS_OP_CLOSE] = "close",
+    [LATENCY_OPS + TFS_OP_READ] = "read",
+    [LATENCY_OPS + TFS_OP_WRITE] = "write",
+    [LATENCY_OPS + TFS_OP_APPEND] = "append",
+    [LATENCY_OPS + TFS_OP_TRUNCATE] = "truncate",
+    [LATENCY_OPS + TFS_OP_MOUNT] = "mount",
+    [LATENCY_OPS + TFS_OP_UNMOUNT] = "unmount",
+    [LATENCY_OPS + TFS_OP_SHARE] = "share",
+    [LATENCY_OPS + TFS_OP_READ_SHARED] = "read_shared",
+    [LATENCY_OPS + TFS_OP_WRITE_SHARED] = "write_shared",
+    [LATENCY_OPS + TFS_OP_SNAPSHOT] = "snapshot",
+};
+
+void latency_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void latency_unlock(pthread_mutex_t *lock) {
+    if (pthread_mutex_unlock(lock)) {
+        fprintf(stderr, "Error: mutex failed to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the time in nanoseconds of a monotonic clock.
+ */
+unsigned long long latency_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns the bucket of a latency: below LATENCY_SUB_BUCKETS ns one per
+ * value, and then LATENCY_SUB_BUCKETS per power of 2.
+ */
+int latency_bucket(unsigned long long ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return ns;
+    }
+    if (ns >> LATENCY_MAX_SHIFT) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return shift * LATENCY_SUB_BUCKETS + (ns >> shift);
+}
+
+/*
+ * Returns the highest latency that falls in a bucket.
+ */
+unsigned long long latency_bucket_max(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    unsigned long long mantissa = bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/*
+ * Marks the histograms of an exiting thread free for the next thread.
+ */
+void latency_thread_exit(void *arg) {
+    latency_thread_t *self = arg;
+    latency_lock(&latency_threads_lock);
+    self->owned = 0;
+    latency_unlock(&latency_threads_lock);
+}
+
+void latency_init() {
+    if (pthread_key_create(&latency_key, latency_thread_exit)) {
+        fprintf(stderr, "Error: failed to create thread key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the histograms of the calling thread, taking those of an exited
+ * thread or registering new ones on first use.
+ */
+latency_thread_t *latency_thread() {
+    if (latency_self != NULL) {
+        return latency_self;
+    }
+
+    pthread_once(&latency_once, latency_init);
+
+    latency_lock(&latency_threads_lock);
+    latency_thread_t *self = latency_threads;
+    while (self != NULL && self->owned) {
+        self = self->next;
+    }
+    if (self == NULL) {
+        self = calloc(1, sizeof(latency_thread_t));
+        if (self == NULL) {
+            fprintf(stderr, "Error: failed to allocate latency histograms\n");
+            exit(EXIT_FAILURE);
+        }
+        self->next = latency_threads;
+        latency_threads = self;
+    }
+    self->owned = 1;
+    latency_unlock(&latency_threads_lock);
+
+    pthread_setspecific(latency_key, self);
+    latency_self = self;
+    return self;
+}
+
+/*
+ * Records a latency in the histogram of the calling thread.
+ * Input:
+ *  - metric: what it is the time of, see latency_metric_t
+ *  - ns: the latency in nanoseconds
+ */
+void latency_record(int metric, unsigned long long ns) {
+    if (metric < 0 || metric >= LATENCY_METRICS) {
+        return;
+    }
+    unsigned long *count = &latency_thread()->counts[metric][latency_bucket(ns)];
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the highest latency of the fraction of the window below it.
+ */
+double latency_percentile(unsigned long *window, unsigned long count, double fraction) {
+    unsigned long rank = (unsigned long) (fraction * count);
+    unsigned long seen = 0;
+
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += window[bucket];
+        if (seen > rank) {
+            return latency_bucket_max(bucket) / 1000.0;
+        }
+    }
+    return latency_bucket_max(LATENCY_BUCKETS - 1) / 1000.0;
+}
+
+/*
+ * Prints, for every metric recorded since the previous call, the number
+ * of latencies and their percentiles in microseconds, summing the
+ * histograms of every thread.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void latency_print_stats(FILE *fp) {
+    unsigned long window[LATENCY_BUCKETS];
+
+    latency_lock(&latency_stats_lock);
+    fprintf(fp, "latency: %-12s %12s %10s %10s %10s %10s %10s\n", "us", "total", "window", "p50", "p99", "p999",
+            "max");
+    for (int metric = 0; metric < LATENCY_METRICS; metric++) {
+        unsigned long total = 0, count = 0;
+        int highest = 0;
+
+        memset(window, 0, sizeof(window));
+        latency_lock(&latency_threads_lock);
+        for (latency_thread_t *thread = latency_threads; thread != NULL; thread = thread->next) {
+            for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+                window[bucket] += __atomic_load_n(&thread->counts[metric][bucket], __ATOMIC_RELAXED);
+            }
+        }
+        latency_unlock(&latency_threads_lock);
+
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            unsigned long sum = window[bucket];
+            window[bucket] = sum - latency_previous[metric][bucket];
+            latency_previous[metric][bucket] = sum;
+            total += sum;
+            count += window[bucket];
+            if (window[bucket]) {
+                highest = bucket;
+            }
+        }
+
+        if (count == 0) {
+            continue;
+        }
+        fprintf(fp, "latency: %-12s %12lu %10lu %10.1f %10.1f %10.1f %10.1f\n", latency_names[metric], total, count,
+                latency_percentile(window, count, 0.5), latency_percentile(window, count, 0.99),
+                latency_percentile(window, count, 0.999), latency_bucket_max(highest) / 1000.0);
+    }
+    latency_unlock(&latency_stats_lock);
+}
@@ -0,0 +1,34 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+
+#include "../../tecnicofs-protocol.h"
+
+/* Each power of 2 of nanoseconds is split in 2^LATENCY_SUB_BITS buckets,
+ * so a latency is reported within 1/2^LATENCY_SUB_BITS of its value */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+/* Latencies from 2^LATENCY_MAX_SHIFT ns (about a minute) on share the last bucket */
+#define LATENCY_MAX_SHIFT 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_SHIFT - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/*
+ * What a latency is the time of. The requests of opcode op are
+ * LATENCY_OPS + op.
+ */
+typedef enum latency_metric_t {
+    LATENCY_READ_LOCK,  /* wait for the read lock of an i-node */
+    LATENCY_WRITE_LOCK, /* wait for the write lock of an i-node */
+    LATENCY_RECEIVE,    /* system calls draining stream connections, which never block */
+    LATENCY_SEND,       /* system calls sending responses */
+    LATENCY_OPS
+} latency_metric_t;
+
+#define LATENCY_METRICS (LATENCY_OPS + TFS_OP_SNAPSHOT + 1)
+
+unsigned long long latency_now();
+void latency_record(int metric, unsigned long long ns);
+void latency_print_stats(FILE *fp);
+
+#endif /* LATENCY_H */
@@ -7,24 +7,63 @@
 
 #include "../../tecnicofs-api-constants.h"
 
-typedef struct lockstack_node_t {
-    pthread_rwlock_t *lock;
-    struct lockstack_node_t *next;
-} lockstack_node_t;
-
-typedef struct lockstack_t {
-    lockstack_node_t *first;
-} lockstack_t;
+/* Maximum number of components of a path ("a/b/c...") */
+#define MAX_PATH_DEPTH (MAX_FILE_NAME / 2 + 1)
+/* Locks held at most by an operation on valid paths: the root and the
+ * components of two paths (move), the child node and a new i-node */
+#define LOCKSTACK_INLINE_SIZE (2 * (MAX_PATH_DEPTH + 1) + 2)
 
 typedef enum locktype_t {
     READ_LOCK, WRITE_LOCK, NO_LOCK
 } locktype_t;
 
+/*
+ * How a lock was taken with one type, counted while profiling is on
+ */
+typedef struct lockprof_t {
+    unsigned long acquired;
+    unsigned long contended; /* acquisitions that had to wait */
+    unsigned long long waitNs;
+    unsigned long long holdNs;
+} lockprof_t;
+
+/*
+ * Read-write lock with its profile, indexed by locktype_t
+ */
+typedef struct rwlock_t {
+    pthread_rwlock_t rwlock;
+    lockprof_t profile[NO_LOCK];
+} rwlock_t;
+
+/*
+ * Lock held by a stack, with when it was taken if it is profiled
+ */
+typedef struct lockstack_entry_t {
+    rwlock_t *lock;
+    locktype_t type;
+    unsigned long long since; /* 0 when not profiled */
+} lockstack_entry_t;
+
+typedef struct lockstack_t {
+    int size;
+    int capacity;
+    lockstack_entry_t *locks; /* inlineLocks, unless it overflowed to the heap */
+    lockstack_entry_t inlineLocks[LOCKSTACK_INLINE_SIZE];
+} lockstack_t;
+
+void rwlock_init(rwlock_t *lock);
+void rwlock_destroy(rwlock_t *lock);
+void rwlock_reset_profile(rwlock_t *lock);
+void lockstack_set_profiling(int enabled);
+int lockstack_profiling();
 void lockstack_init(lockstack_t *stack);
-int lockstack_trylock(lockstack_t *stack, pthread_rwlock_t *lock);
-void lockstack_addreadlock(lockstack_t *stack, pthread_rwlock_t *lock);
-void lockstack_addwritelock(lockstack_t *stack, pthread_rwlock_t *lock);
+int lockstack_trylock(lockstack_t *stack, rwlock_t *lock);
+void lockstack_lock(lockstack_t *stack, rwlock_t *lock, locktype_t type);
+void lockstack_addreadlock(lockstack_t *stack, rwlock_t *lock);
+void lockstack_addwritelock(lockstack_t *stack, rwlock_t *lock);
+int lockstack_has(lockstack_t *stack, rwlock_t *lock);
 void lockstack_pop(lockstack_t *stack);
+void lockstack_remove(lockstack_t *stack, rwlock_t *lock);
 void lockstack_clear(lockstack_t *stack);
 
 #endif /* LOCKSTACK_H */
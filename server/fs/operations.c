@@ -1,11 +1,50 @@
 #include "operations.h"
+#include "slab.h"
+#include "dcache.h"
+#include "wal.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 int modifyingTasks = 0;
 int printRequest = 0;
 
+/* Most threads printing the tree */
+#define PRINT_MAX_THREADS 8
+/* Subtrees the top of the tree is split into, per printing thread */
+#define PRINT_SUBTREES_PER_THREAD 4
+/* Most segments the tree is split into, whatever its shape */
+#define PRINT_MAX_SEGMENTS 4096
+/* Buffer of the output file of a print */
+#define PRINT_BUFFER_SIZE (1 << 20)
+
+/* Returned by getinumber_optimistic when the path changed while it was read */
+#define RETRY -2
+/* Most directory entries looked through to find the paths of the i-nodes
+ * the lock profile reports */
+#define LOCK_PROFILE_WALK_LIMIT 65536
+
+/* Moves started and finished, an optimistic lookup is only valid if no
+ * move ran while it walked the path */
+unsigned int movesStarted = 0;
+unsigned int movesFinished = 0;
+
+/* I-nodes reported by the statistics when locks are profiled, see profile_locks */
+int lockProfileTop = 0;
+
+/*
+ * Profile of the lock of an i-node, copied to rank it
+ */
+typedef struct lock_profile_entry_t {
+	int inumber;
+	lockprof_t profile[NO_LOCK];
+	unsigned long long waitNs; /* of both types */
+	unsigned long acquired;
+	char path[MAX_FILE_NAME];
+} lock_profile_entry_t;
+
 /* Given a path, fills pointers with strings for the parent path and child
  * file name
  * Input:
@@ -18,7 +57,7 @@ void split_parent_child_from_path(char * path, char ** parent, char ** child) {
 	int len = strlen(path);
 
 	// deal with trailing slash ( a/x vs a/x/ )
-	if (path[len-1] == '/') {
+	if (len > 0 && path[len-1] == '/') {
 		path[len-1] = '\0';
 	}
 
@@ -69,20 +108,15 @@ void destroy_fs() {
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: the directory
  * Returns: SUCCESS or FAIL
  */
 
-int is_dir_empty(DirEntry *dirEntries) {
-	if (dirEntries == NULL) {
+int is_dir_empty(Directory *dir) {
+	if (dir == NULL) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
-		}
-	}
-	return SUCCESS;
+	return directory_count(dir) == 0 ? SUCCESS : FAIL;
 }
 
 
@@ -90,42 +124,69 @@ int is_dir_empty(DirEntry *dirEntries) {
  * Looks for node in directory entry from name.
  * Input:
  *  - name: path of node
- *  - entries: entries of directory
+ *  - dir: the directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
-	if (entries == NULL) {
-		return FAIL;
+int lookup_sub_node(char *name, Directory *dir) {
+	return directory_lookup(dir, name);
+}
+
+/*
+ * Locks an i-node reached while walking a path and then releases the lock
+ * the walk holds on its parent, so at most two levels are locked at a time.
+ * Locks that were in the lockstack before the walk are never released.
+ * A walk never reaches an i-node twice, so the lockstack is only searched
+ * for the lock when it held others before the walk began.
+ * While mutations are logged the parent stays locked: the log holds paths,
+ * so a move of an ancestor must not be logged between the locking of a
+ * node and the record of its change, see wal_log.
+ * Input:
+ *  - inumber: the i-node to lock
+ *  - nType, data: references to copy the i-node into
+ *  - locktype: type of lock to use on the i-node
+ *  - lockstack: reference to lockstack
+ *  - held: reference to the lock the walk holds on the parent, updated to
+ *          the lock it holds on the i-node
+ *  - shared: whether the lockstack held locks before the walk
+ */
+void lock_coupled(int inumber, type *nType, union Data *data, locktype_t locktype,
+				  lockstack_t *lockstack, rwlock_t **held, int shared) {
+	inode_t *inode = inode_at(inumber);
+	int owned = inode != NULL && locktype != NO_LOCK && !(shared && lockstack_has(lockstack, &inode->lock));
+
+	inode_get_unheld(inumber, nType, data, owned ? locktype : NO_LOCK, lockstack);
+
+	if (*held != NULL && !wal_logging()) {
+		lockstack_remove(lockstack, *held);
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
-	return FAIL;
+	*held = owned ? &inode->lock : NULL;
 }
 
 /*
- * Gets inumber of node
+ * Gets inumber of node, walking the path from a given i-node with
+ * hand-over-hand locking: ancestors are released as soon as the next level
+ * is locked, so only the node itself stays locked.
  * Input:
- *  - name: path of node
+ *  - start_inumber: i-node where the path starts
+ *  - name: path of node, relative to start_inumber
  *  - lockstack: reference to lockstack
- * 	- locktype: type of lock to be used on the parent of the node
+ * 	- locktype: type of lock to be used on the node
  * Returns:
  * 	- current_inumber: found node's inumber
  *  - FAIL: if not found
  */
-int getinumber(char *name, lockstack_t *lockstack, locktype_t locktype) {
+int getinumber_from(int start_inumber, char *name, lockstack_t *lockstack, locktype_t locktype) {
 	char full_path[MAX_FILE_NAME];
 	char delim[] = "/";
 	char *saveptr;
 
 	strcpy(full_path, name);
 
-	/* start at root node */
-	int current_inumber = FS_ROOT;
+	int current_inumber = start_inumber;
+	rwlock_t *held = NULL;
+	int shared = lockstack->size > 0;
 	
 	/* use for copy */
 	type nType;
@@ -133,26 +194,133 @@ int getinumber(char *name, lockstack_t *lockstack, locktype_t locktype) {
 
 	char *path = strtok_r(full_path, delim, &saveptr);
 
-	/* get root inode data */
+	/* get start inode data */
 	if (path != NULL) {
-		inode_get(current_inumber, &nType, &data, READ_LOCK, lockstack);
+		lock_coupled(current_inumber, &nType, &data, READ_LOCK, lockstack, &held, shared);
 	}
 		
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
+	/* search for all sub nodes, files have none */
+	while (path != NULL && (current_inumber = nType == T_DIRECTORY ? lookup_sub_node(path, data.dir) : FAIL) != FAIL) {
 		path = strtok_r(NULL, delim, &saveptr);
 		if (path != NULL) {
-			inode_get(current_inumber, &nType, &data, READ_LOCK, lockstack);
+			lock_coupled(current_inumber, &nType, &data, READ_LOCK, lockstack, &held, shared);
 		}
 	}
 
 	if (path == NULL && current_inumber != FAIL) {
-		inode_get(current_inumber, &nType, &data, locktype, lockstack);
+		lock_coupled(current_inumber, &nType, &data, locktype, lockstack, &held, shared);
+	}
+
+	return current_inumber;
+}
+
+/*
+ * Gets inumber of node
+ * Input:
+ *  - name: path of node
+ *  - lockstack: reference to lockstack
+ * 	- locktype: type of lock to be used on the node
+ * Returns:
+ * 	- current_inumber: found node's inumber
+ *  - FAIL: if not found
+ */
+int getinumber(char *name, lockstack_t *lockstack, locktype_t locktype) {
+	return getinumber_from(FS_ROOT, name, lockstack, locktype);
+}
+
+/*
+ * Gets inumber of node without taking any lock or writing to shared memory.
+ * Every i-node in the path is read optimistically and validated against
+ * its sequence number, each one before the next is trusted, and no move
+ * may run meanwhile.
+ * Input:
+ *  - name: path of node
+ *  - trace: where the directories searched are traced for the dcache
+ * Returns:
+ * 	- current_inumber: found node's inumber
+ *  - FAIL: if not found
+ *  - RETRY: if the path changed while it was read
+ */
+int getinumber_optimistic(char *name, dcache_trace_t *trace) {
+	char full_path[MAX_FILE_NAME];
+	char delim[] = "/";
+	char *saveptr;
+
+	unsigned int moves = __atomic_load_n(&movesFinished, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&movesStarted, __ATOMIC_ACQUIRE) != moves) {
+		return RETRY;
+	}
+
+	strcpy(full_path, name);
+
+	/* start at root node */
+	int current_inumber = FS_ROOT;
+	inode_t *inode = inode_at(current_inumber);
+	unsigned int seq = inode_read_begin(inode);
+
+	char *path = strtok_r(full_path, delim, &saveptr);
+
+	while (path != NULL) {
+		/* Used for testing synchronization speedup */
+		insert_delay(DELAY);
+
+		type nType = inode->nodeType;
+		Directory *dir = inode->data.dir;
+		unsigned int gen = __atomic_load_n(&inode->entriesGen, __ATOMIC_RELAXED);
+		if (!inode_read_validate(inode, seq)) {
+			return RETRY;
+		}
+
+		int sub_inumber = FAIL;
+		if (nType == T_DIRECTORY) {
+			DirectoryView view;
+			directory_view(dir, &view);
+			if (!inode_read_validate(inode, seq)) {
+				return RETRY;
+			}
+			sub_inumber = directory_view_lookup(&view, path);
+			dcache_trace(trace, current_inumber, gen);
+		}
+
+		inode_t *sub_inode = sub_inumber == FAIL ? NULL : inode_at(sub_inumber);
+		unsigned int sub_seq = sub_inode == NULL ? 0 : inode_read_begin(sub_inode);
+
+		/* the entry was there while the sub node was not changing yet */
+		if (!inode_read_validate(inode, seq)) {
+			return RETRY;
+		}
+		if (sub_inode == NULL) {
+			current_inumber = FAIL;
+			break;
+		}
+
+		current_inumber = sub_inumber;
+		inode = sub_inode;
+		seq = sub_seq;
+		path = strtok_r(NULL, delim, &saveptr);
+	}
+
+	if (__atomic_load_n(&movesStarted, __ATOMIC_ACQUIRE) != moves) {
+		return RETRY;
 	}
 
 	return current_inumber;
 }
 
+/*
+ * Marks the start of a move, invalidating concurrent optimistic lookups.
+ */
+void move_begin() {
+	__atomic_fetch_add(&movesStarted, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Marks the end of a move.
+ */
+void move_end() {
+	__atomic_fetch_add(&movesFinished, 1, __ATOMIC_RELEASE);
+}
+
 /*
  * Creates a new node given a path.
  * Input:
@@ -191,7 +359,7 @@ int create(char *name, type nodeType){
 		return FAIL;
 	}
 
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
+	if (lookup_sub_node(child_name, pdata.dir) != FAIL) {
 		printf("failed to create %s, already exists in dir %s\n",
 		       child_name, parent_name);
 		lockstack_clear(&lockstack);
@@ -207,12 +375,14 @@ int create(char *name, type nodeType){
 		return FAIL;
 	}
 
-	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
+	unsigned int epoch = snapshot_epoch();
+	if (dir_add_entry(parent_inumber, child_inumber, child_name, epoch) == FAIL) {
 		printf("could not add entry %s in dir %s\n",
 		       child_name, parent_name);
 		lockstack_clear(&lockstack);
 		return FAIL;
 	}
+	wal_log(WAL_CREATE, nodeType, name, NULL, epoch);
 
 	lockstack_clear(&lockstack);
 	return SUCCESS;
@@ -259,7 +429,7 @@ int delete(char *name){
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_node(child_name, pdata.dir);
 
 	if (child_inumber == FAIL) {
 		printf("could not delete %s, does not exist in dir %s\n",
@@ -270,32 +440,87 @@ int delete(char *name){
 
 	inode_get(child_inumber, &cType, &cdata, WRITE_LOCK, &lockstack);
 
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) {
 		printf("could not delete %s: is a directory and not empty\n",
 		       name);
 		lockstack_clear(&lockstack);
 		return FAIL;
 	}
 
+	if (cType == T_FILE && inode_is_open(inode_at(child_inumber))) {
+		printf("could not delete %s: is open\n", name);
+		lockstack_clear(&lockstack);
+		return TECNICOFS_ERROR_FILE_IS_OPEN;
+	}
+
+	/* the parent and the node change in the same snapshot */
+	unsigned int epoch = snapshot_epoch();
+
 	/* remove entry from folder that contained deleted node */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name, epoch) == FAIL) {
 		printf("failed to delete %s from dir %s\n",
 		       child_name, parent_name);
 		lockstack_clear(&lockstack);
 		return FAIL;
 	}
 
-	if (inode_delete(child_inumber) == FAIL) {
+	if (inode_delete(child_inumber, epoch) == FAIL) {
 		printf("could not delete inode number %d from dir %s\n",
 		       child_inumber, parent_name);
 		lockstack_clear(&lockstack);
 		return FAIL;
 	}
+	wal_log(WAL_DELETE, cType, name, NULL, epoch);
 
 	lockstack_clear(&lockstack);
 	return SUCCESS;
 }
 
+/*
+ * Copies a path without empty components, so that "/a//b/" becomes "a/b".
+ */
+void normalize_path(char *dest, char *path) {
+	int len = 0;
+
+	for (char *c = path; *c != '\0'; c++) {
+		if (*c == '/' && (len == 0 || dest[len - 1] == '/')) {
+			continue;
+		}
+		dest[len++] = *c;
+	}
+	if (len > 0 && dest[len - 1] == '/') {
+		len--;
+	}
+	dest[len] = '\0';
+}
+
+/*
+ * Returns the length of the longest common prefix of two normalized paths
+ * that ends at a component boundary.
+ */
+int common_path_length(char *a, char *b) {
+	int common = 0;
+
+	for (int i = 0; ; i++) {
+		int end_a = a[i] == '\0' || a[i] == '/';
+		int end_b = b[i] == '\0' || b[i] == '/';
+		if (end_a && end_b) {
+			common = i;
+		}
+		if (a[i] != b[i] || a[i] == '\0') {
+			return common;
+		}
+	}
+}
+
+/*
+ * Returns whether a path is inside the subtree of another, both normalized.
+ */
+int is_path_below(char *path, char *ancestor) {
+	int len = strlen(ancestor);
+	return common_path_length(ancestor, path) == len && path[len] == '/';
+}
+
 /*
  * Given two paths, fills pointers with the inumbers from the parent and the destination
  * Input:
@@ -306,18 +531,42 @@ int delete(char *name){
  * 	- lockstack: reference to lockstack
  */
 void get_parents(char *pfrom, char* pto, int *pfrom_inumber, int *pto_inumber, lockstack_t *lockstack) {
-	int compare = strcmp(pfrom, pto);
+	char from[MAX_FILE_NAME], to[MAX_FILE_NAME], common[MAX_FILE_NAME];
+
+	normalize_path(from, pfrom);
+	normalize_path(to, pto);
+
+	/* The closest common ancestor stays locked while both parents are
+	 * walked from it, so neither walk has to lock one of its ancestors
+	 * again while holding a lock below it */
+	int len = common_path_length(from, to);
+	strncpy(common, from, len);
+	common[len] = '\0';
+
+	char *rest_from = from[len] == '/' ? from + len + 1 : from + len;
+	char *rest_to = to[len] == '/' ? to + len + 1 : to + len;
+
+	/* the ancestor is written to if it is one of the parents */
+	locktype_t common_locktype = (*rest_from == '\0' || *rest_to == '\0') ? WRITE_LOCK : READ_LOCK;
+	int common_inumber = getinumber(common, lockstack, common_locktype);
+	if (common_inumber == FAIL) {
+		*pfrom_inumber = FAIL;
+		*pto_inumber = FAIL;
+		return;
+	}
+
+	int compare = strcmp(rest_from, rest_to);
 	// Locks the i-nodes acording to the lexicographic order of the paths to avoid deadlocks
 	if (compare == 0) {
 		// As parents are the same, execute getinumber once
-		*pfrom_inumber = getinumber(pfrom, lockstack, WRITE_LOCK);
+		*pfrom_inumber = getinumber_from(common_inumber, rest_from, lockstack, WRITE_LOCK);
 		*pto_inumber = *pfrom_inumber;
 	} else if (compare < 0) {
-		*pfrom_inumber = getinumber(pfrom, lockstack, WRITE_LOCK);
-		*pto_inumber = getinumber(pto, lockstack, WRITE_LOCK);
+		*pfrom_inumber = getinumber_from(common_inumber, rest_from, lockstack, WRITE_LOCK);
+		*pto_inumber = getinumber_from(common_inumber, rest_to, lockstack, WRITE_LOCK);
 	} else {
-		*pto_inumber = getinumber(pto, lockstack, WRITE_LOCK);
-		*pfrom_inumber = getinumber(pfrom, lockstack, WRITE_LOCK);
+		*pto_inumber = getinumber_from(common_inumber, rest_to, lockstack, WRITE_LOCK);
+		*pfrom_inumber = getinumber_from(common_inumber, rest_from, lockstack, WRITE_LOCK);
 	}
 }
 
@@ -340,6 +589,15 @@ int move(char *from, char *to) {
 
 	//start_modifying_task();
 
+	/* a node moved into its own subtree would leave a cycle no walk
+	 * could get out of */
+	normalize_path(from_copy, from);
+	normalize_path(to_copy, to);
+	if (is_path_below(to_copy, from_copy)) {
+		printf("failed to move %s, %s is inside it\n", from, to);
+		return FAIL;
+	}
+
 	lockstack_t lockstack;
 	lockstack_init(&lockstack);
 	
@@ -370,7 +628,7 @@ int move(char *from, char *to) {
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name_from, pfdata.dirEntries);
+	child_inumber = lookup_sub_node(child_name_from, pfdata.dir);
 	if (child_inumber == FAIL) {
 		printf("could not move %s, does not exist in dir %s\n",
 		       child_name_from, parent_name_from);
@@ -391,25 +649,33 @@ int move(char *from, char *to) {
 		}
 	}
 
-	if (lookup_sub_node(child_name_to, ptdata.dirEntries) != FAIL) {
+	if (lookup_sub_node(child_name_to, ptdata.dir) != FAIL) {
 		printf("failed to create %s, already exists in dir %s\n",
 		       child_name_from, parent_name_to);
 		lockstack_clear(&lockstack);
 		return FAIL;
 	}
 
+	move_begin();
+	/* both parents change in the same snapshot */
+	unsigned int epoch = snapshot_epoch();
+
 	/* add entry to destination folder */
-	if (dir_add_entry(parent_inumber_to, child_inumber, child_name_to) == FAIL) {
+	if (dir_add_entry(parent_inumber_to, child_inumber, child_name_to, epoch) == FAIL) {
+		move_end();
 		lockstack_clear(&lockstack);
 		return FAIL;
 	}
 
 	/* remove entry from parent folder that contained the node */
-	if (dir_reset_entry(parent_inumber_from, child_inumber) == FAIL) {
+	if (dir_reset_entry(parent_inumber_from, child_inumber, child_name_from, epoch) == FAIL) {
+		move_end();
 		lockstack_clear(&lockstack);
 		return FAIL;
 	}
+	wal_log(WAL_MOVE, T_NONE, from, to, epoch);
 
+	move_end();
 	lockstack_clear(&lockstack);
 	return SUCCESS;
 }
@@ -423,34 +689,448 @@ int move(char *from, char *to) {
  *     FAIL: otherwise
  */
 int lookup(char *name) {
-	lockstack_t lockstack; 
+	int inumber;
+	if (dcache_lookup(name, &inumber)) {
+		return inumber;
+	}
+
+	dcache_trace_t trace;
+	dcache_trace_init(&trace);
+
+	inumber = getinumber_optimistic(name, &trace);
+	if (inumber == RETRY) {
+		/* the path changed meanwhile, fall back to locking it, and do not
+		 * cache a path that is changing */
+		lockstack_t lockstack; 
+		lockstack_init(&lockstack);
+
+		inumber = getinumber(name, &lockstack, READ_LOCK);
+
+		lockstack_clear(&lockstack);
+		return inumber;
+	}
+
+	dcache_insert(name, inumber, &trace);
+	return inumber;
+}
+
+
+/*
+ * Opens a file, which can not be deleted until it is closed.
+ * Input:
+ *  - name: path of the file
+ *  - mode: READ, WRITE or RW
+ * Returns:
+ *  - inumber: the file's inumber
+ *  - an error code otherwise
+ */
+int open_file(char *name, permission mode) {
+	type nType;
+	lockstack_t lockstack;
 	lockstack_init(&lockstack);
 
-	int inumber = getinumber(name, &lockstack, READ_LOCK);
+	if (mode != READ && mode != WRITE && mode != RW) {
+		return TECNICOFS_ERROR_INVALID_MODE;
+	}
 
-	lockstack_clear(&lockstack);
+	int inumber = getinumber(name, &lockstack, WRITE_LOCK);
+	if (inumber == FAIL) {
+		printf("could not open %s, does not exist\n", name);
+		lockstack_clear(&lockstack);
+		return TECNICOFS_ERROR_FILE_NOT_FOUND;
+	}
 
+	inode_get(inumber, &nType, NULL, NO_LOCK, &lockstack);
+	if (nType != T_FILE) {
+		printf("could not open %s, is not a file\n", name);
+		lockstack_clear(&lockstack);
+		return TECNICOFS_ERROR_OTHER;
+	}
+
+	inode_t *inode = inode_at(inumber);
+	inode->readers += (mode & READ) != 0;
+	inode->writers += (mode & WRITE) != 0;
+
+	lockstack_clear(&lockstack);
 	return inumber;
 }
 
+/*
+ * Closes a file opened with the same mode.
+ * Input:
+ *  - inumber: identifier of the file
+ *  - mode: READ, WRITE or RW
+ * Returns: SUCCESS or an error code
+ */
+int close_file(int inumber, permission mode) {
+	lockstack_t lockstack;
+	lockstack_init(&lockstack);
+	int res = SUCCESS;
+
+	inode_t *inode = inode_at(inumber);
+	if (inode_get(inumber, NULL, NULL, WRITE_LOCK, &lockstack) == FAIL ||
+	    ((mode & READ) && inode->readers == 0) || ((mode & WRITE) && inode->writers == 0)) {
+		res = TECNICOFS_ERROR_FILE_NOT_OPEN;
+	} else {
+		inode->readers -= (mode & READ) != 0;
+		inode->writers -= (mode & WRITE) != 0;
+	}
+
+	lockstack_clear(&lockstack);
+	return res;
+}
 
 /*
- * Prints tecnicofs tree.
+ * Locks an open file, which needs no path lookup as it can not be deleted.
  * Input:
- *  - fp: pointer to output file
+ *  - inumber: identifier of the file
+ *  - locktype: type of lock to be used on the file
+ *  - lockstack: reference to lockstack
+ * Returns: the contents of the file, or NULL if it is not a file
  */
-void print_tecnicofs_tree(FILE *fp){
-	type type;
+File *lock_file(int inumber, locktype_t locktype, lockstack_t *lockstack) {
+	type nType;
 	union Data data;
 
+	if (inode_get(inumber, &nType, &data, locktype, lockstack) == FAIL || nType != T_FILE) {
+		return NULL;
+	}
+	return data.file;
+}
+
+/*
+ * Reads from an open file.
+ * Input:
+ *  - inumber: identifier of the file
+ *  - offset: where to start reading
+ *  - buffer: where to copy the bytes read
+ *  - length: most bytes to read
+ * Returns: the number of bytes read or an error code
+ */
+int read_file(int inumber, size_t offset, char *buffer, int length) {
 	lockstack_t lockstack;
 	lockstack_init(&lockstack);
-    
-	/* Locks the root for writting and prints the tree */
-	inode_get(FS_ROOT, &type, &data, WRITE_LOCK, &lockstack);
-	inode_print_tree(fp, FS_ROOT, "");
-	
+	int res = TECNICOFS_ERROR_FILE_NOT_OPEN;
+
+	File *file = lock_file(inumber, READ_LOCK, &lockstack);
+	if (file != NULL) {
+		res = file_read(file, offset, buffer, length);
+	}
+
+	lockstack_clear(&lockstack);
+	return res;
+}
+
+/*
+ * Writes to an open file, at offset or, if append is set, at its end.
+ * Returns: the number of bytes written or an error code
+ */
+int write_at(int inumber, size_t offset, int append, char *buffer, int length) {
+	lockstack_t lockstack;
+	lockstack_init(&lockstack);
+	int res = TECNICOFS_ERROR_FILE_NOT_OPEN;
+
+	File *file = lock_file(inumber, WRITE_LOCK, &lockstack);
+	if (file != NULL) {
+		if (append) {
+			offset = file_size(file);
+		}
+		if (offset > FILE_MAX_SIZE || length > FILE_MAX_SIZE - offset) {
+			res = TECNICOFS_ERROR_OTHER;
+		} else {
+			file_write(file, offset, buffer, length);
+			res = length;
+		}
+	}
+
 	lockstack_clear(&lockstack);
+	return res;
+}
+
+/*
+ * Writes to an open file, growing it if needed.
+ * Input:
+ *  - inumber: identifier of the file
+ *  - offset: where to start writing
+ *  - buffer: bytes to write
+ *  - length: number of bytes to write
+ * Returns: the number of bytes written or an error code
+ */
+int write_file(int inumber, size_t offset, char *buffer, int length) {
+	return write_at(inumber, offset, 0, buffer, length);
+}
+
+/*
+ * Writes at the end of an open file.
+ * Returns: the number of bytes written or an error code
+ */
+int append_file(int inumber, char *buffer, int length) {
+	return write_at(inumber, 0, 1, buffer, length);
+}
+
+/*
+ * Sets the size of an open file, dropping its end or filling it with zeros.
+ * Input:
+ *  - inumber: identifier of the file
+ *  - size: the new size
+ * Returns: SUCCESS or an error code
+ */
+int truncate_file(int inumber, size_t size) {
+	lockstack_t lockstack;
+	lockstack_init(&lockstack);
+	int res = TECNICOFS_ERROR_FILE_NOT_OPEN;
+
+	File *file = lock_file(inumber, WRITE_LOCK, &lockstack);
+	if (file != NULL) {
+		if (size > FILE_MAX_SIZE) {
+			res = TECNICOFS_ERROR_OTHER;
+		} else {
+			file_truncate(file, size);
+			res = SUCCESS;
+		}
+	}
+
+	lockstack_clear(&lockstack);
+	return res;
+}
+
+/*
+ * Part of the printed tree: a node whose entries are segments of their
+ * own, printed as its path alone, or a whole subtree
+ */
+typedef struct print_segment_t {
+	int inumber;
+	char path[MAX_FILE_NAME];
+	int read;
+	int expanded;
+	char *output;
+	size_t length;
+	int done;
+} print_segment_t;
+
+/*
+ * Print of a snapshot, shared by the threads printing its segments
+ */
+typedef struct print_job_t {
+	unsigned int epoch;
+	print_segment_t *segments;
+	int count;
+	int next; /* first segment not claimed by a thread */
+	pthread_mutex_t lock;
+	pthread_cond_t printed;
+} print_job_t;
+
+/*
+ * Builds the path of an entry of the directory at path.
+ */
+void print_entry_path(char *dest, char *path, char *name) {
+	if (snprintf(dest, MAX_FILE_NAME, "%s/%s", path, name) >= MAX_FILE_NAME) {
+		fprintf(stderr, "truncation when building full path\n");
+	}
+}
+
+/*
+ * Prints the subtree of a node as it was when the snapshot began. No lock
+ * is held while the entries of a directory are printed.
+ */
+void print_subtree(FILE *fp, int inumber, char *path, unsigned int epoch) {
+	type nType;
+	DirEntry *entries;
+	int count;
+
+	if (inode_snapshot_entries(inumber, epoch, &nType, &entries, &count) == FAIL) {
+		return;
+	}
+
+	fprintf(fp, "%s\n", path);
+	for (int i = 0; i < count; i++) {
+		char entryPath[MAX_FILE_NAME];
+		print_entry_path(entryPath, path, entries[i].name);
+		print_subtree(fp, entries[i].inumber, entryPath, epoch);
+	}
+	free(entries);
+}
+
+/*
+ * Splits the top of the tree into segments, a level at a time, until
+ * there are enough directories to print in parallel.
+ * Input:
+ *  - job: the print, whose segments are set
+ *  - subtrees: directories wanted
+ */
+void print_split(print_job_t *job, int subtrees) {
+	print_segment_t *segments = malloc(sizeof(print_segment_t));
+	int count = 1;
+
+	if (segments == NULL) {
+		fprintf(stderr, "Error: failed to allocate print segments\n");
+		exit(EXIT_FAILURE);
+	}
+	segments[0].inumber = FS_ROOT;
+	segments[0].path[0] = '\0';
+	segments[0].read = 0;
+	segments[0].expanded = 0;
+
+	while (1) {
+		DirEntry *entries[count];
+		int entryCounts[count];
+		int directories = 0, added = 0;
+
+		/* reads the segments of the last level */
+		for (int i = 0; i < count; i++) {
+			type nType;
+			entries[i] = NULL;
+			entryCounts[i] = 0;
+			if (!segments[i].read) {
+				segments[i].read = 1;
+				inode_snapshot_entries(segments[i].inumber, job->epoch, &nType, &entries[i], &entryCounts[i]);
+				directories += entryCounts[i] > 0;
+				added += entryCounts[i];
+			}
+		}
+
+		/* the directories read are printed whole, each by a thread */
+		if (directories >= subtrees || directories == 0 || count + added > PRINT_MAX_SEGMENTS) {
+			for (int i = 0; i < count; i++) {
+				free(entries[i]);
+			}
+			break;
+		}
+
+		/* the entries of a directory follow it, as in the printed tree */
+		print_segment_t *level = malloc(sizeof(print_segment_t) * (count + added));
+		if (level == NULL) {
+			fprintf(stderr, "Error: failed to allocate print segments\n");
+			exit(EXIT_FAILURE);
+		}
+		int levelCount = 0;
+		for (int i = 0; i < count; i++) {
+			print_segment_t *segment = &level[levelCount++];
+			*segment = segments[i];
+			segment->expanded |= entryCounts[i] > 0;
+
+			for (int e = 0; e < entryCounts[i]; e++) {
+				print_segment_t *child = &level[levelCount++];
+				child->inumber = entries[i][e].inumber;
+				print_entry_path(child->path, segment->path, entries[i][e].name);
+				child->read = 0;
+				child->expanded = 0;
+			}
+			free(entries[i]);
+		}
+
+		free(segments);
+		segments = level;
+		count = levelCount;
+	}
+
+	for (int i = 0; i < count; i++) {
+		segments[i].done = 0;
+		segments[i].output = NULL;
+		segments[i].length = 0;
+	}
+	job->segments = segments;
+	job->count = count;
+}
+
+/*
+ * Prints a segment into a buffer of its own.
+ */
+void print_segment(print_job_t *job, print_segment_t *segment) {
+	FILE *fp = open_memstream(&segment->output, &segment->length);
+	if (fp == NULL) {
+		fprintf(stderr, "Error: failed to allocate print buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (segment->expanded) {
+		fprintf(fp, "%s\n", segment->path);
+	} else {
+		print_subtree(fp, segment->inumber, segment->path, job->epoch);
+	}
+	fclose(fp);
+}
+
+/*
+ * Claims the first segment no thread took and prints it. Must be called
+ * with the lock of the job held, which is released while it prints.
+ * Returns: whether there was a segment to print
+ */
+int print_next_segment(print_job_t *job) {
+	if (job->next == job->count) {
+		return 0;
+	}
+
+	print_segment_t *segment = &job->segments[job->next++];
+	pthread_mutex_unlock(&job->lock);
+	print_segment(job, segment);
+	pthread_mutex_lock(&job->lock);
+	segment->done = 1;
+	pthread_cond_broadcast(&job->printed);
+	return 1;
+}
+
+/*
+ * Prints segments of the job until every one is claimed.
+ */
+void *print_worker(void *arg) {
+	print_job_t *job = arg;
+
+	pthread_mutex_lock(&job->lock);
+	while (print_next_segment(job));
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+/*
+ * Prints tecnicofs tree, as it was when the print began, while other
+ * operations go on. The top of the tree is split into segments printed
+ * by several threads, and written to fp in order as they are done.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void print_tecnicofs_tree(FILE *fp){
+	print_job_t job;
+	pthread_t threads[PRINT_MAX_THREADS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = cpus < 1 ? 1 : (cpus > PRINT_MAX_THREADS ? PRINT_MAX_THREADS : cpus);
+	int started = 0;
+
+	job.epoch = snapshot_begin();
+	print_split(&job, count * PRINT_SUBTREES_PER_THREAD);
+	job.next = 0;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.printed, NULL);
+
+	/* this thread writes the segments, and prints them too while it waits */
+	for (int i = 1; i < count && job.count > 1; i++) {
+		if (pthread_create(&threads[started], NULL, print_worker, &job) == 0) {
+			started++;
+		}
+	}
+
+	pthread_mutex_lock(&job.lock);
+	for (int i = 0; i < job.count; i++) {
+		while (!job.segments[i].done) {
+			if (!print_next_segment(&job)) {
+				pthread_cond_wait(&job.printed, &job.lock);
+			}
+		}
+		pthread_mutex_unlock(&job.lock);
+		fwrite(job.segments[i].output, 1, job.segments[i].length, fp);
+		free(job.segments[i].output);
+		pthread_mutex_lock(&job.lock);
+	}
+	pthread_mutex_unlock(&job.lock);
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	snapshot_end();
+
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.printed);
+	free(job.segments);
 }
 
 /*
@@ -468,15 +1148,202 @@ int print_tree(char *outputfile) {
         fprintf(stderr, "Error: could not open output file\n");
         return FAIL;
     }
+    char *buffer = malloc(PRINT_BUFFER_SIZE);
+    if (buffer != NULL) {
+        setvbuf(fp, buffer, _IOFBF, PRINT_BUFFER_SIZE);
+    }
 
     /* print tree */
     print_tecnicofs_tree(fp);
 
     /* close output file */
-    if (fclose(fp)) {
+    int failed = fclose(fp);
+    free(buffer);
+    if (failed) {
         fprintf(stderr, "Error: could not close the output file\n");
         return FAIL;
     }
 
 	return SUCCESS;
 }
+
+/*
+ * Turns on the profiling of the locks of the i-nodes, see
+ * lockstack_set_profiling, and has the statistics report the top
+ * i-nodes with the longest waits.
+ * Input:
+ *  - top: number of i-nodes to report, 0 to turn profiling off
+ */
+void profile_locks(int top) {
+	lockProfileTop = top;
+	lockstack_set_profiling(top > 0);
+}
+
+/*
+ * Returns whether the profile of a lock ranks above another: by the time
+ * waited for it, and then by its acquisitions.
+ */
+int lock_profile_above(lock_profile_entry_t *a, lock_profile_entry_t *b) {
+	return a->waitNs != b->waitNs ? a->waitNs > b->waitNs : a->acquired > b->acquired;
+}
+
+/*
+ * Copies the entries of a directory as they are now, holding its lock
+ * only while copying them.
+ * Returns: SUCCESS, or FAIL if the i-node is no longer a directory
+ */
+int lock_profile_entries(int inumber, DirEntry **entries, int *count) {
+	inode_t *inode = inode_at(inumber);
+	lockstack_t lockstack;
+	int res = FAIL;
+
+	lockstack_init(&lockstack);
+	lockstack_addreadlock(&lockstack, &inode->lock);
+	if (inode->nodeType == T_DIRECTORY) {
+		Directory *dir = inode->data.dir;
+		DirEntry *entry;
+		int pos = 0;
+
+		*count = 0;
+		*entries = malloc(sizeof(DirEntry) * (directory_count(dir) + 1));
+		if (*entries == NULL) {
+			fprintf(stderr, "Error: failed to allocate lock profile\n");
+			exit(EXIT_FAILURE);
+		}
+		while ((entry = directory_next(dir, &pos)) != NULL) {
+			(*entries)[(*count)++] = *entry;
+		}
+		res = SUCCESS;
+	}
+	lockstack_clear(&lockstack);
+
+	return res;
+}
+
+/*
+ * Finds the paths of the profiled i-nodes, walking the subtree of a
+ * directory until every one is found or budget entries were looked at.
+ * The walk locks one directory at a time, so a path may be stale if the
+ * tree changes meanwhile, which for a report is good enough.
+ * Returns: the number of i-nodes still without a path
+ */
+int lock_profile_paths(lock_profile_entry_t *entries, int count, int missing, int inumber, char *path,
+					   int *budget) {
+	DirEntry *children;
+	int childCount;
+	char childPath[MAX_FILE_NAME];
+
+	if (*budget <= 0 || lock_profile_entries(inumber, &children, &childCount) == FAIL) {
+		return missing;
+	}
+	*budget -= childCount;
+
+	for (int i = 0; i < childCount && missing > 0; i++) {
+		print_entry_path(childPath, path, children[i].name);
+		for (int j = 0; j < count; j++) {
+			if (entries[j].inumber == children[i].inumber && entries[j].path[0] == '\0') {
+				strcpy(entries[j].path, childPath);
+				missing--;
+			}
+		}
+	}
+	for (int i = 0; i < childCount && missing > 0; i++) {
+		print_entry_path(childPath, path, children[i].name);
+		missing = lock_profile_paths(entries, count, missing, children[i].inumber, childPath, budget);
+	}
+
+	free(children);
+	return missing;
+}
+
+/*
+ * Prints the i-nodes whose locks were waited for the longest, as counted
+ * since they were created, with their current paths. The paths are found
+ * breadth first within each directory, so the walk stops early for the
+ * i-nodes near the root that convoys form on, and gives up after
+ * LOCK_PROFILE_WALK_LIMIT entries.
+ * Input:
+ *  - fp: pointer to the output file
+ *  - top: most i-nodes to print
+ */
+void print_lock_profile(FILE *fp, int top) {
+	lock_profile_entry_t *entries = malloc(sizeof(lock_profile_entry_t) * top);
+	int count = 0;
+	inode_t *inode;
+
+	if (entries == NULL) {
+		fprintf(stderr, "Error: failed to allocate lock profile\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int inumber = 0; (inode = inode_at(inumber)) != NULL; inumber++) {
+		lock_profile_entry_t entry;
+
+		entry.inumber = inumber;
+		entry.path[0] = '\0';
+		entry.waitNs = 0;
+		entry.acquired = 0;
+		for (int t = 0; t < NO_LOCK; t++) {
+			lockprof_t *profile = &inode->lock.profile[t];
+			entry.profile[t].acquired = __atomic_load_n(&profile->acquired, __ATOMIC_RELAXED);
+			entry.profile[t].contended = __atomic_load_n(&profile->contended, __ATOMIC_RELAXED);
+			entry.profile[t].waitNs = __atomic_load_n(&profile->waitNs, __ATOMIC_RELAXED);
+			entry.profile[t].holdNs = __atomic_load_n(&profile->holdNs, __ATOMIC_RELAXED);
+			entry.waitNs += entry.profile[t].waitNs;
+			entry.acquired += entry.profile[t].acquired;
+		}
+		if (entry.acquired == 0 || (count == top && !lock_profile_above(&entry, &entries[count - 1]))) {
+			continue;
+		}
+
+		/* keep the top sorted, dropping the last one when it is full */
+		int pos = count < top ? count++ : count - 1;
+		while (pos > 0 && lock_profile_above(&entry, &entries[pos - 1])) {
+			entries[pos] = entries[pos - 1];
+			pos--;
+		}
+		entries[pos] = entry;
+	}
+
+	/* deleted i-nodes have no path to look for */
+	int missing = count;
+	for (int i = 0; i < count; i++) {
+		if (entries[i].inumber == FS_ROOT) {
+			strcpy(entries[i].path, "/");
+			missing--;
+		} else if (__atomic_load_n(&inode_at(entries[i].inumber)->nodeType, __ATOMIC_RELAXED) == T_NONE) {
+			strcpy(entries[i].path, "(deleted)");
+			missing--;
+		}
+	}
+	if (missing > 0) {
+		int budget = LOCK_PROFILE_WALK_LIMIT;
+		lock_profile_paths(entries, count, missing, FS_ROOT, "", &budget);
+	}
+
+	fprintf(fp, "locks: %8s %5s %10s %10s %10s %10s %s\n", "inumber", "type", "acquired", "contended", "wait us",
+			"hold us", "path");
+	for (int i = 0; i < count; i++) {
+		for (int t = 0; t < NO_LOCK; t++) {
+			lockprof_t *profile = &entries[i].profile[t];
+			fprintf(fp, "locks: %8d %5s %10lu %10lu %10.1f %10.1f %s\n", entries[i].inumber,
+					t == READ_LOCK ? "read" : "write", profile->acquired, profile->contended,
+					profile->waitNs / 1000.0, profile->holdNs / 1000.0,
+					entries[i].path[0] != '\0' ? entries[i].path : "(not found)");
+		}
+	}
+	free(entries);
+}
+
+/*
+ * Prints the statistics of tecnicofs.
+ * Input:
+ * 	- fp: pointer to the output file
+ */
+void print_tecnicofs_stats(FILE *fp) {
+    slab_print_stats(fp);
+    dcache_print_stats(fp);
+    if (lockProfileTop > 0) {
+        print_lock_profile(fp, lockProfileTop);
+    }
+}
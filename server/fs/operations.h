@@ -6,12 +6,21 @@
 
 void init_fs();
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int is_dir_empty(Directory *dir);
 int create(char *name, type nodeType);
 int delete(char *name);
 int lookup(char *name);
 int move(char *from, char *to);
+int open_file(char *name, permission mode);
+int close_file(int inumber, permission mode);
+int read_file(int inumber, size_t offset, char *buffer, int length);
+int write_file(int inumber, size_t offset, char *buffer, int length);
+int append_file(int inumber, char *buffer, int length);
+int truncate_file(int inumber, size_t size);
 void print_tecnicofs_tree(FILE *fp);
 int print_tree(char *outputfile);
+void print_tecnicofs_stats(FILE *fp);
+void profile_locks(int top);
+void print_lock_profile(FILE *fp, int top);
 
 #endif /* FS_H */
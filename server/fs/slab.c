@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+/*
+ * Free block, linked through its first bytes
+ */
+typedef struct slab_block_t {
+    struct slab_block_t *next;
+} slab_block_t;
+
+/*
+ * Free blocks of a size class cached by one thread
+ */
+typedef struct slab_cache_t {
+    slab_block_t *head;
+    int count;
+    /* only written by the owner thread, read when reporting */
+    unsigned long allocs;
+    unsigned long frees;
+} slab_cache_t;
+
+/*
+ * Caches of a thread, kept in a list for the statistics
+ */
+typedef struct slab_thread_t {
+    slab_cache_t caches[SLAB_CACHED_CLASSES];
+    struct slab_thread_t *next;
+} slab_thread_t;
+
+/*
+ * Free blocks of a size class shared by all threads
+ */
+typedef struct slab_depot_t {
+    pthread_mutex_t lock;
+    slab_block_t *head;
+    int count;
+    unsigned long reserved; /* blocks ever carved for the class */
+    unsigned long inUse; /* stable blocks taken, for the uncached classes */
+} slab_depot_t;
+
+slab_depot_t slab_depots[SLAB_CLASSES];
+slab_thread_t *slab_threads = NULL;
+pthread_mutex_t slab_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+pthread_key_t slab_key;
+__thread slab_thread_t *slab_self = NULL;
+size_t slab_page_size;
+
+/*
+ * Returns the size class of a block with the given size.
+ */
+int slab_class(size_t size) {
+    int class = 0;
+    while (((size_t) 1 << (class + SLAB_MIN_SHIFT)) < size) {
+        class++;
+    }
+    return class;
+}
+
+/*
+ * Returns the size of the blocks of the class.
+ */
+size_t slab_class_size(int class) {
+    return (size_t) 1 << (class + SLAB_MIN_SHIFT);
+}
+
+/*
+ * Returns the number of free blocks of the class a thread may cache.
+ */
+int slab_cache_limit(int class) {
+    int limit = SLAB_CACHE_BYTES / slab_class_size(class);
+    return limit < 2 ? 2 : limit;
+}
+
+void slab_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void slab_unlock(pthread_mutex_t *lock) {
+    if (pthread_mutex_unlock(lock)) {
+        fprintf(stderr, "Error: mutex failed to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Gives the pages of free blocks back to the system when their depot
+ * would hold more than SLAB_DEPOT_BYTES with them, keeping the first page of each, which
+ * links the block. The blocks stay mapped and read as zeros, so stable
+ * blocks stay safe to read. Must be called while the blocks are not in
+ * the depot yet, as nobody else may be using them.
+ */
+void slab_release(slab_depot_t *depot, int class, slab_block_t *first, int count) {
+    size_t size = slab_class_size(class);
+
+    if (size < 2 * slab_page_size ||
+        ((size_t) __atomic_load_n(&depot->count, __ATOMIC_RELAXED) + count) * size <= SLAB_DEPOT_BYTES) {
+        return;
+    }
+    for (slab_block_t *block = first; count-- > 0; block = block->next) {
+        madvise((char *) block + slab_page_size, size - slab_page_size, MADV_DONTNEED);
+    }
+}
+
+/*
+ * Moves count blocks from the thread cache to the depot.
+ */
+void slab_flush(slab_cache_t *cache, int class, int count) {
+    if (count == 0) {
+        return;
+    }
+
+    slab_block_t *first = cache->head, *last = first;
+    for (int i = 1; i < count; i++) {
+        last = last->next;
+    }
+    cache->head = last->next;
+    cache->count -= count;
+
+    slab_depot_t *depot = &slab_depots[class];
+    slab_release(depot, class, first, count);
+    slab_lock(&depot->lock);
+    last->next = depot->head;
+    depot->head = first;
+    depot->count += count;
+    slab_unlock(&depot->lock);
+}
+
+/*
+ * Returns the cached blocks of an exiting thread to the depots.
+ * Its counters stay in the list for the statistics.
+ */
+void slab_thread_exit(void *arg) {
+    slab_thread_t *self = arg;
+    for (int class = 0; class < SLAB_CACHED_CLASSES; class++) {
+        slab_flush(&self->caches[class], class, self->caches[class].count);
+    }
+}
+
+void slab_init() {
+    slab_page_size = sysconf(_SC_PAGESIZE);
+    for (int class = 0; class < SLAB_CLASSES; class++) {
+        if (pthread_mutex_init(&slab_depots[class].lock, NULL)) {
+            fprintf(stderr, "Error: failed to init mutex\n");
+            exit(EXIT_FAILURE);
+        }
+        slab_depots[class].head = NULL;
+        slab_depots[class].count = 0;
+        slab_depots[class].reserved = 0;
+        slab_depots[class].inUse = 0;
+    }
+
+    if (pthread_key_create(&slab_key, slab_thread_exit)) {
+        fprintf(stderr, "Error: failed to create thread key\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the caches of the calling thread, registering them on first use.
+ */
+slab_thread_t *slab_thread() {
+    if (slab_self != NULL) {
+        return slab_self;
+    }
+
+    pthread_once(&slab_once, slab_init);
+
+    slab_thread_t *self = calloc(1, sizeof(slab_thread_t));
+    if (self == NULL) {
+        fprintf(stderr, "Error: failed to allocate slab caches\n");
+        exit(EXIT_FAILURE);
+    }
+
+    slab_lock(&slab_threads_lock);
+    self->next = slab_threads;
+    slab_threads = self;
+    slab_unlock(&slab_threads_lock);
+
+    pthread_setspecific(slab_key, self);
+    slab_self = self;
+    return self;
+}
+
+/*
+ * Allocates memory for blocks, aligned to a page so that the pages of a
+ * free block can be given back, see slab_release.
+ */
+void *slab_reserve(size_t size) {
+    void *memory;
+
+    if (posix_memalign(&memory, slab_page_size, size)) {
+        fprintf(stderr, "Error: failed to allocate slab chunk\n");
+        exit(EXIT_FAILURE);
+    }
+    return memory;
+}
+
+/*
+ * Refills the thread cache from the depot, carving new blocks from the
+ * heap only when the depot is empty.
+ */
+void slab_refill(slab_cache_t *cache, int class) {
+    slab_depot_t *depot = &slab_depots[class];
+    int batch = slab_cache_limit(class) / 2;
+
+    slab_lock(&depot->lock);
+    if (depot->head == NULL) {
+        size_t size = slab_class_size(class);
+        size_t chunk = size < SLAB_CHUNK_SIZE ? SLAB_CHUNK_SIZE : size;
+        char *memory = slab_reserve(chunk);
+
+        /* blocks are never given back to the heap */
+        for (size_t offset = 0; offset + size <= chunk; offset += size) {
+            slab_block_t *block = (slab_block_t *) (memory + offset);
+            block->next = depot->head;
+            depot->head = block;
+            depot->count++;
+            depot->reserved++;
+        }
+    }
+
+    while (batch-- > 0 && depot->head != NULL) {
+        slab_block_t *block = depot->head;
+        depot->head = block->next;
+        depot->count--;
+        block->next = cache->head;
+        cache->head = block;
+        cache->count++;
+    }
+    slab_unlock(&depot->lock);
+}
+
+/*
+ * Allocates a block of at least size bytes.
+ * Blocks bigger than 2^SLAB_MAX_SHIFT come straight from the heap.
+ */
+void *slab_alloc(size_t size) {
+    int class = slab_class(size);
+    if (class >= SLAB_CACHED_CLASSES) {
+        void *ptr = malloc(size);
+        if (ptr == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory\n");
+            exit(EXIT_FAILURE);
+        }
+        return ptr;
+    }
+
+    slab_cache_t *cache = &slab_thread()->caches[class];
+    if (cache->head == NULL) {
+        slab_refill(cache, class);
+    }
+
+    slab_block_t *block = cache->head;
+    cache->head = block->next;
+    cache->count--;
+    cache->allocs++;
+    return block;
+}
+
+/*
+ * Releases a block allocated with slab_alloc with the same size.
+ */
+void slab_free(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    int class = slab_class(size);
+    if (class >= SLAB_CACHED_CLASSES) {
+        free(ptr);
+        return;
+    }
+
+    slab_cache_t *cache = &slab_thread()->caches[class];
+    slab_block_t *block = ptr;
+    block->next = cache->head;
+    cache->head = block;
+    cache->count++;
+    cache->frees++;
+
+    if (cache->count > slab_cache_limit(class)) {
+        slab_flush(cache, class, cache->count / 2);
+    }
+}
+
+/*
+ * Allocates a block of at least size bytes that stays mapped for as long
+ * as the server runs, even once freed, for memory read without locks.
+ * Up to 2^SLAB_MAX_SHIFT bytes these are ordinary slab blocks; bigger ones
+ * are kept, once freed, in the depot of their class for the next stable
+ * allocation of that class.
+ */
+void *slab_alloc_stable(size_t size) {
+    int class = slab_class(size);
+    if (class < SLAB_CACHED_CLASSES) {
+        return slab_alloc(size);
+    } else if (class >= SLAB_CLASSES) {
+        fprintf(stderr, "Error: failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_once(&slab_once, slab_init);
+    slab_depot_t *depot = &slab_depots[class];
+    slab_lock(&depot->lock);
+    slab_block_t *block = depot->head;
+    if (block != NULL) {
+        depot->head = block->next;
+        depot->count--;
+    } else {
+        block = slab_reserve(slab_class_size(class));
+        depot->reserved++;
+    }
+    depot->inUse++;
+    slab_unlock(&depot->lock);
+
+    return block;
+}
+
+/*
+ * Releases a block allocated with slab_alloc_stable with the same size.
+ */
+void slab_free_stable(void *ptr, size_t size) {
+    int class = slab_class(size);
+    if (ptr == NULL || class < SLAB_CACHED_CLASSES) {
+        slab_free(ptr, size);
+        return;
+    }
+
+    slab_depot_t *depot = &slab_depots[class];
+    slab_block_t *block = ptr;
+    block->next = NULL;
+    slab_release(depot, class, block, 1);
+    slab_lock(&depot->lock);
+    block->next = depot->head;
+    depot->head = block;
+    depot->count++;
+    depot->inUse--;
+    slab_unlock(&depot->lock);
+}
+
+/*
+ * Prints the occupancy of every size class that has been used.
+ * Input:
+ *  - fp: pointer to output file
+ */
+void slab_print_stats(FILE *fp) {
+    pthread_once(&slab_once, slab_init);
+
+    fprintf(fp, "slab: %10s %10s %10s %10s %10s\n", "size", "reserved", "in use", "cached", "depot");
+    for (int class = 0; class < SLAB_CLASSES; class++) {
+        slab_depot_t *depot = &slab_depots[class];
+        unsigned long allocs = 0, frees = 0, cached = 0;
+
+        slab_lock(&slab_threads_lock);
+        for (slab_thread_t *thread = slab_threads; thread != NULL && class < SLAB_CACHED_CLASSES;
+             thread = thread->next) {
+            slab_cache_t *cache = &thread->caches[class];
+            allocs += __atomic_load_n(&cache->allocs, __ATOMIC_RELAXED);
+            frees += __atomic_load_n(&cache->frees, __ATOMIC_RELAXED);
+            cached += __atomic_load_n(&cache->count, __ATOMIC_RELAXED);
+        }
+        slab_unlock(&slab_threads_lock);
+
+        slab_lock(&depot->lock);
+        unsigned long reserved = depot->reserved;
+        int inDepot = depot->count;
+        allocs += depot->inUse;
+        slab_unlock(&depot->lock);
+
+        if (reserved == 0) {
+            continue;
+        }
+        fprintf(fp, "slab: %10lu %10lu %10ld %10lu %10d\n", (unsigned long) slab_class_size(class),
+                reserved, (long) (allocs - frees), cached, inDepot);
+    }
+}
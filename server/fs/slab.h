@@ -0,0 +1,31 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Blocks are rounded up to powers of 2 from 2^SLAB_MIN_SHIFT to 2^SLAB_MAX_SHIFT,
+ * the biggest extent of a file, bigger ones come from the heap */
+#define SLAB_MIN_SHIFT 6
+#define SLAB_MAX_SHIFT 16
+/* Classes cached by each thread */
+#define SLAB_CACHED_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+/* Stable blocks go up to 2^SLAB_STABLE_MAX_SHIFT, see slab_alloc_stable */
+#define SLAB_STABLE_MAX_SHIFT 40
+#define SLAB_CLASSES (SLAB_STABLE_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+/* Blocks smaller than a chunk are carved from chunks of this size */
+#define SLAB_CHUNK_SIZE (64 * 1024)
+/* Bytes of free blocks a thread may keep cached per class */
+#define SLAB_CACHE_BYTES (256 * 1024)
+/* Bytes of free blocks a depot keeps in memory per class, the pages of
+ * the others are given back to the system */
+#define SLAB_DEPOT_BYTES (4 * 1024 * 1024)
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+void *slab_alloc_stable(size_t size);
+void slab_free_stable(void *ptr, size_t size);
+void slab_print_stats(FILE *fp);
+
+#endif /* SLAB_H */
@@ -5,27 +5,237 @@
 #include "state.h"
 #include "../../tecnicofs-api-constants.h"
 
-inode_t inode_table[INODE_TABLE_SIZE];
+inode_shard_t *inode_shards[INODE_MAX_SHARDS];
+int inode_shard_count = 0;
+/* shard where the last i-node was allocated, where a free slot is likely */
+int inode_shard_hint = 0;
+pthread_mutex_t inode_grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* snapshot running, 0 if none, and the last one started */
+unsigned int snapshot_active = 0;
+unsigned int snapshot_last = 0;
+/* one snapshot runs at a time */
+pthread_mutex_t snapshot_run_lock = PTHREAD_MUTEX_INITIALIZER;
+/* i-nodes saved for the running snapshot, linked by snapshotNext */
+int snapshot_saved = FREE_INODE;
+pthread_mutex_t snapshot_saved_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* whether insert_delay spins, see inode_set_delays */
+int inode_delays = 1;
+
+/* Packing of the tagged head of a shard free list */
+#define FREE_HEAD(tag, inumber) (((unsigned long long) (unsigned int) (tag) << 32) | (unsigned int) (inumber))
+#define FREE_HEAD_TAG(head) ((unsigned int) ((head) >> 32))
+#define FREE_HEAD_INUMBER(head) ((int) (unsigned int) (head))
 
 /*
  * Sleeps for synchronization testing.
  */
 void insert_delay(int cycles) {
+    if (!inode_delays) {
+        return;
+    }
     for (int i = 0; i < cycles; i++) {}
 }
 
 /*
- * Initializes the i-nodes table.
+ * Turns the synchronization testing delays on or off, off while nothing
+ * runs concurrently, such as while the log is replayed.
  */
-void inode_table_init() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
-        if (pthread_rwlock_init(&inode_table[i].lock, NULL)) {
-            fprintf(stderr, "Error: failed to init RWLock\n");
+void inode_set_delays(int enabled) {
+    inode_delays = enabled;
+}
+
+/*
+ * Returns the i-node with the given inumber or NULL if it is out of the table.
+ */
+inode_t *inode_at(int inumber) {
+    if (inumber < 0) {
+        return NULL;
+    }
+
+    int shard = inumber / INODE_SHARD_SIZE;
+    if (shard >= __atomic_load_n(&inode_shard_count, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &inode_shards[shard]->inodes[inumber % INODE_SHARD_SIZE];
+}
+
+/*
+ * Marks the start of a change to the i-node, so that optimistic readers
+ * retry. The caller must hold the i-node write lock.
+ */
+void inode_write_begin(inode_t *inode) {
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Marks the end of a change to the i-node.
+ */
+void inode_write_end(inode_t *inode) {
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Starts an optimistic read of the i-node, without locking it.
+ * Returns: the sequence number to validate the read with; it is odd if the
+ *  i-node is being changed, in which case the read can not succeed
+ */
+unsigned int inode_read_begin(inode_t *inode) {
+    return __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Checks that the i-node did not change since inode_read_begin returned seq,
+ * which means every field read in between is consistent.
+ * Returns: 1 if the read is valid, otherwise 0
+ */
+int inode_read_validate(inode_t *inode, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return !(seq & 1) && __atomic_load_n(&inode->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*
+ * Allocates and initializes a new shard, chaining all its i-nodes in the
+ * shard free list, and publishes it at the end of the table.
+ * Must be called with inode_grow_lock held.
+ * Returns: SUCCESS or FAIL
+ */
+int inode_shard_add() {
+    int index = inode_shard_count;
+    if (index == INODE_MAX_SHARDS) {
+        return FAIL;
+    }
+
+    inode_shard_t *shard = malloc(sizeof(inode_shard_t));
+    if (shard == NULL) {
+        fprintf(stderr, "Error: failed to allocate i-node shard\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int base = index * INODE_SHARD_SIZE;
+    for (int i = 0; i < INODE_SHARD_SIZE; i++) {
+        shard->inodes[i].nodeType = T_NONE;
+        shard->inodes[i].data.dir = NULL;
+        shard->inodes[i].seq = 0;
+        shard->inodes[i].entriesGen = 0;
+        shard->inodes[i].readers = 0;
+        shard->inodes[i].writers = 0;
+        shard->inodes[i].snapshotEpoch = 0;
+        shard->inodes[i].snapshot = NULL;
+        shard->inodes[i].nextFree = (i + 1 < INODE_SHARD_SIZE) ? base + i + 1 : FREE_INODE;
+        rwlock_init(&shard->inodes[i].lock);
+    }
+
+    shard->freeHead = FREE_HEAD(0, base);
+
+    inode_shards[index] = shard;
+    __atomic_store_n(&inode_shard_count, index + 1, __ATOMIC_RELEASE);
+    return SUCCESS;
+}
+
+/*
+ * Pops a free inumber from the free list of the shard.
+ * Returns: the inumber or FREE_INODE if the shard is full
+ */
+int inode_shard_pop(inode_shard_t *shard) {
+    unsigned long long head = __atomic_load_n(&shard->freeHead, __ATOMIC_ACQUIRE);
+
+    while (1) {
+        int inumber = FREE_HEAD_INUMBER(head);
+        if (inumber == FREE_INODE) {
+            return FREE_INODE;
+        }
+
+        /* the i-node may be claimed by someone else meanwhile, then the tag differs */
+        int next = __atomic_load_n(&shard->inodes[inumber % INODE_SHARD_SIZE].nextFree, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&shard->freeHead, &head, FREE_HEAD(FREE_HEAD_TAG(head) + 1, next),
+                                        0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return inumber;
+        }
+    }
+}
+
+/*
+ * Claims a free inumber, growing the table with a new shard when every
+ * existing shard is full.
+ * Returns: the inumber or FAIL if the table can not grow any further
+ */
+int inode_alloc() {
+    while (1) {
+        int count = __atomic_load_n(&inode_shard_count, __ATOMIC_ACQUIRE);
+        int hint = __atomic_load_n(&inode_shard_hint, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < count; i++) {
+            int index = (hint + i) % count;
+            int inumber = inode_shard_pop(inode_shards[index]);
+            if (inumber != FREE_INODE) {
+                if (index != hint) {
+                    __atomic_store_n(&inode_shard_hint, index, __ATOMIC_RELAXED);
+                }
+                return inumber;
+            }
+        }
+
+        if (pthread_mutex_lock(&inode_grow_lock)) {
+            fprintf(stderr, "Error: mutex failed to lock\n");
             exit(EXIT_FAILURE);
         }
+
+        /* another thread may have grown the table meanwhile */
+        int res = SUCCESS;
+        if (inode_shard_count == count) {
+            res = inode_shard_add();
+        }
+
+        if (pthread_mutex_unlock(&inode_grow_lock)) {
+            fprintf(stderr, "Error: mutex failed to unlock\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (res == FAIL) {
+            return FAIL;
+        }
+    }
+}
+
+/*
+ * Returns the inumber to the free list of its shard.
+ */
+void inode_free(int inumber) {
+    inode_shard_t *shard = inode_shards[inumber / INODE_SHARD_SIZE];
+    inode_t *inode = &shard->inodes[inumber % INODE_SHARD_SIZE];
+    unsigned long long head = __atomic_load_n(&shard->freeHead, __ATOMIC_RELAXED);
+
+    do {
+        __atomic_store_n(&inode->nextFree, FREE_HEAD_INUMBER(head), __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&shard->freeHead, &head, FREE_HEAD(FREE_HEAD_TAG(head) + 1, inumber),
+                                          0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Releases the contents of the i-node.
+ */
+void inode_release_data(inode_t *inode) {
+    if (inode->nodeType == T_DIRECTORY) {
+        directory_destroy(inode->data.dir);
+    } else if (inode->nodeType == T_FILE) {
+        file_destroy(inode->data.file);
+    }
+    inode->data.dir = NULL;
+}
+
+/*
+ * Initializes the i-nodes table.
+ */
+void inode_table_init() {
+    inode_shard_count = 0;
+    inode_shard_hint = 0;
+    if (inode_shard_add() == FAIL) {
+        fprintf(stderr, "Error: failed to init i-node table\n");
+        exit(EXIT_FAILURE);
     }
 }
 
@@ -33,24 +243,26 @@ void inode_table_init() {
  * Releases the allocated memory for the i-nodes tables.
  */
 void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	    if (inode_table[i].data.dirEntries)
-            free(inode_table[i].data.dirEntries);
-        }
-        if (pthread_rwlock_destroy(&inode_table[i].lock)) {
-            fprintf(stderr, "Error: failed to destroy RWLock\n");
-            exit(EXIT_FAILURE);
+    for (int s = 0; s < inode_shard_count; s++) {
+        inode_shard_t *shard = inode_shards[s];
+
+        for (int i = 0; i < INODE_SHARD_SIZE; i++) {
+            inode_release_data(&shard->inodes[i]);
+            rwlock_destroy(&shard->inodes[i].lock);
         }
+
+        free(shard);
+        inode_shards[s] = NULL;
     }
+    inode_shard_count = 0;
 }
 
 /*
  * Creates a new i-node in the table with the given information.
+ * The new i-node is locked for writing and added to the lockstack.
  * Input:
  *  - nType: the type of the node (file or directory)
+ *  - lockstack: reference to lockstack, NULL to leave the i-node unlocked
  * Returns:
  *  inumber: identifier of the new i-node, if successfully created
  *     FAIL: if an error occurs
@@ -59,58 +271,170 @@ int inode_create(type nType, lockstack_t *lockstack) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if (lockstack_trylock(lockstack, &inode_table[inumber].lock)) {
-            continue;
-        }
-            /*
-            if (pthread_rwlock_wrlock(&createlock)) {
-                printf("Error: Write lock failed to lock\n");
-                exit(EXIT_FAILURE);
-            }
-            */
-        if (inode_table[inumber].nodeType == T_NONE) {
-            inode_table[inumber].nodeType = nType;
-
-            if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-                
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                }
-            } else {
-                inode_table[inumber].data.fileContents = NULL;
-            }
+    int inumber = inode_alloc();
+    if (inumber == FAIL) {
+        return FAIL;
+    }
 
-            return inumber;
-        }
+    inode_t *inode = inode_at(inumber);
+    /* a freed i-node may still be locked by the thread that deleted it */
+    lockstack_addwritelock(lockstack, &inode->lock);
+    /* the waits for the i-node it was before are not its own */
+    rwlock_reset_profile(&inode->lock);
+
+    inode_write_begin(inode);
+    inode->nodeType = nType;
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        inode->data.dir = directory_create();
+    } else {
+        inode->data.file = file_create();
+    }
+    inode->readers = 0;
+    inode->writers = 0;
+    inode_write_end(inode);
 
-        lockstack_pop(lockstack);
+    return inumber;
+}
+
+/*
+ * Creates a new i-node holding the given contents, which it takes over.
+ * Only used to restore the tree, before anything else runs, when the
+ * i-nodes are allocated in order.
+ * Returns: the inumber of the new i-node or FAIL
+ */
+int inode_restore(type nType, union Data data) {
+    int inumber = inode_alloc();
+    if (inumber == FAIL) {
+        return FAIL;
     }
 
-    return FAIL;
+    inode_t *inode = inode_at(inumber);
+    inode->nodeType = nType;
+    inode->data = data;
+    inode->readers = 0;
+    inode->writers = 0;
+    return inumber;
+}
+
+/*
+ * Saves the i-node as it is for the snapshot epoch, unless it was saved
+ * already. The caller must hold the i-node lock for writing.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - epoch: snapshot read by the operation changing it, 0 if none
+ *  - deleting: whether the i-node is being deleted, in which case it is
+ *    kept until the snapshot ends
+ * Returns: whether the i-node is kept for the snapshot
+ */
+int inode_snapshot_save(int inumber, unsigned int epoch, int deleting) {
+    inode_t *inode = inode_at(inumber);
+    Directory *copy = NULL;
+
+    if (epoch == 0) {
+        return 0;
+    }
+    /* the copy is made before taking the list lock, it may be thrown away */
+    int saved = inode->snapshotEpoch == epoch;
+    if (!saved && inode->nodeType == T_DIRECTORY && directory_count(inode->data.dir) > 0) {
+        copy = directory_copy(inode->data.dir);
+    }
+
+    if (pthread_mutex_lock(&snapshot_saved_lock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
+    }
+    /* the snapshot ended, and its saved i-nodes were released */
+    int kept = __atomic_load_n(&snapshot_active, __ATOMIC_SEQ_CST) == epoch;
+    if (kept && !saved) {
+        inode->snapshotType = inode->nodeType;
+        inode->snapshot = copy;
+        inode->snapshotEpoch = epoch;
+        inode->snapshotNext = snapshot_saved;
+        snapshot_saved = inumber;
+        copy = NULL;
+    }
+    if (kept && deleting) {
+        /* released as the snapshot ends, where it is freed */
+        inode_release_data(inode);
+        inode->nodeType = T_NONE;
+    }
+    if (pthread_mutex_unlock(&snapshot_saved_lock)) {
+        fprintf(stderr, "Error: mutex failed to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+
+    directory_destroy(copy);
+    return kept;
 }
 
 /*
  * Deletes the i-node.
  * Input:
  *  - inumber: identifier of the i-node
+ *  - epoch: snapshot read by the operation, see snapshot_epoch
  * Returns: SUCCESS or FAIL
  */
-int inode_delete(int inumber) {
+int inode_delete(int inumber, unsigned int epoch) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    inode_t *inode = inode_at(inumber);
+    if ((inode == NULL) || (inode->nodeType == T_NONE)) {
         printf("inode_delete: invalid inumber\n");
         return FAIL;
     } 
 
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
+    inode_write_begin(inode);
+    /* a running snapshot may still reach the i-node, which is not reused until it ends */
+    if (inode_snapshot_save(inumber, epoch, 1)) {
+        inode_write_end(inode);
+        return SUCCESS;
+    }
+    inode_release_data(inode);
+    inode->nodeType = T_NONE;
+    inode_write_end(inode);
+
+    inode_free(inumber);
+    return SUCCESS;
+}
+
+/*
+ * Copies the contents of the i-node into the arguments, locking it first.
+ * Input:
+ *  - held: whether the lockstack may hold the lock of the i-node already,
+ *          which is then not taken again
+ */
+int inode_get_locking(int inumber, type *nType, union Data *data, locktype_t type, lockstack_t *lockstack,
+                      int held) {
+    /* Used for testing synchronization speedup */
+    insert_delay(DELAY);
+
+    inode_t *inode = inode_at(inumber);
+    if (inode == NULL) {
+        printf("inode_get: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    if (type != NO_LOCK && !held) {
+        lockstack_lock(lockstack, &inode->lock, type);
+    } else if (type == READ_LOCK) {
+        lockstack_addreadlock(lockstack, &inode->lock);
+    } else if (type == WRITE_LOCK) {
+        lockstack_addwritelock(lockstack, &inode->lock);
+    }
+    
+    if (inode->nodeType == T_NONE) {
+        printf("inode_get: invalid inumber %d\n", inumber);
+        return FAIL;
+    }
+
+    if (nType)
+        *nType = inode->nodeType;
+
+    if (data)
+        *data = inode->data;
+
     return SUCCESS;
 }
 
@@ -124,65 +448,96 @@ int inode_delete(int inumber) {
  * Returns: SUCCESS or FAIL
  */
 int inode_get(int inumber, type *nType, union Data *data, locktype_t type, lockstack_t *lockstack) {
+    return inode_get_locking(inumber, nType, data, type, lockstack, 1);
+}
+
+/*
+ * Copies the contents of the i-node into the arguments, like inode_get,
+ * for an i-node whose lock the lockstack is known not to hold, without
+ * looking for it in the lockstack.
+ */
+int inode_get_unheld(int inumber, type *nType, union Data *data, locktype_t type, lockstack_t *lockstack) {
+    return inode_get_locking(inumber, nType, data, type, lockstack, 0);
+}
+
+
+/*
+ * Replaces the contents of a file.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - fileContents: the new contents
+ *  - len: length of the new contents
+ * Returns: SUCCESS or FAIL
+ */
+int inode_set_file(int inumber, char *fileContents, int len) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if (type == READ_LOCK) {
-        lockstack_addreadlock(lockstack, &inode_table[inumber].lock);
-    } else if (type == WRITE_LOCK) {
-        lockstack_addwritelock(lockstack, &inode_table[inumber].lock);
-    }
-    
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
-        printf("inode_get: invalid inumber %d\n", inumber);
+    inode_t *inode = inode_at(inumber);
+    if ((inode == NULL) || (inode->nodeType == T_NONE)) {
+        printf("inode_set_file: invalid inumber\n");
         return FAIL;
     }
 
-    if (nType)
-        *nType = inode_table[inumber].nodeType;
+    if (inode->nodeType != T_FILE) {
+        printf("inode_set_file: can only set the contents of files\n");
+        return FAIL;
+    }
 
-    if (data)
-        *data = inode_table[inumber].data;
+    if (len < 0) {
+        printf("inode_set_file: invalid length\n");
+        return FAIL;
+    }
 
+    file_truncate(inode->data.file, 0);
+    file_write(inode->data.file, 0, fileContents, len);
     return SUCCESS;
 }
 
+/*
+ * Returns whether the file is open, in any mode. The caller must hold
+ * the i-node lock.
+ */
+int inode_is_open(inode_t *inode) {
+    return inode->readers > 0 || inode->writers > 0;
+}
 
 /*
  * Resets an entry for a directory.
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ *  - epoch: snapshot read by the operation, see snapshot_epoch
  * Returns: SUCCESS or FAIL
  */
-int dir_reset_entry(int inumber, int sub_inumber) {
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name, unsigned int epoch) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    inode_t *inode = inode_at(inumber);
+    if ((inode == NULL) || (inode->nodeType == T_NONE)) {
         printf("inode_reset_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (inode->nodeType != T_DIRECTORY) {
         printf("inode_reset_entry: can only reset entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    inode_t *sub_inode = inode_at(sub_inumber);
+    if ((sub_inode == NULL) || (sub_inode->nodeType == T_NONE)) {
         printf("inode_reset_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
-    }
-    return FAIL;
+    inode_write_begin(inode);
+    inode_snapshot_save(inumber, epoch, 0);
+    __atomic_store_n(&inode->entriesGen, inode->entriesGen + 1, __ATOMIC_RELEASE);
+    int res = directory_remove(inode->data.dir, sub_name, sub_inumber);
+    inode_write_end(inode);
+    return res;
 }
 
 
@@ -192,23 +547,26 @@ int dir_reset_entry(int inumber, int sub_inumber) {
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
  *  - sub_name: name of the sub i-node entry 
+ *  - epoch: snapshot read by the operation, see snapshot_epoch
  * Returns: SUCCESS or FAIL
  */
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name, unsigned int epoch) {
     /* Used for testing synchronization speedup */
     insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    inode_t *inode = inode_at(inumber);
+    if ((inode == NULL) || (inode->nodeType == T_NONE)) {
         printf("inode_add_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    if (inode->nodeType != T_DIRECTORY) {
         printf("inode_add_entry: can only add entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    inode_t *sub_inode = inode_at(sub_inumber);
+    if ((sub_inode == NULL) || (sub_inode->nodeType == T_NONE)) {
         printf("inode_add_entry: invalid entry inumber\n");
         return FAIL;
     }
@@ -218,40 +576,110 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
                entry name must be non-empty\n");
         return FAIL;
     }
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
-        }
+
+    inode_write_begin(inode);
+    inode_snapshot_save(inumber, epoch, 0);
+    __atomic_store_n(&inode->entriesGen, inode->entriesGen + 1, __ATOMIC_RELEASE);
+    int res = directory_insert(inode->data.dir, sub_name, sub_inumber);
+    inode_write_end(inode);
+    return res;
+}
+
+
+/*
+ * Returns the snapshot running, or 0 if none is. An operation reads it
+ * once, holding the locks of every i-node it changes, and gives it to
+ * each change it makes: i-nodes it changes while a snapshot runs are
+ * saved first, so the snapshot sees either all its changes or none.
+ */
+unsigned int snapshot_epoch() {
+    return __atomic_load_n(&snapshot_active, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Starts a snapshot of the tree, waiting for the one running, if any.
+ * Returns: the epoch of the snapshot
+ */
+unsigned int snapshot_begin() {
+    if (pthread_mutex_lock(&snapshot_run_lock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
     }
-    return FAIL;
+    unsigned int epoch = ++snapshot_last;
+    __atomic_store_n(&snapshot_active, epoch, __ATOMIC_SEQ_CST);
+    return epoch;
 }
 
+/*
+ * Ends the running snapshot, releasing the i-nodes saved for it and
+ * freeing the ones deleted while it ran.
+ */
+void snapshot_end() {
+    if (pthread_mutex_lock(&snapshot_saved_lock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(&snapshot_active, 0, __ATOMIC_SEQ_CST);
+    while (snapshot_saved != FREE_INODE) {
+        int inumber = snapshot_saved;
+        inode_t *inode = inode_at(inumber);
+        snapshot_saved = inode->snapshotNext;
+
+        directory_destroy(inode->snapshot);
+        inode->snapshot = NULL;
+        if (inode->nodeType == T_NONE) {
+            inode_free(inumber);
+        }
+    }
+    if (pthread_mutex_unlock(&snapshot_saved_lock) || pthread_mutex_unlock(&snapshot_run_lock)) {
+        fprintf(stderr, "Error: mutex failed to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
 /*
- * Prints the i-nodes table.
+ * Reads an i-node as it was when a snapshot began, copying the entries
+ * of a directory.
  * Input:
  *  - inumber: identifier of the i-node
- *  - name: pointer to the name of current file/dir
+ *  - epoch: the snapshot, which must be running
+ *  - nType: pointer to store the type of the node
+ *  - entries: pointer to store the entries of a directory, to be freed
+ *    by the caller, NULL if it has none
+ *  - count: pointer to store the number of entries
+ * Returns: SUCCESS or FAIL if the i-node did not exist
  */
-void inode_print_tree(FILE *fp, int inumber, char *name) {
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
-        return;
+int inode_snapshot_entries(int inumber, unsigned int epoch, type *nType, DirEntry **entries, int *count) {
+    inode_t *inode = inode_at(inumber);
+    if (inode == NULL) {
+        return FAIL;
     }
 
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
-                }
-                inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path);
-            }
+    lockstack_t lockstack;
+    lockstack_init(&lockstack);
+    lockstack_addreadlock(&lockstack, &inode->lock);
+
+    /* an i-node not saved for the snapshot has not changed since it began */
+    int saved = inode->snapshotEpoch == epoch;
+    *nType = saved ? inode->snapshotType : inode->nodeType;
+    Directory *dir = saved ? inode->snapshot : inode->data.dir;
+
+    *entries = NULL;
+    *count = 0;
+    if (*nType == T_DIRECTORY && directory_count(dir) > 0) {
+        *entries = malloc(sizeof(DirEntry) * directory_count(dir));
+        if (*entries == NULL) {
+            fprintf(stderr, "Error: failed to allocate entries\n");
+            exit(EXIT_FAILURE);
+        }
+
+        DirEntry *entry;
+        int pos = 0;
+        while ((entry = directory_next(dir, &pos)) != NULL) {
+            (*entries)[(*count)++] = *entry;
         }
     }
+
+    lockstack_clear(&lockstack);
+    return *nType == T_NONE ? FAIL : SUCCESS;
 }
@@ -7,13 +7,15 @@
 
 #include "../../tecnicofs-api-constants.h"
 #include "lockstack.h"
+#include "directory.h"
+#include "file.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
+#define INODE_SHARD_SIZE 1024
+#define INODE_MAX_SHARDS 4096
 
 #define SUCCESS 0
 #define FAIL -1
@@ -22,19 +24,11 @@
 
 
 /*
- * Contains the name of the entry and respective i-number
- */
-typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
-	int inumber;
-} DirEntry;
-
-/*
- * Data is either text (file) or entries (DirEntry)
+ * Data is either contents (File) or entries (Directory)
  */
 union Data {
-	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
+	File *file; /* for files */
+	Directory *dir; /* for directories */
 };
 
 /*
@@ -43,20 +37,59 @@ union Data {
 typedef struct inode_t {    
 	type nodeType;
 	union Data data;
-  pthread_rwlock_t lock;
+	rwlock_t lock; /* counts how it is taken, see lockstack_set_profiling */
+	unsigned int seq; /* odd while the i-node is being changed */
+	/* bumped whenever an entry is added to or removed from the directory,
+	 * and never reset, so cached paths through it go stale, see dcache.c */
+	unsigned int entriesGen;
+	int nextFree; /* next free inumber of the shard, while unused */
+	/* times the file is open for reading and for writing, a file open
+	 * in RW mode counts in both */
+	int readers;
+	int writers;
+	/* the i-node as it was when snapshot snapshotEpoch began, saved by
+	 * the first change made to it while the snapshot runs */
+	unsigned int snapshotEpoch;
+	type snapshotType;
+	Directory *snapshot; /* NULL for a directory with no entries */
+	int snapshotNext; /* next i-node saved for the running snapshot */
 } inode_t;
 
+/*
+ * Fixed-size segment of the i-node table. Shards are allocated as the
+ * table grows and are never moved, so pointers to live i-nodes stay valid.
+ * Free i-nodes form a lock-free stack: freeHead packs the first free
+ * inumber (low 32 bits) with a counter bumped on every change (high 32 bits)
+ * so that a stale compare-and-swap can not succeed (ABA problem).
+ */
+typedef struct inode_shard_t {
+	inode_t inodes[INODE_SHARD_SIZE];
+	unsigned long long freeHead;
+} inode_shard_t;
+
 
 void insert_delay(int cycles);
+void inode_set_delays(int enabled);
 void inode_table_init();
 void inode_table_destroy();
+inode_t *inode_at(int inumber);
+void inode_write_begin(inode_t *inode);
+void inode_write_end(inode_t *inode);
+unsigned int inode_read_begin(inode_t *inode);
+int inode_read_validate(inode_t *inode, unsigned int seq);
 int inode_create(type nType, lockstack_t *lockstack);
-int inode_delete(int inumber);
+int inode_restore(type nType, union Data data);
+int inode_delete(int inumber, unsigned int epoch);
 int inode_get(int inumber, type *nType, union Data *data, locktype_t type, lockstack_t *lockstack);
+int inode_get_unheld(int inumber, type *nType, union Data *data, locktype_t type, lockstack_t *lockstack);
 int inode_set_file(int inumber, char *fileContents, int len);
-int dir_reset_entry(int inumber, int sub_inumber);
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
-void inode_print_tree(FILE *fp, int inumber, char *name);
+int inode_is_open(inode_t *inode);
+int dir_reset_entry(int inumber, int sub_inumber, char *sub_name, unsigned int epoch);
+int dir_add_entry(int inumber, int sub_inumber, char *sub_name, unsigned int epoch);
+unsigned int snapshot_epoch();
+unsigned int snapshot_begin();
+void snapshot_end();
+int inode_snapshot_entries(int inumber, unsigned int epoch, type *nType, DirEntry **entries, int *count);
 
 
 #endif /* INODES_H */
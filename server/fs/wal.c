@@ -0,0 +1,652 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "image.h"
+#include "operations.h"
+
+#define WAL_CHECKPOINT_FILE "checkpoint"
+#define WAL_CHECKPOINT_TEMP "checkpoint.tmp"
+/* Segments are named after the lsn of their first record */
+#define WAL_SEGMENT_FORMAT "log-%016llx"
+#define WAL_SEGMENT_NAME_LENGTH 20
+/* Smallest buffer records are gathered in */
+#define WAL_MIN_BUFFER (64 << 10)
+
+/*
+ * Records logged but not written yet
+ */
+typedef struct wal_buffer_t {
+    char *data;
+    size_t length;
+    size_t capacity;
+} wal_buffer_t;
+
+/* whether mutations are logged, off until the log is recovered */
+int wal_enabled = 0;
+int wal_dirfd = -1;
+/* segment being written and the lsn it starts at, used by the flushing thread */
+int wal_fd = -1;
+unsigned long long wal_segment_start = 0;
+
+pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when a flush ends */
+pthread_cond_t wal_synced = PTHREAD_COND_INITIALIZER;
+/* signaled when enough was logged for a checkpoint */
+pthread_cond_t wal_checkpoint_due = PTHREAD_COND_INITIALIZER;
+/* records are added to one buffer while the other one is written */
+wal_buffer_t wal_buffers[2];
+int wal_filling = 0;
+/* lsn after the last record logged, and up to which the log is on disk */
+unsigned long long wal_end = 0;
+unsigned long long wal_durable = 0;
+/* whether a thread is writing the log */
+int wal_flushing = 0;
+/* lsn at which the last checkpoint began */
+unsigned long long wal_checkpointed = 0;
+int wal_closing = 0;
+pthread_t wal_checkpointer;
+
+/* end of the last record logged by the thread, 0 once it is on disk */
+__thread unsigned long long wal_pending = 0;
+
+uint32_t wal_crc_table[256];
+
+void wal_mutex_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void wal_mutex_unlock(pthread_mutex_t *lock) {
+    if (pthread_mutex_unlock(lock)) {
+        fprintf(stderr, "Error: mutex failed to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Fills the table of the CRC-32 of every byte.
+ */
+void wal_crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+        }
+        wal_crc_table[i] = crc;
+    }
+}
+
+/*
+ * Returns the CRC-32 of length bytes of data.
+ */
+uint32_t wal_crc(const char *data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc = wal_crc_table[(crc ^ (unsigned char) data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFF;
+}
+
+/*
+ * Exits on a failed operation on the log, which can not go on without it.
+ */
+void wal_fail(const char *what) {
+    fprintf(stderr, "Error: log %s failed: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Writes length bytes of data to the segment and waits for them to be
+ * on disk.
+ */
+void wal_write(const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(wal_fd, data, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            wal_fail("write");
+        }
+        data += n;
+        length -= n;
+    }
+    if (fdatasync(wal_fd)) {
+        wal_fail("sync");
+    }
+}
+
+/*
+ * Makes the segment starting at lsn start the one written, creating it
+ * if it does not exist.
+ */
+void wal_segment_open(unsigned long long start) {
+    char name[WAL_SEGMENT_NAME_LENGTH + 1];
+
+    if (wal_fd >= 0) {
+        close(wal_fd);
+    }
+    snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, start);
+    wal_fd = openat(wal_dirfd, name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    /* the new entry of the directory must be on disk too */
+    if (wal_fd < 0 || fsync(wal_dirfd)) {
+        wal_fail("segment open");
+    }
+    wal_segment_start = start;
+}
+
+int wal_compare_lsn(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Lists the segments of the log.
+ * Input:
+ *  - starts: pointer to store the lsn each segment starts at, in order,
+ *    to be freed by the caller
+ * Returns: the number of segments
+ */
+int wal_segments(unsigned long long **starts) {
+    int fd = dup(wal_dirfd), count = 0, capacity = 16;
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    struct dirent *entry;
+
+    *starts = malloc(sizeof(unsigned long long) * capacity);
+    if (dir == NULL || *starts == NULL) {
+        wal_fail("directory read");
+    }
+    /* the duplicate shares its position with wal_dirfd, left at the end by the last listing */
+    rewinddir(dir);
+
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long start;
+        char check[WAL_SEGMENT_NAME_LENGTH + 1];
+        if (strlen(entry->d_name) != WAL_SEGMENT_NAME_LENGTH || sscanf(entry->d_name, WAL_SEGMENT_FORMAT, &start) != 1) {
+            continue;
+        }
+        /* only the names the log would give, "log-0x..." and the like are not segments */
+        snprintf(check, sizeof(check), WAL_SEGMENT_FORMAT, start);
+        if (strcmp(check, entry->d_name) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            *starts = realloc(*starts, sizeof(unsigned long long) * capacity);
+            if (*starts == NULL) {
+                wal_fail("directory read");
+            }
+        }
+        (*starts)[count++] = start;
+    }
+    closedir(dir);
+
+    qsort(*starts, count, sizeof(unsigned long long), wal_compare_lsn);
+    return count;
+}
+
+/*
+ * Maps a file of the log directory for reading.
+ * Returns: the mapping, NULL if the file does not exist or is empty
+ */
+char *wal_map(char *name, size_t *size) {
+    struct stat st;
+    char *data = NULL;
+
+    int fd = openat(wal_dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        return NULL;
+    }
+    if (fd < 0 || fstat(fd, &st)) {
+        wal_fail("open");
+    }
+
+    *size = st.st_size;
+    if (*size > 0) {
+        data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (data == MAP_FAILED) {
+            wal_fail("map");
+        }
+        madvise(data, *size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return data;
+}
+
+/*
+ * Restores the tree from the last checkpoint, if there is one, in place
+ * of the tree the server started with. The checkpoint is an image, served
+ * where it is mapped.
+ * Input:
+ *  - dir: the log directory
+ *  - header: where to store the header of the checkpoint, left zeroed
+ *    if there is none
+ * Returns: whether there is a checkpoint
+ */
+int wal_load_checkpoint(char *dir, image_header_t *header) {
+    char path[PATH_MAX];
+
+    memset(header, 0, sizeof(image_header_t));
+    if (faccessat(wal_dirfd, WAL_CHECKPOINT_FILE, F_OK, 0)) {
+        if (errno != ENOENT) {
+            wal_fail("checkpoint open");
+        }
+        return 0;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, WAL_CHECKPOINT_FILE) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        wal_fail("checkpoint open");
+    }
+    destroy_fs();
+    if (image_load(path, header) == FAIL) {
+        wal_fail("checkpoint open");
+    }
+    return 1;
+}
+
+/*
+ * Runs a record of the log again, unless its operation is in the
+ * checkpoint.
+ * Input:
+ *  - record: the record
+ *  - paths: the bytes of its paths
+ *  - lsn: where the record starts
+ *  - header: header of the checkpoint
+ */
+void wal_replay_record(wal_record_t *record, char *paths, unsigned long long lsn, image_header_t *header) {
+    char from[MAX_FILE_NAME], to[MAX_FILE_NAME];
+
+    /* an operation logged while the checkpoint was taken is in it unless
+     * it ran in the checkpoint snapshot, see wal_checkpoint */
+    if (lsn < header->logBegin || (lsn < header->logEnd && record->epoch != header->logEpoch)) {
+        return;
+    }
+
+    memcpy(from, paths, record->fromLength);
+    from[record->fromLength] = '\0';
+    memcpy(to, paths + record->fromLength, record->toLength);
+    to[record->toLength] = '\0';
+
+    int result = FAIL;
+    switch (record->op) {
+        case WAL_CREATE:
+            result = create(from, record->nodeType);
+            break;
+        case WAL_DELETE:
+            result = delete(from);
+            break;
+        case WAL_MOVE:
+            result = move(from, to);
+            break;
+    }
+
+    /* every record logged succeeded, one that fails again was logged out
+     * of order and the tree recovered is not the one acknowledged */
+    if (result != SUCCESS) {
+        fprintf(stderr, "Warning: record at lsn %llu of the log failed to replay\n", lsn);
+    }
+}
+
+/*
+ * Runs the records of the segment that are not in the checkpoint again.
+ * Input:
+ *  - start: lsn the segment starts at
+ *  - header: header of the checkpoint
+ * Returns: the number of bytes of valid records at the start of the
+ *  segment; a record torn by a crash and what follows it are not valid
+ */
+size_t wal_replay_segment(unsigned long long start, image_header_t *header) {
+    char name[WAL_SEGMENT_NAME_LENGTH + 1];
+    size_t size = 0, offset = 0;
+
+    snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, start);
+    char *data = wal_map(name, &size);
+
+    while (size - offset >= sizeof(wal_record_t)) {
+        wal_record_t record;
+        memcpy(&record, data + offset, sizeof(record));
+
+        size_t length = sizeof(record) + record.fromLength + record.toLength;
+        /* the log was synced past the records before the checkpoint, which are skipped anyway */
+        int checked = start + offset + length > header->logBegin;
+        if (record.fromLength >= MAX_FILE_NAME || record.toLength >= MAX_FILE_NAME || size - offset < length ||
+            (checked && wal_crc(data + offset + sizeof(record.crc), length - sizeof(record.crc)) != record.crc)) {
+            break;
+        }
+
+        wal_replay_record(&record, data + offset + sizeof(record), start + offset, header);
+        offset += length;
+    }
+
+    if (data != NULL) {
+        munmap(data, size);
+    }
+    return offset;
+}
+
+/*
+ * Runs the log from the checkpoint on, and drops what follows the last
+ * valid record.
+ * Input:
+ *  - header: header of the checkpoint
+ *  - last: pointer to store the lsn the last segment starts at
+ * Returns: the lsn after the last valid record
+ */
+unsigned long long wal_replay(image_header_t *header, unsigned long long *last) {
+    unsigned long long *starts;
+    int count = wal_segments(&starts);
+    int first = 0, valid;
+
+    /* segments ending before the checkpoint began hold nothing to run */
+    while (first + 1 < count && starts[first + 1] <= header->logBegin) {
+        first++;
+    }
+
+    unsigned long long end = count > 0 ? starts[first] : header->logEnd;
+    for (valid = first; valid < count && starts[valid] == end; valid++) {
+        size_t size = wal_replay_segment(starts[valid], header);
+        end += size;
+
+        char name[WAL_SEGMENT_NAME_LENGTH + 1];
+        snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, starts[valid]);
+        struct stat st;
+        if (fstatat(wal_dirfd, name, &st, 0)) {
+            wal_fail("stat");
+        }
+        if ((size_t) st.st_size != size) {
+            fprintf(stderr, "Warning: dropping %lld bytes torn from the log\n", (long long) (st.st_size - size));
+            int fd = openat(wal_dirfd, name, O_WRONLY | O_CLOEXEC);
+            if (fd < 0 || ftruncate(fd, size) || fsync(fd)) {
+                wal_fail("truncate");
+            }
+            close(fd);
+            valid++;
+            break;
+        }
+    }
+
+    /* segments after a torn one were never acknowledged */
+    for (int i = valid; i < count; i++) {
+        char name[WAL_SEGMENT_NAME_LENGTH + 1];
+        snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, starts[i]);
+        unlinkat(wal_dirfd, name, 0);
+    }
+
+    *last = valid > first ? starts[valid - 1] : end;
+    free(starts);
+    return end;
+}
+
+/*
+ * Removes the segments that end before lsn.
+ */
+void wal_trim(unsigned long long lsn) {
+    unsigned long long *starts;
+    int count = wal_segments(&starts);
+
+    for (int i = 0; i + 1 < count && starts[i + 1] <= lsn; i++) {
+        char name[WAL_SEGMENT_NAME_LENGTH + 1];
+        snprintf(name, sizeof(name), WAL_SEGMENT_FORMAT, starts[i]);
+        unlinkat(wal_dirfd, name, 0);
+    }
+    free(starts);
+}
+
+/*
+ * Saves the tree to a new checkpoint, while operations go on, and drops
+ * the segments of the log it makes useless.
+ *
+ * The tree is read from a snapshot. The operations logged before begin
+ * read their epoch before the snapshot began, so they are in it. Those
+ * logged between begin and end are in it unless they read the epoch of
+ * the snapshot. Those logged after end are not: an operation that read
+ * an older epoch holds the locks of the directories it changes and of
+ * their ancestors, which the snapshot had to read, until its record is
+ * logged.
+ */
+void wal_checkpoint() {
+    image_header_t header;
+
+    wal_mutex_lock(&wal_lock);
+    unsigned long long begin = wal_end;
+    wal_mutex_unlock(&wal_lock);
+    unsigned int epoch = snapshot_begin();
+
+    int fd = openat(wal_dirfd, WAL_CHECKPOINT_TEMP, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if (fp == NULL) {
+        wal_fail("checkpoint open");
+    }
+    setvbuf(fp, NULL, _IOFBF, IMAGE_BUFFER_SIZE);
+    if (image_dump(fp, epoch, &header) == FAIL) {
+        wal_fail("checkpoint write");
+    }
+
+    wal_mutex_lock(&wal_lock);
+    header.logEnd = wal_end;
+    wal_mutex_unlock(&wal_lock);
+    snapshot_end();
+    header.logBegin = begin;
+    header.logEpoch = epoch;
+
+    /* the replay decides which records the checkpoint holds by their lsn,
+     * which a log cut short before end would give to other records */
+    wal_pending = header.logEnd;
+    wal_sync();
+
+    if (image_finish(fp, &header) == FAIL || fclose(fp)) {
+        wal_fail("checkpoint write");
+    }
+    if (renameat(wal_dirfd, WAL_CHECKPOINT_TEMP, wal_dirfd, WAL_CHECKPOINT_FILE) || fsync(wal_dirfd)) {
+        wal_fail("checkpoint rename");
+    }
+    wal_trim(begin);
+
+    wal_mutex_lock(&wal_lock);
+    wal_checkpointed = begin;
+    wal_mutex_unlock(&wal_lock);
+}
+
+/*
+ * Takes a checkpoint once WAL_CHECKPOINT_BYTES were logged since the last
+ * one, or WAL_CHECKPOINT_INTERVAL seconds went by with anything logged.
+ */
+void *wal_checkpointer_run(void *arg) {
+    wal_mutex_lock(&wal_lock);
+    while (!wal_closing) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += WAL_CHECKPOINT_INTERVAL;
+
+        while (!wal_closing && wal_end - wal_checkpointed < WAL_CHECKPOINT_BYTES) {
+            if (pthread_cond_timedwait(&wal_checkpoint_due, &wal_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        if (wal_closing || wal_end == wal_checkpointed) {
+            continue;
+        }
+
+        wal_mutex_unlock(&wal_lock);
+        wal_checkpoint();
+        wal_mutex_lock(&wal_lock);
+    }
+    wal_mutex_unlock(&wal_lock);
+    return NULL;
+}
+
+/*
+ * Recovers the tree from the log in dir, created if it does not exist,
+ * and logs the mutations from then on. Must be called on the empty tree,
+ * before anything else runs.
+ */
+void wal_open(char *dir) {
+    image_header_t header;
+    unsigned long long last;
+
+    wal_crc_init();
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        wal_fail("directory create");
+    }
+    wal_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (wal_dirfd < 0) {
+        wal_fail("directory open");
+    }
+
+    /* nothing runs concurrently with the recovery */
+    inode_set_delays(0);
+    int checkpointed = wal_load_checkpoint(dir, &header);
+    wal_end = wal_replay(&header, &last);
+    inode_set_delays(1);
+
+    wal_durable = wal_end;
+    wal_checkpointed = header.logBegin;
+    wal_segment_open(last);
+    wal_enabled = 1;
+    if (!checkpointed) {
+        wal_checkpoint();
+    }
+
+    if (pthread_create(&wal_checkpointer, NULL, wal_checkpointer_run, NULL) != 0) {
+        fprintf(stderr, "Error: could not create thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Writes what is left of the log and stops logging.
+ */
+void wal_close() {
+    if (!wal_enabled) {
+        return;
+    }
+
+    wal_mutex_lock(&wal_lock);
+    wal_closing = 1;
+    pthread_cond_signal(&wal_checkpoint_due);
+    wal_pending = wal_end;
+    wal_mutex_unlock(&wal_lock);
+    pthread_join(wal_checkpointer, NULL);
+
+    wal_sync();
+    wal_enabled = 0;
+    close(wal_fd);
+    close(wal_dirfd);
+    for (int i = 0; i < 2; i++) {
+        free(wal_buffers[i].data);
+    }
+}
+
+/*
+ * Returns whether mutations are logged.
+ */
+int wal_logging() {
+    return wal_enabled;
+}
+
+/*
+ * Logs a mutation. The caller must still hold the locks of the i-nodes it
+ * changed and of every ancestor on its paths, so that the log has the
+ * mutations in the order they were made and a move of an ancestor is not
+ * logged before a change below it, and call wal_sync before acknowledging
+ * it.
+ * Input:
+ *  - op: the mutation
+ *  - nodeType: type of the node created or deleted
+ *  - from: its path, or the path a node was moved from
+ *  - to: the path a node was moved to, NULL for the others
+ *  - epoch: snapshot read by the operation, see snapshot_epoch
+ */
+void wal_log(wal_op_t op, type nodeType, char *from, char *to, unsigned int epoch) {
+    char record[sizeof(wal_record_t) + 2 * MAX_FILE_NAME];
+
+    if (!wal_enabled) {
+        return;
+    }
+
+    wal_record_t header = { 0, op, nodeType, strlen(from), to == NULL ? 0 : strlen(to), epoch };
+    size_t length = sizeof(header) + header.fromLength + header.toLength;
+    memcpy(record, &header, sizeof(header));
+    memcpy(record + sizeof(header), from, header.fromLength);
+    if (to != NULL) {
+        memcpy(record + sizeof(header) + header.fromLength, to, header.toLength);
+    }
+    header.crc = wal_crc(record + sizeof(header.crc), length - sizeof(header.crc));
+    memcpy(record, &header.crc, sizeof(header.crc));
+
+    wal_mutex_lock(&wal_lock);
+    wal_buffer_t *buffer = &wal_buffers[wal_filling];
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity < WAL_MIN_BUFFER ? WAL_MIN_BUFFER : buffer->capacity * 2;
+        buffer->data = realloc(buffer->data, capacity);
+        if (buffer->data == NULL) {
+            fprintf(stderr, "Error: failed to allocate log buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, record, length);
+    buffer->length += length;
+    wal_end += length;
+    wal_pending = wal_end;
+    if (wal_end - wal_checkpointed >= WAL_CHECKPOINT_BYTES) {
+        pthread_cond_signal(&wal_checkpoint_due);
+    }
+    wal_mutex_unlock(&wal_lock);
+}
+
+/*
+ * Waits until the mutations logged by the calling thread are on disk.
+ * The first thread to wait writes and syncs everything logged so far, by
+ * every thread, while those that come meanwhile wait for the next sync,
+ * so concurrent workers share each one.
+ */
+void wal_sync() {
+    unsigned long long lsn = wal_pending;
+
+    if (lsn == 0) {
+        return;
+    }
+    wal_pending = 0;
+
+    wal_mutex_lock(&wal_lock);
+    while (wal_durable < lsn) {
+        if (wal_flushing) {
+            pthread_cond_wait(&wal_synced, &wal_lock);
+            continue;
+        }
+
+        wal_flushing = 1;
+        wal_buffer_t *buffer = &wal_buffers[wal_filling];
+        wal_filling ^= 1;
+        unsigned long long end = wal_end;
+        wal_mutex_unlock(&wal_lock);
+
+        wal_write(buffer->data, buffer->length);
+        buffer->length = 0;
+        if (end - wal_segment_start >= WAL_SEGMENT_SIZE) {
+            wal_segment_open(end);
+        }
+
+        wal_mutex_lock(&wal_lock);
+        wal_durable = end;
+        wal_flushing = 0;
+        pthread_cond_broadcast(&wal_synced);
+    }
+    wal_mutex_unlock(&wal_lock);
+}
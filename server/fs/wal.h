@@ -0,0 +1,39 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+
+#include "../../tecnicofs-api-constants.h"
+
+/* Bytes of log after which it goes on in a new segment file */
+#define WAL_SEGMENT_SIZE (16 << 20)
+/* Bytes of log after which a checkpoint is taken */
+#define WAL_CHECKPOINT_BYTES (64 << 20)
+/* Seconds after which a checkpoint is taken, if anything was logged */
+#define WAL_CHECKPOINT_INTERVAL 60
+
+typedef enum wal_op_t {
+    WAL_CREATE = 1, WAL_DELETE, WAL_MOVE
+} wal_op_t;
+
+/*
+ * Record of the log, followed by the bytes of its paths, without '\0'.
+ * The position of a record in the log, counting from the first record
+ * ever logged, is its log sequence number (lsn).
+ */
+typedef struct __attribute__((packed)) wal_record_t {
+    uint32_t crc; /* of the rest of the record, paths included */
+    uint8_t op;
+    uint8_t nodeType;
+    uint16_t fromLength;
+    uint16_t toLength;
+    uint32_t epoch; /* snapshot read by the operation, see snapshot_epoch */
+} wal_record_t;
+
+void wal_open(char *dir);
+void wal_close();
+int wal_logging();
+void wal_log(wal_op_t op, type nodeType, char *from, char *to, unsigned int epoch);
+void wal_sync();
+
+#endif /* WAL_H */
@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "fs/state.h"
+
+/*
+ * Decodes a text command such as "c path f".
+ * Returns: SUCCESS or FAIL
+ */
+int decode_text(char *message, request_t *request) {
+    char token = '\0';
+    int numTokens = sscanf(message, "%c %99s %99s", &token, request->textArgs[0], request->textArgs[1]);
+
+    request->binary = 0;
+    request->args[0] = request->textArgs[0];
+    request->args[1] = request->textArgs[1];
+    request->argc = numTokens - 1;
+
+    switch (token) {
+        case 'c':
+            request->opcode = TFS_OP_CREATE;
+            /* the node type is not a path */
+            request->nodeType = request->textArgs[1][0];
+            request->argc = 1;
+            return numTokens == 3 ? SUCCESS : FAIL;
+        case 'l':
+            request->opcode = TFS_OP_LOOKUP;
+            return numTokens == 2 ? SUCCESS : FAIL;
+        case 'd':
+            request->opcode = TFS_OP_DELETE;
+            return numTokens == 2 ? SUCCESS : FAIL;
+        case 'm':
+            request->opcode = TFS_OP_MOVE;
+            return numTokens == 3 ? SUCCESS : FAIL;
+        case 'p':
+            request->opcode = TFS_OP_PRINT;
+            return numTokens == 2 ? SUCCESS : FAIL;
+        case 's':
+            request->opcode = TFS_OP_STATS;
+            return numTokens == 2 ? SUCCESS : FAIL;
+        case 'i':
+            request->opcode = TFS_OP_SNAPSHOT;
+            return numTokens == 2 ? SUCCESS : FAIL;
+    }
+    return FAIL;
+}
+
+/*
+ * Points arg at the length-prefixed path starting at *offset of the
+ * message, advancing the offset past it.
+ * Returns: SUCCESS or FAIL if the path is malformed
+ */
+int decode_path(char *message, size_t length, size_t *offset, char **arg) {
+    uint16_t pathlen;
+
+    if (length - *offset < sizeof(pathlen)) {
+        return FAIL;
+    }
+    memcpy(&pathlen, message + *offset, sizeof(pathlen));
+    *offset += sizeof(pathlen);
+
+    /* the path must fit the buffers of the file system, be terminated and,
+     * as in the text protocol, not be empty */
+    if (pathlen < 2 || pathlen > MAX_FILE_NAME || length - *offset < pathlen) {
+        return FAIL;
+    }
+    char *path = message + *offset;
+    if (memchr(path, '\0', pathlen) != path + pathlen - 1) {
+        return FAIL;
+    }
+
+    *arg = path;
+    *offset += pathlen;
+    return SUCCESS;
+}
+
+/*
+ * Copies the integer of the given size starting at *offset of the
+ * message, advancing the offset past it.
+ * Returns: SUCCESS or FAIL if the message ends before it
+ */
+int decode_integer(char *message, size_t length, size_t *offset, void *value, size_t size) {
+    if (length - *offset < size) {
+        return FAIL;
+    }
+    memcpy(value, message + *offset, size);
+    *offset += size;
+    return SUCCESS;
+}
+
+/*
+ * Decodes the arguments of a file operation that follow its path.
+ * Returns: SUCCESS or FAIL
+ */
+int decode_file_arguments(char *message, size_t length, size_t *offset, request_t *request) {
+    switch (request->opcode) {
+        case TFS_OP_OPEN:
+            if (decode_integer(message, length, offset, &request->mode, sizeof(request->mode)) == FAIL) {
+                return FAIL;
+            }
+            /* fall through */
+        case TFS_OP_UNMOUNT:
+            return decode_integer(message, length, offset, &request->session, sizeof(request->session));
+        case TFS_OP_SHARE:
+            if (decode_integer(message, length, offset, &request->session, sizeof(request->session)) == FAIL) {
+                return FAIL;
+            }
+            return decode_integer(message, length, offset, &request->dataLength, sizeof(request->dataLength));
+        case TFS_OP_CLOSE:
+        case TFS_OP_READ:
+        case TFS_OP_READ_SHARED:
+        case TFS_OP_WRITE_SHARED:
+        case TFS_OP_WRITE:
+        case TFS_OP_APPEND:
+        case TFS_OP_TRUNCATE:
+            break;
+        default:
+            return SUCCESS;
+    }
+
+    if (decode_integer(message, length, offset, &request->session, sizeof(request->session)) == FAIL ||
+        decode_integer(message, length, offset, &request->fd, sizeof(request->fd)) == FAIL) {
+        return FAIL;
+    }
+
+    switch (request->opcode) {
+        case TFS_OP_READ:
+            if (decode_integer(message, length, offset, &request->offset, sizeof(request->offset)) == FAIL) {
+                return FAIL;
+            }
+            return decode_integer(message, length, offset, &request->dataLength, sizeof(request->dataLength));
+        case TFS_OP_TRUNCATE:
+            return decode_integer(message, length, offset, &request->offset, sizeof(request->offset));
+        case TFS_OP_READ_SHARED:
+        case TFS_OP_WRITE_SHARED:
+            if (decode_integer(message, length, offset, &request->offset, sizeof(request->offset)) == FAIL ||
+                decode_integer(message, length, offset, &request->sharedOffset, sizeof(request->sharedOffset)) == FAIL) {
+                return FAIL;
+            }
+            return decode_integer(message, length, offset, &request->dataLength, sizeof(request->dataLength));
+        case TFS_OP_WRITE:
+            if (decode_integer(message, length, offset, &request->offset, sizeof(request->offset)) == FAIL) {
+                return FAIL;
+            }
+            /* fall through */
+        case TFS_OP_APPEND:
+            if (decode_integer(message, length, offset, &request->dataLength, sizeof(request->dataLength)) == FAIL ||
+                length - *offset < request->dataLength) {
+                return FAIL;
+            }
+            request->data = message + *offset;
+            *offset += request->dataLength;
+            return SUCCESS;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Decodes the arguments of request->opcode, starting at *offset of the
+ * message, and advances the offset past them.
+ * Returns: SUCCESS or FAIL
+ */
+int decode_arguments(char *message, size_t length, size_t *offset, request_t *request) {
+    switch (request->opcode) {
+        case TFS_OP_MOVE:
+            request->argc = 2;
+            break;
+        case TFS_OP_CREATE:
+        case TFS_OP_DELETE:
+        case TFS_OP_LOOKUP:
+        case TFS_OP_PRINT:
+        case TFS_OP_STATS:
+        case TFS_OP_SNAPSHOT:
+        case TFS_OP_OPEN:
+            request->argc = 1;
+            break;
+        case TFS_OP_SHARDS:
+        case TFS_OP_CLOSE:
+        case TFS_OP_READ:
+        case TFS_OP_WRITE:
+        case TFS_OP_APPEND:
+        case TFS_OP_TRUNCATE:
+        case TFS_OP_MOUNT:
+        case TFS_OP_UNMOUNT:
+        case TFS_OP_SHARE:
+        case TFS_OP_READ_SHARED:
+        case TFS_OP_WRITE_SHARED:
+            request->argc = 0;
+            break;
+        default:
+            return FAIL;
+    }
+
+    for (int i = 0; i < request->argc; i++) {
+        if (decode_path(message, length, offset, &request->args[i]) == FAIL) {
+            return FAIL;
+        }
+    }
+
+    if (request->opcode == TFS_OP_CREATE) {
+        if (*offset == length) {
+            return FAIL;
+        }
+        request->nodeType = message[(*offset)++];
+    }
+
+    return decode_file_arguments(message, length, offset, request);
+}
+
+/*
+ * Decodes a binary request without copying its arguments.
+ * Returns: SUCCESS or FAIL
+ */
+int decode_binary(char *message, size_t length, request_t *request) {
+    tfs_request_header header;
+    size_t offset = sizeof(header);
+
+    /* failures are answered in binary too */
+    request->binary = 1;
+    request->opcode = 0;
+    if (length < sizeof(header)) {
+        return FAIL;
+    }
+    memcpy(&header, message, sizeof(header));
+    request->id = header.id;
+    request->opcode = header.opcode;
+    if (header.version != TFS_VERSION) {
+        return FAIL;
+    }
+
+    if (header.opcode == TFS_OP_BATCH) {
+        /* the entries are decoded one at a time as they run */
+        if (length - offset < sizeof(request->batchCount)) {
+            return FAIL;
+        }
+        memcpy(&request->batchCount, message + offset, sizeof(request->batchCount));
+        request->batchOffset = offset + sizeof(request->batchCount);
+        return request->batchCount <= TFS_MAX_BATCH ? SUCCESS : FAIL;
+    }
+
+    if (decode_arguments(message, length, &offset, request) == FAIL) {
+        return FAIL;
+    }
+    return offset == length ? SUCCESS : FAIL;
+}
+
+/*
+ * Decodes the next entry of a batch, starting at *offset of the message,
+ * and advances the offset past it.
+ * Returns: SUCCESS or FAIL
+ */
+int decode_batch_entry(char *message, size_t length, size_t *offset, request_t *entry) {
+    entry->binary = 1;
+    entry->id = 0;
+    entry->nodeType = '\0';
+
+    if (*offset == length) {
+        return FAIL;
+    }
+    entry->opcode = message[(*offset)++];
+    return decode_arguments(message, length, offset, entry);
+}
+
+/*
+ * Returns whether an operation may run as an entry of a batch. Only the
+ * operations on the tree may: a read would not fit its bytes in the
+ * vector of results, a share takes a memfd the batch does not carry, and
+ * the others act on sessions and open files, which are not batched.
+ */
+int batchable_opcode(uint8_t opcode) {
+    switch (opcode) {
+        case TFS_OP_CREATE:
+        case TFS_OP_DELETE:
+        case TFS_OP_LOOKUP:
+        case TFS_OP_MOVE:
+        case TFS_OP_PRINT:
+        case TFS_OP_STATS:
+        case TFS_OP_SHARDS:
+        case TFS_OP_SNAPSHOT:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Decodes a request received in a message, in either protocol.
+ * Input:
+ *  - message: the received bytes, followed by a '\0'
+ *  - length: number of received bytes
+ *  - request: reference to store the decoded request
+ * Returns: SUCCESS or FAIL
+ */
+int decode_request(char *message, size_t length, request_t *request) {
+    request->id = 0;
+    request->nodeType = '\0';
+
+    if (length > 0 && (unsigned char) message[0] == TFS_MAGIC) {
+        return decode_binary(message, length, request);
+    }
+    return decode_text(message, request);
+}
+
+/*
+ * Encodes the response to a request, in the protocol of the request.
+ * Input:
+ *  - request: the request answered
+ *  - result: result of the request
+ *  - buffer: where to write the response, at least sizeof(tfs_response)
+ * Returns: the length of the response
+ */
+size_t encode_response(request_t *request, int result, void *buffer) {
+    if (!request->binary) {
+        memcpy(buffer, &result, sizeof(int));
+        return sizeof(int);
+    }
+
+    tfs_result_type resultType = TFS_RESULT_STATUS;
+    if (request->opcode == TFS_OP_LOOKUP) {
+        resultType = TFS_RESULT_INUMBER;
+    } else if (request->opcode == TFS_OP_SHARDS || request->opcode == TFS_OP_WRITE ||
+               request->opcode == TFS_OP_APPEND || request->opcode == TFS_OP_READ_SHARED ||
+               request->opcode == TFS_OP_WRITE_SHARED) {
+        resultType = TFS_RESULT_COUNT;
+    } else if (request->opcode == TFS_OP_READ) {
+        resultType = TFS_RESULT_DATA;
+    } else if (request->opcode == TFS_OP_MOUNT || request->opcode == TFS_OP_OPEN) {
+        resultType = TFS_RESULT_HANDLE;
+    }
+
+    tfs_response response = {
+        .magic = TFS_MAGIC,
+        .version = TFS_VERSION,
+        .opcode = request->opcode,
+        .resultType = resultType,
+        .id = request->id,
+        .result = result
+    };
+    memcpy(buffer, &response, sizeof(response));
+    return sizeof(response);
+}
+
+/*
+ * Encodes the response to a batch.
+ * Input:
+ *  - request: the batch answered
+ *  - results: result of each entry of the batch
+ *  - buffer: where to write the response, at least TFS_MAX_MESSAGE
+ * Returns: the length of the response
+ */
+size_t encode_batch_response(request_t *request, int32_t *results, void *buffer) {
+    tfs_response response = {
+        .magic = TFS_MAGIC,
+        .version = TFS_VERSION,
+        .opcode = TFS_OP_BATCH,
+        .resultType = TFS_RESULT_VECTOR,
+        .id = request->id,
+        .result = request->batchCount
+    };
+    size_t resultsLength = request->batchCount * sizeof(int32_t);
+
+    memcpy(buffer, &response, sizeof(response));
+    memcpy((char *) buffer + sizeof(response), results, resultsLength);
+    return sizeof(response) + resultsLength;
+}
+
+/*
+ * Encodes the response to a read, whose bytes are already in place after
+ * the response header.
+ * Input:
+ *  - request: the read answered
+ *  - result: number of bytes read, or an error code
+ *  - buffer: where the response is, at least TFS_MAX_MESSAGE
+ * Returns: the length of the response
+ */
+size_t encode_read_response(request_t *request, int result, void *buffer) {
+    return encode_response(request, result, buffer) + (result > 0 ? result : 0);
+}
+
+/*
+ * Finds the descriptor passed with SCM_RIGHTS in a received message.
+ * Descriptors past the first one are closed.
+ * Returns: the descriptor, or -1 if none was passed
+ */
+int received_fd(struct msghdr *msg) {
+    int fd = -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int passed;
+            memcpy(&passed, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (fd < 0) {
+                fd = passed;
+            } else {
+                close(passed);
+            }
+        }
+    }
+    return fd;
+}
@@ -0,0 +1,48 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-protocol.h"
+
+/* Most arguments taken by a request */
+#define MAX_REQUEST_ARGS 2
+
+/*
+ * Decoded request, in either protocol. The arguments of a binary request
+ * point straight into the buffer it was received in, the ones of a text
+ * request into textArgs.
+ */
+typedef struct request_t {
+    int binary;
+    uint32_t id;
+    uint8_t opcode;
+    char nodeType;
+    int argc;
+    char *args[MAX_REQUEST_ARGS];
+    char textArgs[MAX_REQUEST_ARGS][MAX_INPUT_SIZE];
+    /* arguments of the file operations */
+    int32_t session;
+    int32_t fd;
+    uint32_t sharedOffset;
+    uint8_t mode;
+    uint64_t offset;
+    uint32_t dataLength;
+    char *data; /* bytes to write, in the buffer of the request */
+    /* entries of a batch, still encoded after batchOffset */
+    uint16_t batchCount;
+    size_t batchOffset;
+} request_t;
+
+int decode_request(char *message, size_t length, request_t *request);
+int decode_batch_entry(char *message, size_t length, size_t *offset, request_t *entry);
+int batchable_opcode(uint8_t opcode);
+size_t encode_response(request_t *request, int result, void *buffer);
+size_t encode_batch_response(request_t *request, int32_t *results, void *buffer);
+size_t encode_read_response(request_t *request, int result, void *buffer);
+int received_fd(struct msghdr *msg);
+
+#endif /* PROTOCOL_H */
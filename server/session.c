@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "session.h"
+#include "fs/operations.h"
+
+/* slots of the sessions, allocated on first use and never freed */
+session_t *sessions[MAX_SESSIONS];
+/* times each slot was used, to tell its sessions apart */
+int generations[MAX_SESSIONS];
+/* slots free for new sessions */
+int freeSlots[MAX_SESSIONS];
+int freeCount = -1;
+pthread_mutex_t sessionsLock = PTHREAD_MUTEX_INITIALIZER;
+
+void session_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void session_unlock(pthread_mutex_t *lock) {
+    if (pthread_mutex_unlock(lock)) {
+        fprintf(stderr, "Error: mutex failed to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Returns the current time in seconds, coarse but cheap.
+ */
+time_t session_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * Returns the length of the path of a socket address, without the '\0'
+ * that may end it, or 0 if the socket is unnamed.
+ */
+size_t session_path_length(const struct sockaddr_un *addr, socklen_t length) {
+    size_t pathLength = length - offsetof(struct sockaddr_un, sun_path);
+
+    if (length <= offsetof(struct sockaddr_un, sun_path)) {
+        return 0;
+    }
+    if (pathLength > sizeof(addr->sun_path)) {
+        pathLength = sizeof(addr->sun_path);
+    }
+    /* abstract addresses start with '\0' and are taken whole */
+    return addr->sun_path[0] == '\0' ? pathLength : strnlen(addr->sun_path, pathLength);
+}
+
+/*
+ * Returns the session with the given id, locked, or NULL if it is not open.
+ */
+session_t *session_get(int id) {
+    if (id < 0) {
+        return NULL;
+    }
+
+    session_t *session = __atomic_load_n(&sessions[id & (MAX_SESSIONS - 1)], __ATOMIC_ACQUIRE);
+    if (session == NULL) {
+        return NULL;
+    }
+
+    session_lock(&session->lock);
+    if (session->id != id) {
+        session_unlock(&session->lock);
+        return NULL;
+    }
+    return session;
+}
+
+/*
+ * Opens a new session.
+ * Input:
+ *  - owner: address of the client socket the session serves, NULL for a
+ *    session bound to a stream connection
+ *  - ownerLength: length of owner
+ * Returns: the id of the session, or TECNICOFS_ERROR_OTHER if too many are
+ * open or the client socket is unnamed
+ */
+int session_open(const struct sockaddr_un *owner, socklen_t ownerLength) {
+    size_t pathLength = owner == NULL ? 0 : session_path_length(owner, ownerLength);
+    if (owner != NULL && pathLength == 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    session_lock(&sessionsLock);
+    if (freeCount < 0) {
+        for (int i = 0; i < MAX_SESSIONS; i++) {
+            freeSlots[i] = MAX_SESSIONS - 1 - i;
+        }
+        freeCount = MAX_SESSIONS;
+    }
+    if (freeCount == 0) {
+        session_unlock(&sessionsLock);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    int slot = freeSlots[--freeCount];
+    session_t *session = sessions[slot];
+    if (session == NULL) {
+        session = malloc(sizeof(session_t));
+        if (session == NULL || pthread_mutex_init(&session->lock, NULL) || pthread_cond_init(&session->idle, NULL)) {
+            fprintf(stderr, "Error: failed to allocate session\n");
+            exit(EXIT_FAILURE);
+        }
+        session->id = -1;
+        __atomic_store_n(&sessions[slot], session, __ATOMIC_RELEASE);
+    }
+
+    /* ids stay positive, and a slot reuses them only after many sessions */
+    generations[slot] = (generations[slot] + 1) % (0x7fffffff / MAX_SESSIONS);
+    int id = generations[slot] * MAX_SESSIONS + slot;
+
+    session_lock(&session->lock);
+    for (int fd = 0; fd < TFS_MAX_OPEN_FILES; fd++) {
+        session->files[fd].inumber = FREE_INODE;
+        session->files[fd].users = 0;
+        session->files[fd].closing = 0;
+    }
+    session->shared = NULL;
+    session->sharedSize = 0;
+    memcpy(session->owner, owner == NULL ? "" : owner->sun_path, pathLength);
+    session->ownerLength = pathLength;
+    session->lastUsed = session_now();
+    session->id = id;
+    session_unlock(&session->lock);
+
+    session_unlock(&sessionsLock);
+    return id;
+}
+
+/*
+ * Checks that a request on a session comes from the client socket that
+ * opened it, or from one of the sockets the client binds to the same path
+ * followed by "-<shard>" to reach the other shards, and counts it as a use
+ * of the session.
+ * Input:
+ *  - id: the session
+ *  - client: address the request came from
+ *  - clientLength: length of client
+ * Returns: 1 if the session is open and serves that client, 0 otherwise
+ */
+int session_owned(int id, const struct sockaddr_un *client, socklen_t clientLength) {
+    size_t pathLength = session_path_length(client, clientLength);
+    session_t *session = session_get(id);
+    int owned = 0;
+
+    if (session == NULL) {
+        return 0;
+    }
+    size_t ownerLength = session->ownerLength;
+    if (ownerLength > 0 && pathLength >= ownerLength && memcmp(session->owner, client->sun_path, ownerLength) == 0) {
+        owned = pathLength == ownerLength;
+        if (pathLength > ownerLength + 1 && client->sun_path[ownerLength] == '-') {
+            owned = 1;
+            for (size_t i = ownerLength + 1; i < pathLength; i++) {
+                owned &= client->sun_path[i] >= '0' && client->sun_path[i] <= '9';
+            }
+        }
+    }
+    if (owned) {
+        session->lastUsed = session_now();
+    }
+    session_unlock(&session->lock);
+
+    return owned;
+}
+
+/*
+ * Returns whether a client socket is still there, that is whether it
+ * does not refuse a connection.
+ */
+int session_reachable(const char *path, size_t pathLength) {
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, pathLength);
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return 1;
+    }
+    int gone = connect(fd, (struct sockaddr *) &addr, offsetof(struct sockaddr_un, sun_path) + pathLength) < 0 &&
+               (errno == ECONNREFUSED || errno == ENOENT);
+    close(fd);
+
+    return !gone;
+}
+
+/*
+ * Closes every SESSION_REAP_INTERVAL seconds the datagram sessions whose
+ * client socket is gone or that have been idle for SESSION_IDLE_TIMEOUT
+ * seconds, as a client that dies never closes them. Runs forever.
+ */
+void *session_reaper(void *arg) {
+    char owner[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+
+    while (1) {
+        sleep(SESSION_REAP_INTERVAL);
+
+        time_t now = session_now();
+        for (int slot = 0; slot < MAX_SESSIONS; slot++) {
+            session_t *session = __atomic_load_n(&sessions[slot], __ATOMIC_ACQUIRE);
+            if (session == NULL) {
+                continue;
+            }
+
+            session_lock(&session->lock);
+            int id = session->id;
+            int idle = now - session->lastUsed >= SESSION_IDLE_TIMEOUT;
+            size_t ownerLength = session->ownerLength;
+            memcpy(owner, session->owner, ownerLength);
+            session_unlock(&session->lock);
+
+            /* the socket is checked unlocked, the session may be closed meanwhile */
+            if (id >= 0 && ownerLength > 0 && (idle || !session_reachable(owner, ownerLength))) {
+                session_close(id);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Clears a descriptor of a locked session, waiting for the requests
+ * using it. The session lock is released while waiting.
+ * Returns: the entry the descriptor had
+ */
+open_file_t session_clear_file(session_t *session, int fd) {
+    open_file_t *file = &session->files[fd];
+
+    file->closing = 1;
+    while (file->users > 0) {
+        pthread_cond_wait(&session->idle, &session->lock);
+    }
+
+    open_file_t old = *file;
+    file->inumber = FREE_INODE;
+    file->closing = 0;
+    return old;
+}
+
+/*
+ * Closes a session and every file it has open.
+ * Returns: SUCCESS or TECNICOFS_ERROR_NO_OPEN_SESSION
+ */
+int session_close(int id) {
+    open_file_t files[TFS_MAX_OPEN_FILES];
+    session_t *session = session_get(id);
+
+    if (session == NULL) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+
+    /* new requests on the session fail from now on */
+    session->id = -1;
+    for (int fd = 0; fd < TFS_MAX_OPEN_FILES; fd++) {
+        files[fd].inumber = FREE_INODE;
+        if (session->files[fd].inumber != FREE_INODE && !session->files[fd].closing) {
+            files[fd] = session_clear_file(session, fd);
+        }
+    }
+    /* with no file pinned, no request is using the shared memory */
+    char *shared = session->shared;
+    size_t sharedSize = session->sharedSize;
+    session->shared = NULL;
+    session_unlock(&session->lock);
+
+    if (shared != NULL) {
+        munmap(shared, sharedSize);
+    }
+
+    /* files still being opened are closed by their open */
+    for (int fd = 0; fd < TFS_MAX_OPEN_FILES; fd++) {
+        if (files[fd].inumber >= 0) {
+            close_file(files[fd].inumber, files[fd].mode);
+        }
+    }
+
+    session_lock(&sessionsLock);
+    freeSlots[freeCount++] = id & (MAX_SESSIONS - 1);
+    session_unlock(&sessionsLock);
+    return SUCCESS;
+}
+
+/*
+ * Opens a file in a session.
+ * Input:
+ *  - id: the session
+ *  - path: path of the file
+ *  - mode: READ, WRITE or RW
+ * Returns: the descriptor of the file, or an error code
+ */
+int session_open_file(int id, char *path, permission mode) {
+    session_t *session = session_get(id);
+    int fd;
+
+    if (session == NULL) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+
+    for (fd = 0; fd < TFS_MAX_OPEN_FILES && session->files[fd].inumber != FREE_INODE; fd++);
+    if (fd == TFS_MAX_OPEN_FILES) {
+        session_unlock(&session->lock);
+        return TECNICOFS_ERROR_MAXED_OPEN_FILES;
+    }
+    session->files[fd].inumber = SESSION_OPENING;
+    session_unlock(&session->lock);
+
+    /* the session is not locked while the path is resolved */
+    int inumber = open_file(path, mode);
+
+    session = session_get(id);
+    if (session == NULL) {
+        /* the session was closed meanwhile */
+        if (inumber >= 0) {
+            close_file(inumber, mode);
+        }
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    session->files[fd].inumber = inumber >= 0 ? inumber : FREE_INODE;
+    session->files[fd].mode = mode;
+    session_unlock(&session->lock);
+
+    return inumber >= 0 ? fd : inumber;
+}
+
+/*
+ * Closes a descriptor of a session, once the requests using it are done.
+ * Returns: SUCCESS or an error code
+ */
+int session_close_file(int id, int fd) {
+    session_t *session = session_get(id);
+
+    if (session == NULL) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    if (fd < 0 || fd >= TFS_MAX_OPEN_FILES || session->files[fd].inumber < 0 || session->files[fd].closing) {
+        session_unlock(&session->lock);
+        return TECNICOFS_ERROR_FILE_NOT_OPEN;
+    }
+
+    open_file_t file = session_clear_file(session, fd);
+    session_unlock(&session->lock);
+
+    return close_file(file.inumber, file.mode);
+}
+
+/*
+ * Gets the file behind a descriptor and keeps it open, so that it can not
+ * be deleted, until session_unpin_file is called.
+ * Input:
+ *  - id: the session
+ *  - fd: the descriptor
+ *  - access: READ or WRITE, the access needed
+ *  - inumber: reference to store the inumber of the file
+ * Returns: SUCCESS or an error code
+ */
+int session_pin_file(int id, int fd, permission access, int *inumber) {
+    session_t *session = session_get(id);
+    int res = SUCCESS;
+
+    if (session == NULL) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+
+    open_file_t *file = &session->files[fd < 0 || fd >= TFS_MAX_OPEN_FILES ? 0 : fd];
+    if (fd < 0 || fd >= TFS_MAX_OPEN_FILES || file->inumber < 0 || file->closing) {
+        res = TECNICOFS_ERROR_FILE_NOT_OPEN;
+    } else if (!(file->mode & access)) {
+        res = TECNICOFS_ERROR_INVALID_MODE;
+    } else {
+        file->users++;
+        *inumber = file->inumber;
+    }
+
+    session_unlock(&session->lock);
+    return res;
+}
+
+/*
+ * Releases a descriptor pinned by session_pin_file.
+ */
+void session_unpin_file(int id, int fd) {
+    session_t *session = sessions[id & (MAX_SESSIONS - 1)];
+
+    /* a closing session waits for its users, so it is still there */
+    session_lock(&session->lock);
+    if (--session->files[fd].users == 0 && session->files[fd].closing) {
+        pthread_cond_broadcast(&session->idle);
+    }
+    session_unlock(&session->lock);
+}
+
+/*
+ * Maps memory the client shares with the server for the shared reads and
+ * writes of a session. The memfd must be sealed against shrinking, so
+ * that the client can not pull the pages from under the server, and is
+ * closed once mapped.
+ * Input:
+ *  - id: the session
+ *  - memfd: the memfd passed by the client
+ *  - size: bytes to share, from the start of the memfd
+ * Returns: SUCCESS or an error code
+ */
+int session_share(int id, int memfd, size_t size) {
+    struct stat st;
+    int seals = fcntl(memfd, F_GET_SEALS);
+
+    if (size == 0 || size > TFS_MAX_SHARED || seals < 0 || !(seals & F_SEAL_SHRINK) ||
+        fstat(memfd, &st) || st.st_size < size) {
+        close(memfd);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    char *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (shared == MAP_FAILED) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    session_t *session = session_get(id);
+    if (session == NULL) {
+        munmap(shared, size);
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    /* a request may be using the memory shared before */
+    if (session->shared != NULL) {
+        session_unlock(&session->lock);
+        munmap(shared, size);
+        return TECNICOFS_ERROR_OTHER;
+    }
+    session->shared = shared;
+    session->sharedSize = size;
+    session_unlock(&session->lock);
+
+    return SUCCESS;
+}
+
+/*
+ * Returns where length bytes at offset of the memory shared by a session
+ * are, or NULL if they are not in it. The memory stays mapped while a
+ * file of the session is pinned.
+ */
+char *session_shared(int id, uint32_t offset, uint32_t length) {
+    session_t *session = session_get(id);
+    char *shared = NULL;
+
+    if (session == NULL) {
+        return NULL;
+    }
+    if (session->shared != NULL && offset <= session->sharedSize && length <= session->sharedSize - offset) {
+        shared = session->shared + offset;
+    }
+    session_unlock(&session->lock);
+
+    return shared;
+}
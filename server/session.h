@@ -0,0 +1,63 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-protocol.h"
+
+/* Sessions open at once, a power of 2 */
+#define MAX_SESSIONS 1024
+/* Marks a descriptor taken by an open that has not finished */
+#define SESSION_OPENING -2
+/* Seconds between checks for datagram sessions whose client is gone */
+#define SESSION_REAP_INTERVAL 10
+/* Seconds after which a datagram session with no requests is closed */
+#define SESSION_IDLE_TIMEOUT 600
+
+/*
+ * Entry of the open-file table of a session. While users is not zero a
+ * request is using the file, and the entry is not cleared until it is done.
+ */
+typedef struct open_file_t {
+    int inumber; /* FREE_INODE while the descriptor is free, SESSION_OPENING while it is being opened */
+    permission mode;
+    int users;
+    int closing;
+} open_file_t;
+
+/*
+ * Session of a client, with the files it has open. The descriptors are
+ * indexes in files, so using one takes no lookup. A session opened over
+ * datagrams only serves the client socket that opened it, see
+ * session_owned; one opened on a stream connection is bound to it.
+ */
+typedef struct session_t {
+    pthread_mutex_t lock;
+    pthread_cond_t idle; /* signaled when the users of a closing file are done */
+    int id; /* changes every time the slot is reused, -1 while it is free */
+    char owner[sizeof(((struct sockaddr_un *) NULL)->sun_path)]; /* path of the client socket */
+    size_t ownerLength; /* 0 for sessions bound to a stream connection */
+    time_t lastUsed; /* when the session last served a request, in seconds */
+    open_file_t files[TFS_MAX_OPEN_FILES];
+    char *shared; /* memory shared with the client, NULL if it shares none */
+    size_t sharedSize;
+} session_t;
+
+int session_open(const struct sockaddr_un *owner, socklen_t ownerLength);
+int session_owned(int id, const struct sockaddr_un *client, socklen_t clientLength);
+void *session_reaper(void *arg);
+int session_close(int id);
+int session_open_file(int id, char *path, permission mode);
+int session_close_file(int id, int fd);
+int session_pin_file(int id, int fd, permission access, int *inumber);
+void session_unpin_file(int id, int fd);
+int session_share(int id, int memfd, size_t size);
+char *session_shared(int id, uint32_t offset, uint32_t length);
+
+#endif /* SESSION_H */
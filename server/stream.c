@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "stream.h"
+#include "dispatch.h"
+#include "session.h"
+#include "protocol.h"
+#include "fs/latency.h"
+
+int listenfd;
+int epollfd;
+
+void stream_lock(pthread_mutex_t *lock) {
+    if (pthread_mutex_lock(lock)) {
+        fprintf(stderr, "Error: mutex failed to lock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void stream_unlock(pthread_mutex_t *lock) {
+    if (pthread_mutex_unlock(lock)) {
+        fprintf(stderr, "Error: mutex failed to unlock\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Creates, binds and listens on the stream socket and creates the epoll
+ * instance that watches it
+ */
+void stream_init(char *path) {
+    struct sockaddr_un server_addr;
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listenfd < 0) {
+        fprintf(stderr, "Error: server cannot open socket\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (unlink(path) && errno != ENOENT) {
+        fprintf(stderr, "Error: cannot unlink socket path\n");
+        exit(EXIT_FAILURE);
+    }
+
+    bzero((char *)&server_addr, sizeof(struct sockaddr_un));
+    server_addr.sun_family = AF_UNIX;
+    strcpy(server_addr.sun_path, path);
+    if (bind(listenfd, (struct sockaddr *) &server_addr, SUN_LEN(&server_addr)) < 0) {
+        fprintf(stderr, "Error: server could not bind socket\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(listenfd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Error: server could not listen on socket\n");
+        exit(EXIT_FAILURE);
+    }
+
+    epollfd = epoll_create1(0);
+    if (epollfd < 0) {
+        fprintf(stderr, "Error: could not create epoll instance\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &event) < 0) {
+        fprintf(stderr, "Error: could not watch socket\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Releases a reference to the connection, closing it with the last one
+ */
+void stream_conn_release(stream_conn_t *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    if (conn->session >= 0) {
+        session_close(conn->session);
+    }
+    if (conn->passedFd >= 0) {
+        close(conn->passedFd);
+    }
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->writeLock);
+    free(conn->buffer);
+    free(conn->output);
+    free(conn);
+}
+
+/*
+ * Watches the connection for what it can do now: for reading, unless it
+ * has too many requests running or replies waiting, which is how a client
+ * that does not read its replies is held back, or the client shut its side
+ * down, and for writing while replies wait. Once a client that shut its
+ * side down has every reply, it is watched for writing too, so that the
+ * reactor wakes up to drop it. Must be called with writeLock held.
+ */
+void stream_watch(stream_conn_t *conn) {
+    uint32_t events = 0;
+    if (!conn->readClosed && conn->inFlight < STREAM_MAX_IN_FLIGHT &&
+        conn->outputEnd - conn->outputStart < STREAM_MAX_OUTPUT) {
+        events |= EPOLLIN;
+    }
+    if (conn->outputEnd > conn->outputStart || (conn->readClosed && conn->inFlight == 0)) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events || !conn->watched) {
+        return;
+    }
+
+    conn->events = events;
+    struct epoll_event event = { .events = events, .data.ptr = conn };
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+        fprintf(stderr, "Error: could not watch connection\n");
+    }
+}
+
+/*
+ * Accepts every pending connection
+ */
+void stream_accept() {
+    while (1) {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "Error: failed to accept connection\n");
+            }
+            return;
+        }
+
+        stream_conn_t *conn = malloc(sizeof(stream_conn_t));
+        if (conn == NULL) {
+            fprintf(stderr, "Error: failed to allocate connection\n");
+            exit(EXIT_FAILURE);
+        }
+        conn->fd = fd;
+        conn->refs = 1; /* held by the reactor until the client hangs up */
+        conn->session = -1;
+        conn->passedFd = -1;
+        conn->buffer = NULL;
+        conn->buffered = 0;
+        conn->capacity = 0;
+        conn->output = NULL;
+        conn->outputStart = 0;
+        conn->outputEnd = 0;
+        conn->outputCapacity = 0;
+        conn->events = EPOLLIN;
+        conn->inFlight = 0;
+        conn->readClosed = 0;
+        conn->watched = 1;
+        if (pthread_mutex_init(&conn->writeLock, NULL)) {
+            fprintf(stderr, "Error: failed to init mutex\n");
+            exit(EXIT_FAILURE);
+        }
+
+        struct epoll_event event = { .events = conn->events, .data.ptr = conn };
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            fprintf(stderr, "Error: could not watch connection\n");
+            stream_conn_release(conn);
+        }
+    }
+}
+
+/*
+ * Queues every complete frame in the connection buffer.
+ * Returns: 0, or -1 if the client sent an invalid frame
+ */
+int stream_parse(stream_conn_t *conn) {
+    size_t offset = 0;
+
+    while (conn->buffered - offset >= sizeof(tfs_frame_header)) {
+        tfs_frame_header header;
+        memcpy(&header, conn->buffer + offset, sizeof(header));
+        if (header.length > TFS_MAX_MESSAGE) {
+            return -1;
+        }
+        if (conn->buffered - offset - sizeof(header) < header.length) {
+            break;
+        }
+
+        stream_request_t *request = malloc(sizeof(stream_request_t) + header.length + 1);
+        if (request == NULL) {
+            fprintf(stderr, "Error: failed to allocate request\n");
+            exit(EXIT_FAILURE);
+        }
+        request->conn = conn;
+        request->id = header.id;
+        request->length = header.length;
+        memcpy(request->message, conn->buffer + offset + sizeof(header), header.length);
+        request->message[header.length] = '\0';
+
+        __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+        stream_lock(&conn->writeLock);
+        conn->inFlight++;
+        stream_watch(conn);
+        stream_unlock(&conn->writeLock);
+        dispatch_submit(request, 0);
+        offset += sizeof(header) + header.length;
+    }
+
+    memmove(conn->buffer, conn->buffer + offset, conn->buffered - offset);
+    conn->buffered -= offset;
+    return 0;
+}
+
+/*
+ * Returns whether the connection is to be read, see stream_watch.
+ */
+int stream_readable(stream_conn_t *conn) {
+    stream_lock(&conn->writeLock);
+    int readable = (conn->events & EPOLLIN) != 0;
+    stream_unlock(&conn->writeLock);
+    return readable;
+}
+
+/*
+ * Reads everything available on the connection and queues its requests,
+ * until it is held back.
+ * Returns: 0, or -1 if the connection must be closed
+ */
+int stream_read(stream_conn_t *conn) {
+    while (stream_readable(conn)) {
+        if (conn->capacity - conn->buffered < sizeof(tfs_frame_header) + TFS_MAX_MESSAGE) {
+            size_t capacity = conn->buffered + 2 * (sizeof(tfs_frame_header) + TFS_MAX_MESSAGE);
+            char *buffer = realloc(conn->buffer, capacity);
+            if (buffer == NULL) {
+                fprintf(stderr, "Error: failed to allocate connection buffer\n");
+                exit(EXIT_FAILURE);
+            }
+            conn->buffer = buffer;
+            conn->capacity = capacity;
+        }
+
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = {
+            .iov_base = conn->buffer + conn->buffered,
+            .iov_len = conn->capacity - conn->buffered
+        };
+        struct msghdr msg = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+        };
+
+        unsigned long long start = latency_now();
+        ssize_t n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+        /* a descriptor arrives with the frame that takes it, before it is queued */
+        int passed = n > 0 ? received_fd(&msg) : -1;
+        if (passed >= 0) {
+            passed = __atomic_exchange_n(&conn->passedFd, passed, __ATOMIC_ACQ_REL);
+            if (passed >= 0) {
+                close(passed);
+            }
+        }
+        if (n == 0) {
+            /* the requests read are still answered */
+            stream_lock(&conn->writeLock);
+            conn->readClosed = 1;
+            stream_watch(conn);
+            stream_unlock(&conn->writeLock);
+            return 0;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        latency_record(LATENCY_RECEIVE, latency_now() - start);
+
+        conn->buffered += n;
+        if (stream_parse(conn)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sends as much as the socket of the connection takes without blocking.
+ * Returns: the number of bytes sent, or -1 if the connection failed
+ */
+ssize_t stream_send(stream_conn_t *conn, struct iovec *iov, int count) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count };
+
+    while (1) {
+        unsigned long long start = latency_now();
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n >= 0) {
+            latency_record(LATENCY_SEND, latency_now() - start);
+            return n;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Queues bytes of replies the socket did not take. Must be called with
+ * writeLock held.
+ */
+void stream_output_append(stream_conn_t *conn, const char *bytes, size_t length) {
+    if (conn->outputCapacity - conn->outputEnd < length) {
+        if (conn->outputStart > 0) {
+            memmove(conn->output, conn->output + conn->outputStart, conn->outputEnd - conn->outputStart);
+            conn->outputEnd -= conn->outputStart;
+            conn->outputStart = 0;
+        }
+        if (conn->outputCapacity - conn->outputEnd < length) {
+            size_t capacity = 2 * (conn->outputEnd + length);
+            char *output = realloc(conn->output, capacity);
+            if (output == NULL) {
+                fprintf(stderr, "Error: failed to allocate connection buffer\n");
+                exit(EXIT_FAILURE);
+            }
+            conn->output = output;
+            conn->outputCapacity = capacity;
+        }
+    }
+
+    memcpy(conn->output + conn->outputEnd, bytes, length);
+    conn->outputEnd += length;
+}
+
+/*
+ * Sends the queued replies the socket takes, once it is writable.
+ * Returns: 0, or -1 if the connection must be closed
+ */
+int stream_flush(stream_conn_t *conn) {
+    int res = 0;
+
+    stream_lock(&conn->writeLock);
+    if (conn->outputEnd > conn->outputStart) {
+        struct iovec iov = {
+            .iov_base = conn->output + conn->outputStart,
+            .iov_len = conn->outputEnd - conn->outputStart
+        };
+        ssize_t n = stream_send(conn, &iov, 1);
+        if (n < 0) {
+            res = -1;
+        } else {
+            conn->outputStart += n;
+            if (conn->outputStart == conn->outputEnd) {
+                conn->outputStart = conn->outputEnd = 0;
+            }
+        }
+    }
+    stream_watch(conn);
+    stream_unlock(&conn->writeLock);
+
+    return res;
+}
+
+/*
+ * Returns whether the client shut its side of the connection down and
+ * has every reply.
+ */
+int stream_finished(stream_conn_t *conn) {
+    stream_lock(&conn->writeLock);
+    int finished = conn->readClosed && conn->inFlight == 0 && conn->outputEnd == conn->outputStart;
+    stream_unlock(&conn->writeLock);
+    return finished;
+}
+
+/*
+ * Accepts connections and reads requests from them, handing the requests
+ * to the dispatcher. A connection is dropped when it fails, when the
+ * client is gone, or when the client shut its side down and was sent
+ * every reply.
+ */
+void *stream_reactor() {
+    struct epoll_event events[STREAM_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(epollfd, events, STREAM_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: failed to wait for events\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            stream_conn_t *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                stream_accept();
+                continue;
+            }
+
+            int failed = (events[i].events & EPOLLOUT) && stream_flush(conn);
+            if (failed || stream_read(conn) || (events[i].events & (EPOLLHUP | EPOLLERR)) ||
+                stream_finished(conn)) {
+                stream_lock(&conn->writeLock);
+                conn->watched = 0;
+                stream_unlock(&conn->writeLock);
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                stream_conn_release(conn);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Sends a reply frame for the request, without blocking: what the socket
+ * does not take is queued for the reactor to send once it is writable.
+ * Input:
+ *  - request: the request being answered
+ *  - message: the reply message
+ *  - length: size of the reply message
+ * Returns: 0 if it is successful
+ */
+int stream_reply(stream_request_t *request, const void *message, uint32_t length) {
+    stream_conn_t *conn = request->conn;
+    tfs_frame_header header = { .length = length, .id = request->id };
+    struct iovec iov[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (void *) message, .iov_len = length }
+    };
+    size_t sent = 0;
+    int res = 0;
+
+    /* frames of concurrent replies must not interleave */
+    stream_lock(&conn->writeLock);
+    if (conn->outputEnd == conn->outputStart) {
+        ssize_t n = stream_send(conn, iov, 2);
+        if (n < 0) {
+            res = -1;
+            sent = sizeof(header) + length;
+        } else {
+            sent = n;
+        }
+    }
+    if (sent < sizeof(header)) {
+        stream_output_append(conn, (char *) &header + sent, sizeof(header) - sent);
+        sent = sizeof(header);
+    }
+    stream_output_append(conn, (const char *) message + sent - sizeof(header), sizeof(header) + length - sent);
+    stream_watch(conn);
+    stream_unlock(&conn->writeLock);
+
+    return res;
+}
+
+/*
+ * Releases a request once it is answered
+ */
+void stream_request_done(stream_request_t *request) {
+    stream_conn_t *conn = request->conn;
+
+    stream_lock(&conn->writeLock);
+    conn->inFlight--;
+    stream_watch(conn);
+    stream_unlock(&conn->writeLock);
+    stream_conn_release(conn);
+    free(request);
+}
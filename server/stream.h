@@ -0,0 +1,58 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "../tecnicofs-protocol.h"
+
+/* Maximum number of events handled per epoll_wait */
+#define STREAM_MAX_EVENTS 256
+/* Requests of a connection being run at once before it is no longer read */
+#define STREAM_MAX_IN_FLIGHT 256
+/* Bytes of replies waiting for a connection before it is no longer read */
+#define STREAM_MAX_OUTPUT (256 * 1024)
+
+/*
+ * Client connection, shared by the reactor and the workers answering its
+ * requests, and closed when the last of them releases it
+ */
+typedef struct stream_conn_t {
+    int fd;
+    int refs;
+    int session; /* closed with the connection, -1 if the client mounted none on it */
+    int passedFd; /* last descriptor passed on the connection and not taken, or -1 */
+    char *buffer; /* received bytes not parsed yet */
+    size_t buffered;
+    size_t capacity;
+    /* replies the socket did not take yet, sent by the reactor once it is
+     * writable, and what the connection is watched for; all of them and
+     * inFlight are guarded by writeLock */
+    pthread_mutex_t writeLock;
+    char *output;
+    size_t outputStart;
+    size_t outputEnd;
+    size_t outputCapacity;
+    uint32_t events;
+    int inFlight; /* requests queued and not answered yet */
+    int readClosed; /* set once the client shut its side down */
+    int watched; /* cleared once the reactor drops the connection */
+} stream_conn_t;
+
+/*
+ * Request parsed from a connection
+ */
+typedef struct stream_request_t {
+    stream_conn_t *conn;
+    uint32_t id;
+    uint32_t length;
+    char message[];
+} stream_request_t;
+
+void stream_init(char *path);
+void *stream_reactor();
+int stream_reply(stream_request_t *request, const void *message, uint32_t length);
+void stream_request_done(stream_request_t *request);
+
+#endif /* STREAM_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/un.h>
@@ -6,11 +7,88 @@
 #include <sys/stat.h>
 #include <strings.h>
 #include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <limits.h>
 
 #include "fs/operations.h"
+#include "fs/wal.h"
+#include "fs/image.h"
+#include "fs/latency.h"
+#include "stream.h"
+#include "protocol.h"
+#include "dispatch.h"
+#include "session.h"
 #include "../tecnicofs-api-constants.h"
 
-int serverfd;
+/* Kinds of socket the server can listen on */
+typedef enum server_mode_t {
+    DGRAM_MODE, STREAM_MODE
+} server_mode_t;
+
+/* Most datagrams taken by a single system call */
+#define MAX_RECEIVE_BATCH 64
+/* Microseconds a receiver waits after its first and its later failures in a row */
+#define RECEIVE_BACKOFF_MIN 1000
+#define RECEIVE_BACKOFF_MAX 1000000
+/* Most i-nodes the lock profile reports */
+#define MAX_PROFILED_INODES 1024
+
+/*
+ * Command received on the datagram socket, waiting for a worker
+ */
+typedef struct dgram_request_t {
+    struct sockaddr_un client_addr;
+    socklen_t clientlen;
+    size_t length;
+    char message[TFS_MAX_MESSAGE + 1]; /* room for a terminating '\0' */
+    char control[CMSG_SPACE(sizeof(int))];
+    int passedFd; /* descriptor passed with the datagram, or -1 */
+    size_t responseLength;
+    char response[TFS_MAX_MESSAGE];
+} dgram_request_t;
+
+/*
+ * Where a request came from: the session bound to its stream connection,
+ * NULL for datagrams, a descriptor passed along with it, -1 if none,
+ * which a request taking it swaps for -1, and the client socket of a
+ * datagram, NULL for streams
+ */
+typedef struct origin_t {
+    int *session;
+    int *passedFd;
+    struct sockaddr_un *client;
+    socklen_t clientlen;
+} origin_t;
+
+/*
+ * Commands received together on a shard, run by the same worker and
+ * answered together
+ */
+typedef struct dgram_batch_t {
+    int shard; /* socket they were received on, and must be answered on */
+    int count;
+    dgram_request_t *requests[MAX_RECEIVE_BATCH];
+} dgram_batch_t;
+
+/* datagram sockets the server listens on, one per group of workers */
+int serverfds[TFS_MAX_SHARDS];
+/* requests and batches answered on each shard, for its receiver to reuse */
+dispatch_queue_t freeRequests[TFS_MAX_SHARDS];
+dispatch_queue_t freeBatches[TFS_MAX_SHARDS];
+int numberShards = 1;
+/* datagrams received and answered per system call */
+int receiveBatch = 16;
+server_mode_t serverMode = DGRAM_MODE;
+/* cpus the workers are pinned to, in turn, if any */
+int *workerCpus = NULL;
+int numberCpus = 0;
+/* directory of the log the tree is recovered from and kept in, if any */
+char *logDir = NULL;
+/* image the tree starts from, if any */
+char *imagePath = NULL;
+/* i-nodes with the most contended locks the stats report, 0 not to profile locks */
+int profiledInodes = 0;
 
 /*
  * Initializes the unix socket address
@@ -30,137 +108,524 @@ int setSocketAddress(char *path, struct sockaddr_un *addr) {
 }
 
 /*
- * Runs command on tecnicofs
+ * Opens the output file and prints the statistics of tecnicofs and of
+ * the dispatcher.
  * Input:
- * - command: command to run
+ * - outputfile: path to the outputfile
+ * Returns: SUCCESS or FAIL
  */
-int processCommand(const char *command) {
-    int response = FAIL;
+int print_stats(char *outputfile) {
+    FILE *fp;
+
+    fp = fopen(outputfile, "w");
+    if (!fp) {
+        fprintf(stderr, "Error: could not open output file\n");
+        return FAIL;
+    }
+
+    print_tecnicofs_stats(fp);
+    dispatch_print_stats(fp);
+    latency_print_stats(fp);
+
+    if (fclose(fp)) {
+        fprintf(stderr, "Error: could not close the output file\n");
+        return FAIL;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Opens a session, binding it to the stream connection the request came
+ * from, so that it is closed with the connection, or else to the client
+ * socket the datagram came from
+ * Returns: the session, or an error code
+ */
+int processMount(origin_t *origin) {
+    int session = session_open(origin->client, origin->clientlen);
+
+    if (session >= 0 && origin->session != NULL) {
+        int none = -1;
+        if (!__atomic_compare_exchange_n(origin->session, &none, session, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            session_close(session);
+            return TECNICOFS_ERROR_OPEN_SESSION;
+        }
+    }
+    return session;
+}
+
+/*
+ * Returns whether a request may use its session: the one bound to its
+ * stream connection, or one opened from its client socket
+ */
+int processOwnsSession(request_t *request, origin_t *origin) {
+    if (origin->session != NULL) {
+        return request->session >= 0 && __atomic_load_n(origin->session, __ATOMIC_ACQUIRE) == request->session;
+    }
+    return session_owned(request->session, origin->client, origin->clientlen);
+}
 
-    char token;
-    char arg1[MAX_INPUT_SIZE];
-    char arg2[MAX_INPUT_SIZE];
-    int numTokens = sscanf(command, "%c %s %s", &token, arg1, arg2);
+/*
+ * Runs a read, write, append or truncate on an open file, the shared ones
+ * on the memory shared by its session
+ * Input:
+ * - request: decoded request to run
+ * - origin: where it came from
+ * - buffer: where a read copies the bytes read
+ * - length: most bytes to read
+ * Returns: the result of the operation
+ */
+int processFileRequest(request_t *request, origin_t *origin, char *buffer, uint32_t length) {
+    int inumber;
+    permission access = request->opcode == TFS_OP_READ || request->opcode == TFS_OP_READ_SHARED ? READ : WRITE;
+    char *shared;
 
-    if (numTokens < 2) {
+    if (!processOwnsSession(request, origin)) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    int response = session_pin_file(request->session, request->fd, access, &inumber);
+    if (response != SUCCESS) {
         return response;
     }
 
-    switch (token) {
-        case 'c':
-            if (numTokens != 3)
-                return response;
-            switch (arg2[0]) {
+    switch (request->opcode) {
+        case TFS_OP_READ:
+            response = read_file(inumber, request->offset, buffer, length);
+            break;
+        case TFS_OP_WRITE:
+            response = write_file(inumber, request->offset, request->data, request->dataLength);
+            break;
+        case TFS_OP_APPEND:
+            response = append_file(inumber, request->data, request->dataLength);
+            break;
+        case TFS_OP_TRUNCATE:
+            response = truncate_file(inumber, request->offset);
+            break;
+        case TFS_OP_READ_SHARED:
+        case TFS_OP_WRITE_SHARED:
+            shared = session_shared(request->session, request->sharedOffset, request->dataLength);
+            if (shared == NULL || request->dataLength > INT_MAX) {
+                response = TECNICOFS_ERROR_OTHER;
+            } else if (request->opcode == TFS_OP_READ_SHARED) {
+                response = read_file(inumber, request->offset, shared, request->dataLength);
+            } else {
+                response = write_file(inumber, request->offset, shared, request->dataLength);
+            }
+            break;
+    }
+
+    session_unpin_file(request->session, request->fd);
+    return response;
+}
+
+/*
+ * Runs request on tecnicofs
+ * Input:
+ * - request: decoded request to run
+ * - origin: where it came from
+ */
+int processRequest(request_t *request, origin_t *origin) {
+    int response = FAIL;
+    char **args = request->args;
+
+    switch (request->opcode) {
+        case TFS_OP_CREATE:
+            switch (request->nodeType) {
                 case 'f':
-                    response = create(arg1, T_FILE);
+                    response = create(args[0], T_FILE);
                     break;
                 case 'd':
-                    response = create(arg1, T_DIRECTORY);
+                    response = create(args[0], T_DIRECTORY);
                     break;
             }
             break;
-        case 'l': 
-            if (numTokens != 2)
-                return response;
-            response = lookup(arg1);
+        case TFS_OP_LOOKUP: 
+            response = lookup(args[0]);
             break;
-
-        case 'd':
-            if (numTokens != 2) 
-                return response;
-            response = delete(arg1);
+        case TFS_OP_DELETE:
+            response = delete(args[0]);
             break;
-
-        case 'm':
-            if (numTokens != 3)
-                return response;
-            response = move(arg1, arg2);
+        case TFS_OP_MOVE:
+            response = move(args[0], args[1]);
+            break;
+        case TFS_OP_PRINT:
+            response = print_tree(args[0]);
+            break;
+        case TFS_OP_STATS:
+            response = print_stats(args[0]);
+            break;
+        case TFS_OP_SNAPSHOT:
+            response = image_snapshot(args[0]);
+            break;
+        case TFS_OP_SHARDS:
+            response = serverMode == DGRAM_MODE ? numberShards : 1;
+            break;
+        case TFS_OP_MOUNT:
+            response = processMount(origin);
+            break;
+        case TFS_OP_UNMOUNT:
+            if (!processOwnsSession(request, origin)) {
+                response = TECNICOFS_ERROR_NO_OPEN_SESSION;
+                break;
+            }
+            if (origin->session != NULL) {
+                /* the connection no longer closes the session */
+                int session = request->session;
+                __atomic_compare_exchange_n(origin->session, &session, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            }
+            response = session_close(request->session);
+            break;
+        case TFS_OP_OPEN:
+            response = !processOwnsSession(request, origin) ? TECNICOFS_ERROR_NO_OPEN_SESSION :
+                       session_open_file(request->session, args[0], request->mode);
+            break;
+        case TFS_OP_CLOSE:
+            response = !processOwnsSession(request, origin) ? TECNICOFS_ERROR_NO_OPEN_SESSION :
+                       session_close_file(request->session, request->fd);
             break;
-        case 'p':
-            if (numTokens != 2) 
-                return response;
-            response = print_tree(arg1);
+        case TFS_OP_SHARE: {
+            int memfd = __atomic_exchange_n(origin->passedFd, -1, __ATOMIC_ACQ_REL);
+            if (memfd < 0) {
+                response = TECNICOFS_ERROR_OTHER;
+            } else if (!processOwnsSession(request, origin)) {
+                close(memfd);
+                response = TECNICOFS_ERROR_NO_OPEN_SESSION;
+            } else {
+                response = session_share(request->session, memfd, request->dataLength);
+            }
+            break;
+        }
+        case TFS_OP_WRITE:
+        case TFS_OP_APPEND:
+        case TFS_OP_TRUNCATE:
+        case TFS_OP_READ_SHARED:
+        case TFS_OP_WRITE_SHARED:
+            response = processFileRequest(request, origin, NULL, 0);
             break;
     }
     return response;
 }
 
 /*
- * Receives command from the client socket and returns 0 if it is successful.
+ * Runs the entries of a batch in order and encodes the vector of their results.
+ * Entries that are not operations on the tree fail with TECNICOFS_ERROR_OTHER.
+ * Input:
+ * - batch: decoded batch request
+ * - message: message holding the entries
+ * - length: length of the message
+ * - response: buffer for the response, of at least TFS_MAX_MESSAGE bytes
+ * - origin: where the batch came from
+ * Returns: the length of the response
  */
-int receiveCommand(char *command, struct sockaddr_un *client_addr, socklen_t *clientlen) {
-    int msglen = recvfrom(serverfd, command, sizeof(char) * (MAX_INPUT_SIZE - 1), 0,
-                          (struct sockaddr *)client_addr, clientlen);
-    if (msglen > 0) {
-        command[msglen] = '\0';
+size_t processBatch(request_t *batch, char *message, size_t length, void *response, origin_t *origin) {
+    int32_t results[TFS_MAX_BATCH];
+    size_t offset = batch->batchOffset;
+    int malformed = 0;
+
+    for (int i = 0; i < batch->batchCount; i++) {
+        request_t entry;
+        /* entries after a malformed one cannot be found */
+        if (!malformed && decode_batch_entry(message, length, &offset, &entry) == FAIL) {
+            malformed = 1;
+        }
+        if (malformed) {
+            results[i] = FAIL;
+        } else if (!batchable_opcode(entry.opcode)) {
+            results[i] = TECNICOFS_ERROR_OTHER;
+        } else {
+            results[i] = processRequest(&entry, origin);
+        }
     }
 
-    return msglen <= 0;
+    return encode_batch_response(batch, results, response);
 }
 
 /*
- * Sends response to the client socket and returns 0 if it is successful.
+ * Reads from a file, placing the bytes read straight after the header
+ * of the response
+ * Input:
+ * - request: decoded read request
+ * - response: buffer for the response, of at least TFS_MAX_MESSAGE bytes
+ * - origin: where it came from
+ * Returns: the length of the response
  */
-int sendResponse(int response, struct sockaddr_un *client_addr, socklen_t clientlen) {
-    return sendto(serverfd, &response, sizeof(int), 0, (struct sockaddr *) client_addr, clientlen) <= 0;
+size_t processRead(request_t *request, void *response, origin_t *origin) {
+    uint32_t length = request->dataLength < TFS_MAX_READ ? request->dataLength : TFS_MAX_READ;
+    char *data = (char *) response + sizeof(tfs_response);
+
+    int result = processFileRequest(request, origin, data, length);
+    return encode_read_response(request, result, response);
 }
 
 /*
- * Receives commands, processes them and sends the responses to the client socket
+ * Decodes a message in either protocol, runs it on tecnicofs and encodes
+ * the response in the same protocol
+ * Input:
+ * - message: received message, followed by a '\0'
+ * - length: length of the message
+ * - response: buffer for the response, of at least TFS_MAX_MESSAGE bytes
+ * - origin: where the message came from
+ * Returns: the length of the response
  */
-void *threadFunction() {
-    while (1) {
-        struct sockaddr_un client_addr;
-        socklen_t clientlen = sizeof(struct sockaddr_un);
+size_t processCommand(char *message, size_t length, void *response, origin_t *origin) {
+    request_t request;
+    int result = FAIL;
 
-        char command[MAX_INPUT_SIZE];
-        if (receiveCommand(command, &client_addr, &clientlen)) {
-            printf("Error: failed to receive command\n");
-            continue;
+    size_t responseLength;
+
+    if (decode_request(message, length, &request) == FAIL) {
+        return encode_response(&request, result, response);
+    }
+
+    unsigned long long start = latency_now();
+    if (request.opcode == TFS_OP_BATCH) {
+        responseLength = processBatch(&request, message, length, response, origin);
+    } else if (request.opcode == TFS_OP_READ) {
+        responseLength = processRead(&request, response, origin);
+    } else {
+        result = processRequest(&request, origin);
+        responseLength = encode_response(&request, result, response);
+    }
+    latency_record(LATENCY_OPS + request.opcode, latency_now() - start);
+    return responseLength;
+}
+
+/*
+ * Takes an item answered on a shard back from its free ring, or else
+ * allocates one.
+ */
+void *reuse_dgram_item(dispatch_queue_t *ring, size_t size) {
+    void *item = dispatch_queue_pop(ring);
+    if (item == NULL && (item = malloc(size)) == NULL) {
+        fprintf(stderr, "Error: failed to allocate request\n");
+        exit(EXIT_FAILURE);
+    }
+    return item;
+}
+
+/*
+ * Gets a request to receive a datagram of a shard into.
+ */
+dgram_request_t *new_dgram_request(int shard) {
+    return reuse_dgram_item(&freeRequests[shard], sizeof(dgram_request_t));
+}
+
+/*
+ * Gets a batch to hand requests of a shard to a worker in.
+ */
+dgram_batch_t *new_dgram_batch(int shard) {
+    return reuse_dgram_item(&freeBatches[shard], sizeof(dgram_batch_t));
+}
+
+/*
+ * Gives an answered batch and its requests back to the receiver of their
+ * shard, freeing those its rings have no room for.
+ */
+void free_dgram_batch(dgram_batch_t *batch) {
+    int shard = batch->shard;
+
+    for (int i = 0; i < batch->count; i++) {
+        if (dispatch_queue_push(&freeRequests[shard], batch->requests[i])) {
+            free(batch->requests[i]);
         }
+    }
+    if (dispatch_queue_push(&freeBatches[shard], batch)) {
+        free(batch);
+    }
+}
+
+/*
+ * Receives commands from the client socket, waiting for the first one
+ * but not for the others, so a lone command is never delayed. The call
+ * blocks, so its time is not recorded: it would be mostly the time the
+ * socket was idle.
+ * Input:
+ * - serverfd: socket to receive from
+ * - requests: requests to receive into, one per command
+ * - count: length of requests
+ * Returns: the number of commands received, or 0 if it fails, with errno set
+ */
+int receiveCommands(int serverfd, dgram_request_t **requests, int count) {
+    struct mmsghdr msgs[MAX_RECEIVE_BATCH];
+    struct iovec iovecs[MAX_RECEIVE_BATCH];
+
+    for (int i = 0; i < count; i++) {
+        iovecs[i].iov_base = requests[i]->message;
+        iovecs[i].iov_len = sizeof(char) * TFS_MAX_MESSAGE;
+        memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_name = &requests[i]->client_addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = requests[i]->control;
+        msgs[i].msg_hdr.msg_controllen = sizeof(requests[i]->control);
+    }
 
-        int response = processCommand(command);
-        if (sendResponse(response, &client_addr, clientlen)) {
-            printf("Error: failed to send response\n");
+    int received = recvmmsg(serverfd, msgs, count, MSG_WAITFORONE | MSG_CMSG_CLOEXEC, NULL);
+    if (received <= 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < received; i++) {
+        requests[i]->clientlen = msgs[i].msg_hdr.msg_namelen;
+        requests[i]->length = msgs[i].msg_len;
+        requests[i]->message[msgs[i].msg_len] = '\0';
+        requests[i]->passedFd = received_fd(&msgs[i].msg_hdr);
+    }
+    return received;
+}
+
+/*
+ * Sends the responses of a batch to their clients.
+ * Returns: 0 if every response is sent
+ */
+int sendResponses(int serverfd, dgram_batch_t *batch) {
+    struct mmsghdr msgs[MAX_RECEIVE_BATCH];
+    struct iovec iovecs[MAX_RECEIVE_BATCH];
+    int failed = 0;
+
+    for (int i = 0; i < batch->count; i++) {
+        dgram_request_t *request = batch->requests[i];
+        iovecs[i].iov_base = request->response;
+        iovecs[i].iov_len = request->responseLength;
+        memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_name = &request->client_addr;
+        msgs[i].msg_hdr.msg_namelen = request->clientlen;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* a failed response stops the call, so skip it and send the rest */
+    for (int sent = 0; sent < batch->count;) {
+        unsigned long long start = latency_now();
+        int n = sendmmsg(serverfd, msgs + sent, batch->count - sent, 0);
+        latency_record(LATENCY_SEND, latency_now() - start);
+        if (n <= 0) {
+            failed = 1;
+            n = 1;
+        }
+        sent += n;
+    }
+    return failed;
+}
+
+/*
+ * Receives commands from a shard of the client socket and hands them to
+ * the workers of the shard. Commands that arrive together are split in
+ * batches among the workers of the shard.
+ */
+void *receiverFunction(void *arg) {
+    int shard = (int) (long) arg;
+    int workers = dispatch_group_size(shard);
+    dgram_request_t *requests[MAX_RECEIVE_BATCH];
+    /* microseconds to wait before receiving again after a failure */
+    useconds_t backoff = 0;
+
+    for (int i = 0; i < receiveBatch; i++) {
+        requests[i] = new_dgram_request(shard);
+    }
+
+    while (1) {
+        int received = receiveCommands(serverfds[shard], requests, receiveBatch);
+        if (received == 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: failed to receive command: %s\n", strerror(errno));
+            /* out of memory for now, anything else will not go away */
+            if (errno != ENOMEM && errno != ENOBUFS) {
+                exit(EXIT_FAILURE);
+            }
+            backoff = backoff == 0 ? RECEIVE_BACKOFF_MIN : backoff * 2;
+            if (backoff > RECEIVE_BACKOFF_MAX) {
+                backoff = RECEIVE_BACKOFF_MAX;
+            }
+            usleep(backoff);
             continue;
         }
+        backoff = 0;
+
+        int size = (received + workers - 1) / workers;
+        for (int first = 0; first < received; first += size) {
+            int count = received - first < size ? received - first : size;
+            dgram_batch_t *batch = new_dgram_batch(shard);
+            batch->shard = shard;
+            batch->count = count;
+            for (int i = 0; i < count; i++) {
+                batch->requests[i] = requests[first + i];
+                requests[first + i] = new_dgram_request(shard);
+            }
+            dispatch_submit(batch, shard);
+        }
     }
 
     return NULL;
 }
 
 /*
- * Creates the number of threads given
+ * Processes commands received from the client socket and sends the responses
  */
-void create_thread_pool(pthread_t *tid, int numberThreads) {
-    for(int i = 0; i < numberThreads; i++) {
-        if (pthread_create(&tid[i], NULL, threadFunction, NULL) != 0) {
-            fprintf(stderr, "Error: could not create thread\n");
-            exit(EXIT_FAILURE);
+void handleDgramRequest(void *item) {
+    dgram_batch_t *batch = item;
+
+    for (int i = 0; i < batch->count; i++) {
+        dgram_request_t *request = batch->requests[i];
+        origin_t origin = { NULL, &request->passedFd, &request->client_addr, request->clientlen };
+        request->responseLength = processCommand(request->message, request->length, request->response, &origin);
+        if (request->passedFd >= 0) {
+            close(request->passedFd);
         }
     }
+    /* the mutations are acknowledged once they are on disk */
+    wal_sync();
+    if (sendResponses(serverfds[batch->shard], batch)) {
+        printf("Error: failed to send response\n");
+    }
+
+    free_dgram_batch(batch);
 }
 
 /*
- * Wait for the all the threads
+ * Processes a request read from a stream connection and sends the
+ * response back on its connection
  */
-void wait_for_threads(pthread_t *tid, int numberThreads) {
-    for (int i = 0; i < numberThreads; i++) {
-        if (pthread_join(tid[i], NULL)) {
-            fprintf(stderr, "Error: error waiting for thread\n");
-            exit(EXIT_FAILURE);
-        }
+void handleStreamRequest(void *item) {
+    stream_request_t *request = item;
+
+    char response[TFS_MAX_MESSAGE];
+    origin_t origin = { &request->conn->session, &request->conn->passedFd, NULL, 0 };
+    size_t length = processCommand(request->message, request->length, response, &origin);
+    wal_sync();
+    if (stream_reply(request, response, length)) {
+        printf("Error: failed to send response\n");
+    }
+
+    stream_request_done(request);
+}
+
+/*
+ * Writes the path of a shard of the server socket to buffer, which must
+ * hold a socket path.
+ */
+void shard_path(char *buffer, char *path, int shard) {
+    size_t size = sizeof(((struct sockaddr_un *) NULL)->sun_path);
+    int n = shard == 0 ? snprintf(buffer, size, "%s", path) : snprintf(buffer, size, "%s-%d", path, shard);
+    if (n < 0 || (size_t) n >= size) {
+        fprintf(stderr, "Error: socket path too long\n");
+        exit(EXIT_FAILURE);
     }
 }
 
 /*
- * Initializes and binds the server socket
+ * Initializes and binds a shard of the server socket
  */
-void init_server(char *path) {
+void init_server(char *socketPath, int shard) {
     struct sockaddr_un server_addr;
     socklen_t addrlen;
+    char path[sizeof(server_addr.sun_path)];
 
-    serverfd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    shard_path(path, socketPath, shard);
+    int serverfd = serverfds[shard] = socket(AF_UNIX, SOCK_DGRAM, 0);
     if (serverfd < 0) {
         fprintf(stderr, "Error: server cannot open socket\n");
         exit(EXIT_FAILURE);
@@ -178,40 +643,176 @@ void init_server(char *path) {
     }
 }
 
+/*
+ * Prints the usage of the server and exits
+ */
+void display_usage(const char *appName) {
+    fprintf(stderr, "Usage: %s [-m dgram|stream] [-c cpulist] [-S shards] [-b batchsize] [-l logdir] [-i image] [-p top] numthreads socketname\n", appName);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Parses a comma separated list of cpus into workerCpus
+ */
+void parse_cpus(char *list) {
+    numberCpus = 0;
+    workerCpus = realloc(workerCpus, sizeof(int) * (strlen(list) / 2 + 1));
+    if (workerCpus == NULL) {
+        fprintf(stderr, "Error: failed to allocate cpu list\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (char *cpu = strtok(list, ","); cpu != NULL; cpu = strtok(NULL, ",")) {
+        char *end;
+        long value = strtol(cpu, &end, 10);
+        if (*end != '\0' || end == cpu || value < 0) {
+            numberCpus = 0;
+            return;
+        }
+        workerCpus[numberCpus++] = value;
+    }
+}
+
 /*
  * Validates the number of threads and the number of args 
+ * Parses the options, leaving optind at the first positional argument.
  */
 int parse_args(int argc, char* argv[]) {
-    if (argc != 3) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:c:S:b:l:i:p:")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "dgram") == 0) {
+                    serverMode = DGRAM_MODE;
+                } else if (strcmp(optarg, "stream") == 0) {
+                    serverMode = STREAM_MODE;
+                } else {
+                    fprintf(stderr, "Error: invalid mode %s\n", optarg);
+                    display_usage(argv[0]);
+                }
+                break;
+            case 'c':
+                parse_cpus(optarg);
+                if (numberCpus == 0) {
+                    fprintf(stderr, "Error: invalid cpu list %s\n", optarg);
+                    display_usage(argv[0]);
+                }
+                break;
+            case 'S':
+                numberShards = atoi(optarg);
+                if (numberShards < 1 || numberShards > TFS_MAX_SHARDS) {
+                    fprintf(stderr, "Error: shards must be between 1 and %d\n", TFS_MAX_SHARDS);
+                    display_usage(argv[0]);
+                }
+                break;
+            case 'b':
+                receiveBatch = atoi(optarg);
+                if (receiveBatch < 1 || receiveBatch > MAX_RECEIVE_BATCH) {
+                    fprintf(stderr, "Error: batch size must be between 1 and %d\n", MAX_RECEIVE_BATCH);
+                    display_usage(argv[0]);
+                }
+                break;
+            case 'l':
+                logDir = optarg;
+                break;
+            case 'i':
+                imagePath = optarg;
+                break;
+            case 'p':
+                profiledInodes = atoi(optarg);
+                if (profiledInodes < 1 || profiledInodes > MAX_PROFILED_INODES) {
+                    fprintf(stderr, "Error: profiled i-nodes must be between 1 and %d\n", MAX_PROFILED_INODES);
+                    display_usage(argv[0]);
+                }
+                break;
+            default:
+                display_usage(argv[0]);
+        }
+    }
+
+    /* the stream mode has a single socket */
+    if (serverMode == STREAM_MODE) {
+        numberShards = 1;
+    }
+
+    if (argc - optind != 2) {
         fprintf(stderr, "Error: wrong number of arguments\n");
-        exit(EXIT_FAILURE);
+        display_usage(argv[0]);
     }
 
     /* get number of threads */
-    int numberThreads = atoi(argv[1]);
+    int numberThreads = atoi(argv[optind]);
     if (numberThreads < 1) {
         fprintf(stderr, "Error: can't run less than one thread\n");
         exit(EXIT_FAILURE);
     }
+    if (numberThreads < numberShards) {
+        fprintf(stderr, "Error: each shard needs a thread\n");
+        exit(EXIT_FAILURE);
+    }
 
     return numberThreads;
 }
 
 int main(int argc, char* argv[]) {
     int numberThreads = parse_args(argc, argv);
+    char *socketPath = argv[optind + 1];
 
-    init_server(argv[2]);
-    init_fs(); 
+    if (imagePath == NULL) {
+        init_fs();
+    } else {
+        image_header_t header;
+        if (image_load(imagePath, &header) == FAIL) {
+            fprintf(stderr, "Error: could not open image %s\n", imagePath);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (logDir != NULL) {
+        wal_open(logDir);
+    }
+    if (profiledInodes > 0) {
+        profile_locks(profiledInodes);
+    }
 
-    /* create the thread pool */
-    pthread_t tid[numberThreads];
-    create_thread_pool(tid, numberThreads);
-    wait_for_threads(tid, numberThreads);
+    /* the receiving threads hand the requests to the workers */
+    pthread_t receiver;
+    if (serverMode == STREAM_MODE) {
+        stream_init(socketPath);
+        dispatch_init(numberThreads, 1, handleStreamRequest, workerCpus, numberCpus);
+        if (pthread_create(&receiver, NULL, stream_reactor, NULL) != 0) {
+            fprintf(stderr, "Error: could not create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        for (int i = 0; i < numberShards; i++) {
+            init_server(socketPath, i);
+            dispatch_queue_init(&freeRequests[i]);
+            dispatch_queue_init(&freeBatches[i]);
+        }
+        dispatch_init(numberThreads, numberShards, handleDgramRequest, workerCpus, numberCpus);
+        /* nothing else closes the sessions of clients that die */
+        if (pthread_create(&receiver, NULL, session_reaper, NULL) != 0) {
+            fprintf(stderr, "Error: could not create thread\n");
+            exit(EXIT_FAILURE);
+        }
+        for (long i = 0; i < numberShards; i++) {
+            if (pthread_create(&receiver, NULL, receiverFunction, (void *) i) != 0) {
+                fprintf(stderr, "Error: could not create thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    dispatch_wait();
 
+    wal_close();
     destroy_fs();
-    if (unlink(argv[2])) {
-        fprintf(stderr, "Error: cannot unlink socket path\n");
-        exit(EXIT_FAILURE);
+    for (int i = 0; i < numberShards; i++) {
+        char path[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+        shard_path(path, socketPath, i);
+        if (unlink(path)) {
+            fprintf(stderr, "Error: cannot unlink socket path\n");
+            exit(EXIT_FAILURE);
+        }
     }
     
     exit(EXIT_SUCCESS);
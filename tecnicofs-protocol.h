@@ -0,0 +1,120 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stdint.h>
+
+/* Largest message accepted, in a datagram or in a stream frame */
+#define TFS_MAX_MESSAGE 4096
+
+/*
+ * Stream connections carry a sequence of frames, each one a header
+ * followed by length bytes of message. A reply frame carries the id of
+ * the request it answers, so many requests can be in flight at once and
+ * be answered in any order.
+ */
+typedef struct tfs_frame_header {
+    uint32_t length;
+    uint32_t id;
+} tfs_frame_header;
+
+/*
+ * Binary protocol. Text commands ("c path f") start with a printable
+ * character, binary messages with TFS_MAGIC, so the server accepts both.
+ * Integers are in host byte order, as both ends share the machine.
+ */
+#define TFS_MAGIC 0xF5
+#define TFS_VERSION 1
+
+typedef enum tfs_opcode {
+    TFS_OP_CREATE = 1, /* path, node type ('f' or 'd') */
+    TFS_OP_DELETE,     /* path */
+    TFS_OP_LOOKUP,     /* path */
+    TFS_OP_MOVE,       /* from path, to path */
+    TFS_OP_PRINT,      /* output file path */
+    TFS_OP_STATS,      /* output file path */
+    TFS_OP_BATCH,      /* uint16_t count, then count entries */
+    TFS_OP_SHARDS,     /* no arguments, answered with the number of shards */
+    TFS_OP_OPEN,       /* path, mode (a permission), session */
+    TFS_OP_CLOSE,      /* session, descriptor */
+    TFS_OP_READ,       /* session, descriptor, uint64_t offset, uint32_t length */
+    TFS_OP_WRITE,      /* session, descriptor, uint64_t offset, uint32_t length, then the bytes */
+    TFS_OP_APPEND,     /* session, descriptor, uint32_t length, then the bytes */
+    TFS_OP_TRUNCATE,   /* session, descriptor, uint64_t size */
+    TFS_OP_MOUNT,      /* no arguments, answered with a new session */
+    TFS_OP_UNMOUNT,    /* session, whose files are closed */
+    TFS_OP_SHARE,      /* session, uint32_t size, with a memfd of that size passed along */
+    TFS_OP_READ_SHARED,  /* session, descriptor, uint64_t offset, uint32_t shared offset, uint32_t length */
+    TFS_OP_WRITE_SHARED, /* session, descriptor, uint64_t offset, uint32_t shared offset, uint32_t length */
+    TFS_OP_SNAPSHOT    /* image path */
+} tfs_opcode;
+
+/*
+ * Header of a binary request. It is followed by the arguments of the
+ * opcode: each path is a uint16_t length, counting the terminating '\0',
+ * and the bytes of the path including the '\0'; the node type and the mode
+ * are one byte, sessions and descriptors are int32_t. Each entry of a
+ * batch is the opcode, in one byte, followed by its arguments. The
+ * entries run in order; only operations on the tree are run, any other
+ * entry fails with TECNICOFS_ERROR_OTHER.
+ */
+typedef struct __attribute__((packed)) tfs_request_header {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t reserved;
+    uint32_t id;
+} tfs_request_header;
+
+typedef enum tfs_result_type {
+    TFS_RESULT_STATUS = 1, /* SUCCESS or an error code */
+    TFS_RESULT_INUMBER,    /* an i-number, or an error code if negative */
+    TFS_RESULT_VECTOR,     /* result is a count of int32_t results that follow */
+    TFS_RESULT_COUNT,      /* a count, or an error code if negative */
+    TFS_RESULT_DATA,       /* result is a count of bytes that follow, or an error code */
+    TFS_RESULT_HANDLE      /* a session or a descriptor, or an error code if negative */
+} tfs_result_type;
+
+/*
+ * Binary response, answering the request with the same id. The response
+ * to a batch is followed by the result of each entry, in order, and the
+ * response to a read by the bytes read.
+ */
+typedef struct __attribute__((packed)) tfs_response {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t resultType;
+    uint32_t id;
+    int32_t result;
+} tfs_response;
+
+/*
+ * A server may listen on several datagram sockets, or shards: the path
+ * it was started with and, for shard i > 0, that path followed by "-i".
+ * Any shard serves any request; clients spread them by path.
+ */
+#define TFS_MAX_SHARDS 64
+
+/*
+ * Files are open within a session, which a client opens when it mounts
+ * and whose files are closed when it unmounts or its stream connection
+ * closes. A descriptor is only valid in its session.
+ */
+#define TFS_MAX_OPEN_FILES 16
+
+/*
+ * A session may share memory with the server, a memfd sealed against
+ * shrinking and passed with SCM_RIGHTS. The shared reads and writes then
+ * carry only where their bytes are in it, and the server reads and writes
+ * the file straight from and into it.
+ */
+#define TFS_MAX_SHARED (64 << 20)
+
+/* Most bytes returned by a read, so that they fit in one message */
+#define TFS_MAX_READ (TFS_MAX_MESSAGE - sizeof(tfs_response))
+
+/* Most entries in a batch, so that its results fit in one message */
+#define TFS_MAX_BATCH ((TFS_MAX_MESSAGE - sizeof(tfs_response)) / sizeof(int32_t))
+
+#endif /* TECNICOFS_PROTOCOL_H */